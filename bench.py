@@ -0,0 +1,399 @@
+#!/usr/bin/env python3
+"""
+Measure key throughput and latency through a real device.
+
+Host mode streams a-z key taps over the serial link at a fixed rate and
+matches them against the boot keyboard reports read back from the HID
+interface, giving keys/s, p50/p99 latency (serial write -> HID report on the
+host) and drop/reorder counts. Device mode (firmware built with
+PUSBKB_HID_TEST=ON) asks the on-device generator for the same taps and only
+measures the USB side.
+
+Lock mode (firmware built with PUSBKB_HID_ACK=ON) taps Caps Lock and waits
+for the LED output report the host OS sends back, giving the round trip
+through the target OS (serial write -> LED ack frame) and the device-side
+part of it (IN report delivered -> LED report received).
+
+The host still sees the keystrokes: focus an empty editor window first. On
+Linux, read access to the hidraw node is needed; on macOS the terminal needs
+Input Monitoring permission. For meaningful latencies set the FTDI latency
+timer to 1 ms (Linux: /sys/bus/usb-serial/devices/ttyUSB0/latency_timer).
+
+Usage:
+  ./bench.py --port /dev/ttyUSB0 --rate 200 --count 2000
+  ./bench.py --port /dev/ttyUSB0 --hidraw /dev/hidraw3 --legacy
+  ./bench.py --port /dev/ttyUSB0 --device --pattern flood --count 5000
+  ./bench.py --port /dev/ttyUSB0 --link-baud 3000000 --rate 5000 --count 20000
+  ./bench.py --port /dev/ttyUSB0 --lock-rtt 100
+"""
+
+from __future__ import annotations
+
+import argparse
+import glob
+import os
+import struct
+import threading
+import time
+from pathlib import Path
+from typing import List, Optional, Sequence, Tuple
+
+from log_decode import (
+    FRAME_TYPE_BAUD,
+    FRAME_TYPE_HID_ACK,
+    HID_ACK_FORMAT,
+    FrameReader,
+    decode_latency_frame,
+    decode_stats_frame,
+    encode_frame,
+)
+
+
+USB_VID = 0x1915
+USB_PID = 0xEEEF
+HID_ITF_KEYBOARD = 0
+
+HID_KEY_A = 0x04
+HID_KEY_CAPS_LOCK = 0x39
+ALPHABET = 26
+
+PKT_TYPE_KEYBOARD = 0x00
+CMD_GET_STATS = 0x27
+CMD_GET_LATENCY = 0x28
+CMD_TEST_GEN = 0x29
+CMD_SET_BAUD = 0x2A
+CMD_GET_CREDITS = 0x20
+CMD_HID_ACK = 0x2D
+HID_ACK_LED = 0
+BAUD_SWITCHING = 0
+BAUD_CONFIRMED = 1
+FRAME_TYPE_TEST = 0x35
+PATTERNS = {"alphabet": 1, "flood": 2}
+
+
+class HidCapture:
+    """Reads keyboard reports in a thread, recording newly pressed keys."""
+
+    def __init__(self, path: Optional[str]) -> None:
+        self.presses: List[Tuple[float, int]] = []
+        self.reports = 0
+        self._stop = threading.Event()
+        self._read = self._open(path)
+        self._thread = threading.Thread(target=self._run, daemon=True)
+
+    def _open(self, path: Optional[str]):
+        if path is None:
+            path = find_hidraw()
+        if path is not None:
+            fd = os.open(path, os.O_RDONLY | os.O_NONBLOCK)
+            return lambda: _read_fd(fd)
+        try:
+            import hid  # type: ignore
+        except ImportError:
+            raise SystemExit(
+                "no hidraw node found; install hidapi (pip install hidapi) or pass --hidraw"
+            )
+        for info in hid.enumerate(USB_VID, USB_PID):
+            if info["interface_number"] == HID_ITF_KEYBOARD:
+                device = hid.device()
+                device.open_path(info["path"])
+                device.set_nonblocking(True)
+                return lambda: bytes(device.read(64))
+        raise SystemExit(f"keyboard interface of {USB_VID:04x}:{USB_PID:04x} not found")
+
+    def start(self) -> None:
+        self._thread.start()
+
+    def stop(self) -> None:
+        self._stop.set()
+        self._thread.join()
+
+    def _run(self) -> None:
+        held: set = set()
+        while not self._stop.is_set():
+            report = self._read()
+            if not report:
+                time.sleep(0.0002)
+                continue
+            now = time.perf_counter()
+            self.reports += 1
+            keys = boot_report_keys(report)
+            # Keys in slot order, so a batched report keeps the typed order.
+            for key in keys:
+                if key not in held:
+                    self.presses.append((now, key))
+            held = set(keys)
+
+
+def _read_fd(fd: int) -> bytes:
+    try:
+        return os.read(fd, 64)
+    except BlockingIOError:
+        return b""
+
+
+def find_hidraw() -> Optional[str]:
+    """Linux: the hidraw node of the boot keyboard interface."""
+    for node in sorted(glob.glob("/sys/class/hidraw/hidraw*")):
+        device = Path(node, "device")
+        try:
+            uevent = Path(device, "uevent").read_text()
+            itf = Path(device, "..", "bInterfaceNumber").resolve().read_text()
+        except OSError:
+            continue
+        if f"{USB_VID:08X}:{USB_PID:08X}" in uevent and int(itf, 16) == HID_ITF_KEYBOARD:
+            return "/dev/" + Path(node).name
+    return None
+
+
+def boot_report_keys(report: bytes) -> List[int]:
+    """Keycodes in a [modifier] [fn] [6 keys] report, skipping ErrorRollOver."""
+    return [key for key in report[2:8] if key > 0x03]
+
+
+def key_packet(code: int, legacy: bool) -> bytes:
+    body = bytes([PKT_TYPE_KEYBOARD, code, 0, 0, 0])
+    return body if legacy else encode_frame(body)
+
+
+def match_presses(
+    presses: Sequence[Tuple[float, int]], sent: Sequence[float], count: int
+) -> Tuple[List[float], int, int]:
+    """Matches received keys to the a-z sequence that was sent.
+
+    Returns per-key latencies (empty when `sent` is), the number of keys never
+    received and the number that arrived after a later one.
+    """
+    latencies: List[float] = []
+    skipped: List[int] = []
+    reordered = 0
+    pos = 0
+    for when, key in presses:
+        code = key - HID_KEY_A
+        if not 0 <= code < ALPHABET:
+            continue
+        late = next((i for i in skipped if i % ALPHABET == code), None)
+        if late is not None and (pos >= count or pos % ALPHABET != code):
+            skipped.remove(late)
+            reordered += 1
+            index = late
+        else:
+            # Next occurrence of this key in the sequence; anything in between
+            # is missing for now.
+            distance = (code - pos) % ALPHABET
+            if pos + distance >= count:
+                continue
+            skipped.extend(range(pos, pos + distance))
+            skipped = skipped[-ALPHABET:]
+            index = pos + distance
+            pos = index + 1
+        if sent:
+            latencies.append(when - sent[index])
+    return latencies, count - pos + len(skipped), reordered
+
+
+def percentile(values: Sequence[float], fraction: float) -> float:
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def query_device(port) -> None:
+    """Prints the device counters (and latency histograms, when built in)."""
+    port.reset_input_buffer()
+    port.write(encode_frame(bytes([CMD_GET_STATS])))
+    port.write(encode_frame(bytes([CMD_GET_LATENCY])))
+    read_frames(port, 0.5, print_device_frame)
+
+
+def print_device_frame(payload: bytes) -> bool:
+    line = decode_stats_frame(payload) or decode_latency_frame(payload)
+    if line is not None:
+        print("  " + line)
+    return False
+
+
+def read_frames(port, timeout: float, handle) -> None:
+    """Feeds device frames to `handle` until it returns True or time runs out."""
+    reader = FrameReader()
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        for kind, chunk in reader.feed(port.read(256)):
+            if kind == "frame" and handle(chunk):
+                return
+
+
+def switch_baud(port, baud: int) -> None:
+    """Moves the link to `baud` with the SET_BAUD handshake (see README)."""
+    results: List[int] = []
+
+    def baud_reply(payload: bytes) -> bool:
+        if payload[0] != FRAME_TYPE_BAUD or len(payload) < 6:
+            return False
+        results.append(payload[1])
+        return True
+
+    port.reset_input_buffer()
+    port.write(encode_frame(struct.pack("<BI", CMD_SET_BAUD, baud)))
+    read_frames(port, 1.0, baud_reply)
+    if not results:
+        raise SystemExit("no reply to SET_BAUD (firmware too old?)")
+    if results[0] == BAUD_CONFIRMED:
+        return
+    if results[0] != BAUD_SWITCHING:
+        raise SystemExit(f"device rejected {baud} baud")
+    port.baudrate = baud
+    port.reset_input_buffer()
+    results.clear()
+    # The device moves once its TX is drained; repeat until it answers.
+    for _ in range(15):
+        port.write(encode_frame(bytes([CMD_GET_CREDITS])))
+        read_frames(port, 0.05, baud_reply)
+        if results:
+            break
+    if results != [BAUD_CONFIRMED]:
+        raise SystemExit(f"switch to {baud} baud not confirmed")
+
+
+def run_lock_rtt(port, count: int) -> int:
+    """Caps Lock round trips; an even number, so the Lock state ends unchanged."""
+    count += count % 2
+    port.write(encode_frame(bytes([CMD_HID_ACK, 1 << HID_ACK_LED])))
+    port.reset_input_buffer()
+    round_trips: List[float] = []
+    turnarounds: List[float] = []
+    for _ in range(count):
+        acks: List[int] = []
+
+        def led_ack(payload: bytes) -> bool:
+            if payload[0] != FRAME_TYPE_HID_ACK or len(payload) < 17:
+                return False
+            fields = struct.unpack_from(HID_ACK_FORMAT, payload, 1)
+            if fields[0] != HID_ACK_LED:
+                return False
+            acks.append(fields[6])
+            return True
+
+        start = time.perf_counter()
+        port.write(key_packet(HID_KEY_CAPS_LOCK, legacy=False))
+        read_frames(port, 1.0, led_ack)
+        if acks:
+            round_trips.append(time.perf_counter() - start)
+            turnarounds.append(acks[0] / 1e6)
+        time.sleep(0.02)
+    port.write(encode_frame(bytes([CMD_HID_ACK, 0])))
+    missing = count - len(round_trips)
+    print(f"Caps Lock taps {count}, LED acks {len(round_trips)}, missing {missing}")
+    for name, values in (("round trip", round_trips), ("host turnaround", turnarounds)):
+        if values:
+            print(
+                f"{name} p50 {percentile(values, 0.50) * 1e3:.2f} ms, "
+                f"p99 {percentile(values, 0.99) * 1e3:.2f} ms, "
+                f"max {max(values) * 1e3:.2f} ms"
+            )
+    return 0 if missing == 0 else 1
+
+
+def run_host(port, args: argparse.Namespace) -> List[float]:
+    period = 1.0 / args.rate
+    sent: List[float] = []
+    start = time.perf_counter()
+    for index in range(args.count):
+        target = start + index * period
+        while time.perf_counter() < target:
+            pass
+        port.write(key_packet(HID_KEY_A + index % ALPHABET, args.legacy))
+        sent.append(time.perf_counter())
+    port.flush()
+    return sent
+
+
+def run_device(port, args: argparse.Namespace) -> None:
+    body = struct.pack("<BBHI", CMD_TEST_GEN, PATTERNS[args.pattern], args.rate, args.count)
+    port.write(encode_frame(body))
+
+    def done(payload: bytes) -> bool:
+        if payload[0] != FRAME_TYPE_TEST or len(payload) < 10:
+            return False
+        taps, elapsed_us = struct.unpack_from("<II", payload, 2)
+        rate = taps / (elapsed_us / 1e6) if elapsed_us else 0.0
+        print(f"device generated {taps} taps in {elapsed_us / 1e3:.1f} ms ({rate:.0f}/s)")
+        return True
+
+    read_frames(port, args.count / max(args.rate, 1) + 10, done)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Benchmark PicoUSBKeyBridge.")
+    parser.add_argument("--port", required=True, help="Serial port of the UART link.")
+    parser.add_argument("--baud", type=int, default=115200, help="Serial baud rate.")
+    parser.add_argument(
+        "--link-baud", type=int, help="Switch the link to this baud rate first (SET_BAUD)."
+    )
+    parser.add_argument("--hidraw", help="hidraw node of the boot keyboard (default: search).")
+    parser.add_argument("--rate", type=int, default=100, help="Taps per second (default: 100).")
+    parser.add_argument("--count", type=int, default=1000, help="Taps to send (default: 1000).")
+    parser.add_argument(
+        "--legacy", action="store_true", help="Send 5-byte packets instead of v2 frames."
+    )
+    parser.add_argument(
+        "--device", action="store_true", help="Use the on-device generator (PUSBKB_HID_TEST)."
+    )
+    parser.add_argument(
+        "--pattern", choices=sorted(PATTERNS), default="alphabet", help="Device generator pattern."
+    )
+    parser.add_argument(
+        "--lock-rtt",
+        type=int,
+        metavar="COUNT",
+        help="Measure Caps Lock round trips through the host OS instead (PUSBKB_HID_ACK).",
+    )
+    parser.add_argument(
+        "--settle", type=float, default=1.0, help="Seconds to wait for the last reports."
+    )
+    args = parser.parse_args()
+    if not 1 <= args.rate <= 65535 or args.count < 1:
+        parser.error("--rate must be 1-65535 and --count positive")
+
+    try:
+        import serial  # type: ignore
+    except ImportError:
+        raise SystemExit("pyserial is required (pip install pyserial)")
+    port = serial.Serial(args.port, args.baud, timeout=0.05)
+    if args.link_baud:
+        switch_baud(port, args.link_baud)
+        print(f"link at {args.link_baud} baud")
+    if args.lock_rtt:
+        return run_lock_rtt(port, args.lock_rtt)
+
+    capture = HidCapture(args.hidraw)
+    capture.start()
+    sent: List[float] = []
+    if args.device:
+        run_device(port, args)
+    else:
+        sent = run_host(port, args)
+    time.sleep(args.settle)
+    capture.stop()
+
+    presses = capture.presses
+    latencies, dropped, reordered = match_presses(presses, sent, args.count)
+    received = args.count - dropped
+    print(f"sent {args.count}, received {received}, dropped {dropped}, reordered {reordered}")
+    print(f"HID reports {capture.reports}")
+    if len(presses) >= 2:
+        span = presses[-1][0] - presses[0][0]
+        if span > 0:
+            print(f"throughput {(len(presses) - 1) / span:.1f} keys/s")
+    if latencies:
+        print(
+            f"latency p50 {percentile(latencies, 0.50) * 1e3:.2f} ms, "
+            f"p99 {percentile(latencies, 0.99) * 1e3:.2f} ms, "
+            f"max {max(latencies) * 1e3:.2f} ms"
+        )
+    print("device:")
+    query_device(port)
+    return 0 if dropped == 0 and reordered == 0 else 1
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
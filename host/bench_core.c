@@ -0,0 +1,273 @@
+/*
+ * Microbenchmarks for the portable core, in the spirit of Google Benchmark:
+ * each case runs for a growing number of iterations until it takes at least
+ * BENCH_MIN_TIME_NS, then reports time per iteration and a throughput
+ * counter. Pass a substring to run only the matching cases.
+ *
+ * The times are for the host CPU; compare runs against each other rather than
+ * against the firmware budget.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame.h"
+#include "hid_sched.h"
+#include "hid_reports.h"
+#include "host.h"
+#include "key_queue.h"
+#include "uart_parser.h"
+
+#define BENCH_MIN_TIME_NS 200000000ull
+#define BENCH_TAPS 64
+
+static key_event_t bench_queue_storage[PUSBKB_QUEUE_LEN];
+static key_queue_t bench_queue = KEY_QUEUE_INIT(bench_queue_storage);
+#if PUSBKB_HID_AUX_QUEUE
+static key_event_t bench_aux_queue_storage[PUSBKB_AUX_QUEUE_LEN];
+static key_queue_t bench_aux_queue = KEY_QUEUE_INIT(bench_aux_queue_storage);
+#endif
+static uart_parser_t bench_parser;
+// Parser-only cases count events instead of queueing them.
+static bool bench_use_queue = false;
+static uint32_t bench_events = 0;
+
+bool uart_parser_event_cb(uart_parser_t *parser, const key_event_t *event) {
+  (void)parser;
+  bench_events++;
+  return !bench_use_queue ||
+         hid_sched_push(event);
+}
+
+bool uart_parser_space_cb(uart_parser_t *parser, uint8_t type) {
+  (void)parser;
+  return !bench_use_queue ||
+         key_queue_free_space(hid_sched_queue(type)) != 0;
+}
+
+void uart_parser_command_cb(uart_parser_t *parser, const uint8_t *payload,
+                            uint8_t len) {
+  (void)parser;
+  (void)payload;
+  (void)len;
+}
+
+// Input streams, built once.
+static uint8_t bench_legacy[BENCH_TAPS * 5];
+static uint8_t bench_frames[BENCH_TAPS * 10];
+static size_t bench_frames_len;
+static uint8_t bench_text[PUSBKB_FRAME_MAX_PAYLOAD + 5];
+static size_t bench_text_len;
+
+static void bench_build_inputs(void) {
+  for (size_t i = 0; i < BENCH_TAPS; i++) {
+    uint8_t packet[5] = {PUSBKB_PKT_TYPE_KEYBOARD,
+                         (uint8_t)(PUSBKB_KEY_A + i % 26), 0, 0, 0};
+    memcpy(&bench_legacy[i * 5], packet, sizeof(packet));
+    bench_frames_len += frame_encode(&bench_frames[bench_frames_len],
+                                     sizeof(bench_frames) - bench_frames_len,
+                                     packet, sizeof(packet));
+  }
+  uint8_t text[1 + BENCH_TAPS];
+  text[0] = PUSBKB_PKT_TYPE_TEXT;
+  for (size_t i = 0; i < BENCH_TAPS; i++) {
+    text[1 + i] = (uint8_t)("The quick brown fox jumps over the lazy dog. "[i % 45]);
+  }
+  bench_text_len = frame_encode(bench_text, sizeof(bench_text), text,
+                                sizeof(text));
+}
+
+static void bench_drain(void) {
+  // The fake endpoints are always ready, so this only stops once idle.
+  while (hid_sched_task()) {
+  }
+}
+
+// Each case runs `iterations` times and returns the bytes or items it
+// processed (the counter named in the table).
+typedef uint64_t (*bench_fn_t)(uint64_t iterations);
+
+static uint64_t bm_parse_legacy(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    uart_parse_bytes(&bench_parser, bench_legacy, sizeof(bench_legacy));
+  }
+  return iterations * sizeof(bench_legacy);
+}
+
+static uint64_t bm_parse_frames(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    uart_parse_bytes(&bench_parser, bench_frames, (uint32_t)bench_frames_len);
+  }
+  return iterations * bench_frames_len;
+}
+
+static uint64_t bm_parse_frames_bytewise(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    for (size_t j = 0; j < bench_frames_len; j++) {
+      uart_parse_bytes(&bench_parser, &bench_frames[j], 1);
+    }
+  }
+  return iterations * bench_frames_len;
+}
+
+static uint64_t bm_parse_text(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    uart_parse_bytes(&bench_parser, bench_text, (uint32_t)bench_text_len);
+  }
+  return iterations * bench_text_len;
+}
+
+static uint64_t bm_frame_crc16(uint64_t iterations) {
+  uint16_t crc = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    crc ^= frame_crc16(0xFFFF, bench_frames, bench_frames_len);
+  }
+  __asm__ volatile("" : : "r"(crc));
+  return iterations * bench_frames_len;
+}
+
+static void bench_push(const key_event_t *event) {
+  if (!hid_sched_push(event)) {
+    bench_drain();
+    hid_sched_push(event);
+  }
+}
+
+static uint64_t bm_sched_taps(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    for (uint32_t j = 0; j < BENCH_TAPS; j++) {
+      key_event_t event = {
+        .code = (uint16_t)(PUSBKB_KEY_A + j % 26),
+        .type = PUSBKB_PKT_TYPE_KEYBOARD,
+      };
+      bench_push(&event);
+    }
+    bench_drain();
+  }
+  return iterations * BENCH_TAPS;
+}
+
+// Keyboard taps with a media key every fourth event.
+static uint64_t bm_sched_mixed(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    for (uint32_t j = 0; j < BENCH_TAPS; j++) {
+      key_event_t event = {
+        .code = (uint16_t)(PUSBKB_KEY_A + j % 26),
+        .type = PUSBKB_PKT_TYPE_KEYBOARD,
+      };
+      if (j % 4 == 3) {
+        event.code = (uint16_t)(j % 8 == 3 ? 0x00E9 : 0x00EA); // Volume +/-
+        event.type = PUSBKB_PKT_TYPE_CONSUMER;
+      }
+      bench_push(&event);
+    }
+    bench_drain();
+  }
+  return iterations * BENCH_TAPS;
+}
+
+#if PUSBKB_HID_POINTER
+// A stream of small relative moves, queued faster than the endpoint takes
+// them; the scheduler merges what is queued into one report per IN transfer.
+static uint64_t bm_sched_moves(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    for (uint32_t j = 0; j < BENCH_TAPS; j++) {
+      key_event_t event = {
+        .code = (uint16_t)(0x0101 * (1 + j % 3)), // dx = dy = 1..3
+        .type = PUSBKB_PKT_TYPE_MOUSE,
+      };
+      bench_push(&event);
+    }
+    bench_drain();
+  }
+  return iterations * BENCH_TAPS;
+}
+#endif
+
+static uint64_t bm_pipeline_frames(uint64_t iterations) {
+  for (uint64_t i = 0; i < iterations; i++) {
+    // v2 frames wait for queue space, so a short queue takes several passes.
+    size_t pos = 0;
+    while (pos < bench_frames_len) {
+      pos += uart_parse_bytes(&bench_parser, &bench_frames[pos],
+                              (uint32_t)(bench_frames_len - pos));
+      bench_drain();
+    }
+  }
+  return iterations * BENCH_TAPS;
+}
+
+typedef struct {
+  const char *name;
+  bench_fn_t fn;
+  bool use_queue;
+  const char *counter; // "bytes" or "items"
+} bench_case_t;
+
+static const bench_case_t bench_cases[] = {
+  {"BM_ParseLegacy", bm_parse_legacy, false, "bytes"},
+  {"BM_ParseFrames", bm_parse_frames, false, "bytes"},
+  {"BM_ParseFramesBytewise", bm_parse_frames_bytewise, false, "bytes"},
+  {"BM_ParseText", bm_parse_text, false, "bytes"},
+  {"BM_FrameCrc16", bm_frame_crc16, false, "bytes"},
+  {"BM_SchedulerTaps", bm_sched_taps, true, "items"},
+  {"BM_SchedulerMixed", bm_sched_mixed, true, "items"},
+#if PUSBKB_HID_POINTER
+  {"BM_SchedulerMoves", bm_sched_moves, true, "items"},
+#endif
+  {"BM_PipelineFrames", bm_pipeline_frames, true, "items"},
+};
+
+static uint64_t bench_clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void bench_run(const bench_case_t *bench) {
+  bench_use_queue = bench->use_queue;
+  uint64_t iterations = 1;
+  while (true) {
+    uint64_t wall = bench_clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    uint64_t processed = bench->fn(iterations);
+    wall = bench_clock_ns(CLOCK_MONOTONIC) - wall;
+    cpu = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    if (wall >= BENCH_MIN_TIME_NS || iterations >= (1ull << 40)) {
+      double rate = (double)processed / ((double)cpu / 1e9);
+      const char *unit = strcmp(bench->counter, "bytes") == 0 ? "B/s" : "/s";
+      printf("%-24s %10.0f ns %10.0f ns %12llu %s_per_second=%.3gM%s\n",
+             bench->name, (double)wall / (double)iterations,
+             (double)cpu / (double)iterations,
+             (unsigned long long)iterations, bench->counter, rate / 1e6, unit);
+      return;
+    }
+    // Aim past the minimum time, like Google Benchmark's iteration estimate.
+    uint64_t next = (wall == 0) ? iterations * 10
+                                : iterations * BENCH_MIN_TIME_NS * 14 / 10 / wall;
+    iterations = (next > iterations * 10) ? iterations * 10
+                 : (next <= iterations)   ? iterations + 1
+                                          : next;
+  }
+}
+
+int main(int argc, char **argv) {
+  const char *filter = (argc > 1) ? argv[1] : NULL;
+  bench_build_inputs();
+  uart_parser_init(&bench_parser, false);
+  hid_sched_init(&bench_queue);
+#if PUSBKB_HID_AUX_QUEUE
+  hid_sched_init_aux(&bench_aux_queue);
+#endif
+  printf("%-24s %13s %13s %12s\n", "Benchmark", "Time", "CPU", "Iterations");
+  printf("-----------------------------------------------------------------"
+         "-------------\n");
+  for (size_t i = 0; i < sizeof(bench_cases) / sizeof(bench_cases[0]); i++) {
+    if (filter == NULL || strstr(bench_cases[i].name, filter) != NULL) {
+      bench_run(&bench_cases[i]);
+    }
+  }
+  fprintf(stderr, "%u events, %u reports\n", bench_events, host_hid_reports);
+  return 0;
+}
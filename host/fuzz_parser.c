@@ -0,0 +1,264 @@
+/*
+ * Fuzz harness for the UART parser and the HID scheduler behind it.
+ *
+ * Built with clang and PUSBKB_HOST_FUZZ=ON this is a libFuzzer target
+ * (./fuzz_parser corpus/). Otherwise a small driver replays the files given on
+ * the command line, or a batch of pseudo-random inputs when there are none, so
+ * the harness still runs under plain gcc (with sanitizers if available).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+#include "hid_sched.h"
+#include "hid_reports.h"
+#include "host.h"
+#include "key_queue.h"
+#include "uart_parser.h"
+
+static key_event_t fuzz_queue_storage[PUSBKB_QUEUE_LEN];
+static key_queue_t fuzz_queue = KEY_QUEUE_INIT(fuzz_queue_storage);
+#if PUSBKB_HID_AUX_QUEUE
+static key_event_t fuzz_aux_queue_storage[PUSBKB_AUX_QUEUE_LEN];
+static key_queue_t fuzz_aux_queue = KEY_QUEUE_INIT(fuzz_aux_queue_storage);
+#endif
+static uart_parser_t fuzz_parser;
+// Events the parser handed over during the current run.
+static uint32_t fuzz_events;
+
+static size_t fuzz_queued(void) {
+#if PUSBKB_HID_AUX_QUEUE
+  return key_queue_used(&fuzz_queue) + key_queue_used(&fuzz_aux_queue);
+#else
+  return key_queue_used(&fuzz_queue);
+#endif
+}
+
+static void fuzz_check(bool ok, const char *what);
+
+bool uart_parser_event_cb(uart_parser_t *parser, const key_event_t *event) {
+  fuzz_check(!parser->frames_only || parser->rx_mode == RX_MODE_FRAME,
+             "frames-only parser queues events from frames only");
+  fuzz_events++;
+  return hid_sched_push(event);
+}
+
+bool uart_parser_space_cb(uart_parser_t *parser, uint8_t type) {
+  (void)parser;
+  return key_queue_free_space(hid_sched_queue(type)) != 0;
+}
+
+// Credit requests stand in for the macro play command, which holds back the
+// rest of the input.
+void uart_parser_command_cb(uart_parser_t *parser, const uint8_t *payload,
+                            uint8_t len) {
+  (void)len;
+  if (payload[0] == PUSBKB_FRAME_CMD_GET_CREDIT) {
+    parser->stop = true;
+  }
+}
+
+static void fuzz_check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "invariant failed: %s\n", what);
+    abort();
+  }
+}
+
+// Runs the scheduler until the queues are empty, jumping the clock over timed
+// event delays.
+static void fuzz_drain(void) {
+  key_event_t head;
+  host_hid_ready = true;
+  for (int i = 0; i < 4 * (PUSBKB_QUEUE_LEN + PUSBKB_AUX_QUEUE_LEN) + 8; i++) {
+#if PUSBKB_TIMED_EVENTS
+    if (key_queue_peek(&fuzz_queue, 0, &head)) {
+      host_time_us += head.delay_us;
+    }
+#if PUSBKB_HID_AUX_QUEUE
+    if (key_queue_peek(&fuzz_aux_queue, 0, &head)) {
+      host_time_us += head.delay_us;
+    }
+#endif
+#else
+    (void)head;
+#endif
+    host_time_us += 1000;
+    hid_sched_task();
+    hid_sched_report_complete(PUSBKB_HID_ITF_KEYBOARD);
+    hid_sched_report_complete(PUSBKB_HID_ITF_AUX);
+  }
+  fuzz_check(fuzz_queued() == 0, "scheduler drains the queues");
+}
+
+static void fuzz_run(uint8_t control, const uint8_t *data, size_t size,
+                     bool frames_only) {
+  // Nothing carries over from the previous input, so a saved crash input
+  // reproduces on its own.
+  host_time_us = 0;
+  fuzz_queue = (key_queue_t)KEY_QUEUE_INIT(fuzz_queue_storage);
+#if PUSBKB_HID_AUX_QUEUE
+  fuzz_aux_queue = (key_queue_t)KEY_QUEUE_INIT(fuzz_aux_queue_storage);
+#endif
+  uart_parser_init(&fuzz_parser, (control & 0x01) != 0);
+  fuzz_parser.frames_only = frames_only;
+  fuzz_events = 0;
+#if PUSBKB_MULTIDROP
+  fuzz_parser.addressed_only = (control & 0x40) != 0;
+  fuzz_parser.address = (control >> 7) & 0x01;
+#endif
+  hid_sched_init(&fuzz_queue);
+#if PUSBKB_HID_AUX_QUEUE
+  hid_sched_init_aux(&fuzz_aux_queue);
+#endif
+
+  size_t pos = 0;
+  uint32_t stalls = 0;
+  uint32_t chunk_seed = (control >> 1) & 0x07;
+  while (pos < size) {
+    uint32_t chunk = 1 + (chunk_seed * 7 + (uint32_t)pos) % 64;
+    if (chunk > size - pos) {
+      chunk = (uint32_t)(size - pos);
+    }
+    uint32_t used_before = (uint32_t)fuzz_queued();
+    uint32_t consumed = uart_parse_bytes(&fuzz_parser, &data[pos], chunk);
+    fuzz_check(consumed <= chunk, "consumed within the chunk");
+    fuzz_check(key_queue_used(&fuzz_queue) <= PUSBKB_QUEUE_LEN,
+               "queue within capacity");
+#if PUSBKB_HID_AUX_QUEUE
+    fuzz_check(key_queue_used(&fuzz_aux_queue) <= PUSBKB_AUX_QUEUE_LEN,
+               "aux queue within capacity");
+    fuzz_check(fuzz_parser.dropped_queue_aux <= fuzz_parser.dropped_queue,
+               "aux drops are part of the drops");
+#endif
+    fuzz_check(fuzz_parser.frame_pos <= sizeof(fuzz_parser.frame_buf),
+               "frame within its buffer");
+    pos += consumed;
+
+    host_hid_ready = (control & 0x10) == 0;
+    host_time_us += 100;
+    hid_sched_task();
+    if ((control & 0x20) != 0) {
+      host_time_us += UART_PARSER_TIMEOUT_US + 1;
+      uart_parser_check_timeout(&fuzz_parser);
+    }
+
+    if (consumed < chunk) {
+      // Queue full (or a held-back command): drain and go on. Each drain frees
+      // the whole queue, so the parser has to move forward eventually.
+      stalls = (consumed == 0 && used_before == fuzz_queued())
+                   ? stalls + 1
+                   : 0;
+      fuzz_check(stalls < 64, "parser makes progress");
+      fuzz_drain();
+    }
+  }
+  fuzz_drain();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (size < 2) {
+    return 0;
+  }
+  // First byte: bit 0 = wait for queue space, bits 1-3 = chunk length seed,
+  // bit 4 = busy endpoint while parsing, bit 5 = let the parser time out,
+  // bit 6 = addressed frames only, bit 7 = address 1 instead of 0.
+  uint8_t control = data[0];
+  data++;
+  size--;
+  fuzz_run(control, data, size, false);
+  // Again as while the baud rate is not settled: without a sync byte there is
+  // no frame, so nothing may come out.
+  fuzz_run(control, data, size, true);
+  fuzz_check(fuzz_events == 0 || memchr(data, PUSBKB_FRAME_SYNC, size) != NULL,
+             "frames-only parser skips legacy packets");
+  return 0;
+}
+
+#ifndef PUSBKB_LIBFUZZER
+static int fuzz_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return 1;
+  }
+  static uint8_t buf[1 << 16];
+  size_t len = fread(buf, 1, sizeof(buf), file);
+  fclose(file);
+  LLVMFuzzerTestOneInput(buf, len);
+  return 0;
+}
+
+// Random inputs biased towards valid packets and frames, so the generator
+// reaches past the framing checks without a corpus.
+static size_t fuzz_generate(uint8_t *out, size_t out_size, uint32_t *seed) {
+  size_t len = 0;
+  out[len++] = (uint8_t)(*seed >> 24);
+  while (len + PUSBKB_FRAME_MAX_PAYLOAD + 8 < out_size) {
+    *seed = *seed * 1103515245u + 12345u;
+    uint32_t r = *seed >> 8;
+    if ((r & 0xF) == 0) {
+      break;
+    }
+    uint8_t payload[PUSBKB_FRAME_MAX_PAYLOAD];
+    uint8_t payload_len = (uint8_t)(1 + (r >> 4) % 12);
+    payload[0] = (uint8_t)(r >> 12);
+    for (uint8_t i = 1; i < payload_len; i++) {
+      *seed = *seed * 1103515245u + 12345u;
+      payload[i] = (uint8_t)(*seed >> 16);
+    }
+    switch ((r >> 20) % 4) {
+      case 0:
+        len += frame_encode(&out[len], out_size - len, payload, payload_len);
+        break;
+      case 1:
+        payload[0] &= PUSBKB_PKT_FLAG_RELEASE | 0x01;
+        memcpy(&out[len], payload, 5);
+        len += 5;
+        break;
+      case 2:
+        payload[0] = (uint8_t)(payload[0] & (PUSBKB_PKT_FLAG_RELEASE |
+                                             PUSBKB_PKT_FLAG_TIMED | 0x07));
+#if PUSBKB_MULTIDROP
+        if ((r & 0x20) != 0 && payload_len > 2) {
+          // Addressed to board 0, board 1 or everyone.
+          memmove(&payload[2], payload, (size_t)payload_len - 2);
+          payload[0] = PUSBKB_FRAME_ADDRESSED;
+          payload[1] = ((r >> 6) & 0x03) == 3 ? PUSBKB_ADDRESS_BROADCAST
+                                              : (uint8_t)((r >> 6) & 0x01);
+        }
+#endif
+        len += frame_encode(&out[len], out_size - len, payload, payload_len);
+        if ((r & 0x10) != 0 && len > 2) {
+          out[len - 2] ^= 0x40; // corrupt the CRC
+        }
+        break;
+      default:
+        memcpy(&out[len], payload, payload_len);
+        len += payload_len;
+        break;
+    }
+  }
+  return len;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    int rc = 0;
+    for (int i = 1; i < argc; i++) {
+      rc |= fuzz_file(argv[i]);
+    }
+    return rc;
+  }
+  static uint8_t buf[4096];
+  uint32_t seed = 1;
+  for (int run = 0; run < 20000; run++) {
+    size_t len = fuzz_generate(buf, sizeof(buf), &seed);
+    LLVMFuzzerTestOneInput(buf, len);
+  }
+  printf("fuzz_parser: 20000 generated inputs ok\n");
+  return 0;
+}
+#endif
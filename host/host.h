@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Knobs of the host HAL (hal_host.c) shared by the benchmark and the fuzzer.
+
+// What pusbkb_hal_time_us() returns; advanced by the caller.
+extern uint64_t host_time_us;
+// pusbkb_hal_hid_ready() answer for every interface.
+extern bool host_hid_ready;
+// Reports accepted by pusbkb_hal_hid_report().
+extern uint32_t host_hid_reports;
@@ -0,0 +1,34 @@
+/*
+ * Log sink for host builds: the core only calls these on rare paths, and
+ * printing would dominate both the benchmark and the fuzzer.
+ */
+
+#include "log.h"
+
+void log_write_line(const char *level, const char *format, ...) {
+  (void)level;
+  (void)format;
+}
+
+#if PUSBKB_LOG_DEFERRED
+void log_write_deferred(const char *level, uint32_t nargs,
+                        const char *format, ...) {
+  (void)level;
+  (void)nargs;
+  (void)format;
+}
+#endif
+
+#if PUSBKB_LOG_BINARY
+void log_write_binary(log_level_t level, uint32_t nargs,
+                      const char *format, ...) {
+  (void)level;
+  (void)nargs;
+  (void)format;
+}
+#endif
+
+void log_write_frame(const uint8_t *payload, uint8_t len) {
+  (void)payload;
+  (void)len;
+}
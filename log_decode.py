@@ -0,0 +1,392 @@
+#!/usr/bin/env python3
+"""
+Decode the firmware UART TX stream, expanding binary log frames using the ELF.
+
+Firmware built with PUSBKB_LOG_BINARY=ON sends each LOG_* call as a frame
+carrying the format string address and raw arguments instead of text. Plain
+text (TinyUSB debug output, drop markers) passes through unchanged.
+
+Usage:
+  ./log_decode.py --port /dev/ttyUSB0
+  ./log_decode.py --port /dev/ttyUSB0 --baud 115200 --elf build/PicoUSBKeyBridge.elf
+  ./log_decode.py --input capture.bin
+"""
+
+from __future__ import annotations
+
+import argparse
+import re
+import struct
+import sys
+from pathlib import Path
+from typing import BinaryIO, Iterator, List, Optional, Tuple, Union
+
+
+FRAME_SYNC = 0xA5
+FRAME_TYPE_LOG = 0x30
+FRAME_TYPE_CREDIT = 0x31
+# Per queue: free, capacity, consumed, discarded (keyboard, then aux if present).
+CREDIT_FORMAT = "<HHII"
+CREDIT_QUEUES = ("kb", "aux")
+FRAME_TYPE_STATS = 0x33
+# pusbkb_stats_t in src/stats.h by version; later versions only append.
+STATS_FORMATS = {
+    1: "<B3x10IHH8I",
+    2: "<B3x10IHH8IB3xII",
+    3: "<B3x10IHH8IB3xIII",
+}
+STATS_FIELDS = (
+    "version",
+    "uptime_ms",
+    "rx_bytes",
+    "packets",
+    "framing_errors",
+    "frame_crc_errors",
+    "rx_timeouts",
+    "rx_ring_overflows",
+    "rx_hw_overruns",
+    "queue_dropped",
+    "text_chars_skipped",
+    "queue_high_water",
+    "queue_capacity",
+    "reports_keyboard",
+    "reports_aux",
+    "reports_saved",
+    "hid_busy",
+    "core0_loop_max_us",
+    "core1_loop_max_us",
+    "watchdog_margin_ms",
+    "log_dropped",
+    "reset_cause",
+    "boot_count",
+    "reset_uptime_ms",
+    "ack_dropped",
+)
+# pusbkb_reset_cause_t in src/stats.h.
+RESET_CAUSES = ("power on", "core0 stall", "core1 stall", "software")
+FRAME_TYPE_LATENCY = 0x34
+# pusbkb_latency_stage_t in src/stats.h.
+LATENCY_STAGES = ("parse", "queue", "submit", "usb", "total")
+FRAME_TYPE_BAUD = 0x36
+# pusbkb_baud_result_t in src/frame.h.
+BAUD_RESULTS = ("switching", "confirmed", "reverted", "rejected")
+FRAME_TYPE_ADDRESS = 0x37
+ADDRESS_RESULTS = ("ok", "invalid", "flash error")
+FRAME_TYPE_CONFIG = 0x39
+# pusbkb_config_result_t in src/frame.h, PUSBKB_CONFIG_MODE_* in src/config.h.
+CONFIG_RESULTS = ("ok", "invalid", "flash error")
+CONFIG_MODES = ("default", "boot", "nkro")
+FRAME_TYPE_HID_ACK = 0x38
+# pusbkb_hid_ack_t in src/stats.h.
+HID_ACK_FORMAT = "<BBBBIII"
+HID_ACK_KINDS = ("led", "in")
+# Multidrop: [0x10] [address] [payload] (src/frame.h).
+FRAME_ADDRESSED = 0x10
+ADDRESS_BROADCAST = 0xFF
+LOG_LEVELS = ("DEBUG", "INFO", "WARN", "ERROR")
+
+SHF_ALLOC = 0x2
+SHT_PROGBITS = 1
+
+FORMAT_RE = re.compile(
+    r"%(?P<flags>[-+ #0]*)(?P<width>\d+)?(?:\.(?P<prec>\d+))?"
+    r"(?P<length>hh|h|ll|l|j|z|t)?(?P<conv>[diouxXcsp%])"
+)
+
+
+def crc16(data: bytes, crc: int = 0xFFFF) -> int:
+    """CRC-16/CCITT-FALSE, matching frame_crc16() in src/frame.c."""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def encode_frame(payload: bytes) -> bytes:
+    if len(payload) > 255:
+        raise ValueError("frame payload too long")
+    body = bytes([len(payload)]) + payload
+    return bytes([FRAME_SYNC]) + body + struct.pack("<H", crc16(body))
+
+
+class FrameReader:
+    """Splits a byte stream into ("text", bytes) and ("frame", payload) items."""
+
+    def __init__(self) -> None:
+        self.buffer = bytearray()
+
+    def feed(self, data: bytes) -> Iterator[Tuple[str, bytes]]:
+        self.buffer.extend(data)
+        while self.buffer:
+            sync = self.buffer.find(FRAME_SYNC)
+            if sync != 0:
+                end = len(self.buffer) if sync < 0 else sync
+                yield "text", bytes(self.buffer[:end])
+                del self.buffer[:end]
+                continue
+            if len(self.buffer) < 2:
+                return
+            total = self.buffer[1] + 4
+            if len(self.buffer) < total:
+                return
+            body = bytes(self.buffer[1 : total - 2])
+            (crc,) = struct.unpack_from("<H", self.buffer, total - 2)
+            if crc16(body) != crc:
+                # Not a frame (or a corrupted one): drop the sync byte and
+                # rescan from the next byte.
+                del self.buffer[:1]
+                continue
+            yield "frame", body[1:]
+            del self.buffer[:total]
+
+
+class ElfImage:
+    """Minimal ELF32 little-endian reader for allocated PROGBITS sections."""
+
+    def __init__(self, path: Path) -> None:
+        self.data = path.read_bytes()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1 or self.data[5] != 1:
+            raise ValueError(f"{path}: not a 32-bit little-endian ELF")
+        (shoff,) = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", self.data, 0x2E)
+        self.ranges: List[Tuple[int, int, int]] = []
+        for index in range(shnum):
+            base = shoff + index * shentsize
+            _, sh_type, flags, addr, offset, size = struct.unpack_from(
+                "<IIIIII", self.data, base
+            )
+            if sh_type == SHT_PROGBITS and flags & SHF_ALLOC and size:
+                self.ranges.append((addr, size, offset))
+
+    def read_cstring(self, address: int) -> Optional[str]:
+        for addr, size, offset in self.ranges:
+            if addr <= address < addr + size:
+                start = offset + (address - addr)
+                end = self.data.find(b"\0", start, offset + size)
+                if end < 0:
+                    end = offset + size
+                return self.data[start:end].decode("utf-8", errors="replace")
+        return None
+
+
+def format_c(elf: ElfImage, fmt: str, args: List[int]) -> str:
+    """Expands a printf format with 32-bit raw arguments."""
+    values = iter(args)
+
+    def expand(match: re.Match) -> str:
+        conv = match.group("conv")
+        if conv == "%":
+            return "%"
+        value = next(values, 0)
+        spec = "%" + match.group("flags") + (match.group("width") or "")
+        if match.group("prec"):
+            spec += "." + match.group("prec")
+        if conv in "di":
+            return (spec + "d") % (value - (1 << 32) if value & 0x80000000 else value)
+        if conv == "c":
+            return (spec + "c") % chr(value & 0xFF)
+        if conv == "s":
+            text = elf.read_cstring(value)
+            return (spec + "s") % (text if text is not None else f"<0x{value:08x}>")
+        if conv == "p":
+            return f"0x{value:08x}"
+        return (spec + conv.replace("u", "d")) % value
+
+    return FORMAT_RE.sub(expand, fmt)
+
+
+def decode_log_frame(elf: ElfImage, payload: bytes) -> Optional[str]:
+    if len(payload) < 10 or payload[0] != FRAME_TYPE_LOG or (len(payload) - 10) % 4:
+        return None
+    level = payload[1]
+    timestamp_us, format_addr = struct.unpack_from("<II", payload, 2)
+    args = list(struct.unpack_from(f"<{(len(payload) - 10) // 4}I", payload, 10))
+    fmt = elf.read_cstring(format_addr)
+    if fmt is None:
+        text = f"<unknown format 0x{format_addr:08x}> {args}"
+    else:
+        text = format_c(elf, fmt, args)
+    name = LOG_LEVELS[level] if level < len(LOG_LEVELS) else f"L{level}"
+    return f"[{timestamp_us / 1e6:12.6f}] {name}: {text}"
+
+
+def decode_credit_frame(payload: bytes) -> Optional[str]:
+    size = struct.calcsize(CREDIT_FORMAT)
+    if len(payload) < 1 + size or payload[0] != FRAME_TYPE_CREDIT:
+        return None
+    parts = []
+    for index, name in enumerate(CREDIT_QUEUES):
+        offset = 1 + index * size
+        if len(payload) < offset + size:
+            break
+        free, capacity, consumed, discarded = struct.unpack_from(CREDIT_FORMAT, payload, offset)
+        parts.append(
+            f"{name} free={free}/{capacity} consumed={consumed} discarded={discarded}"
+        )
+    return "credit: " + " ".join(parts)
+
+
+def decode_stats_frame(payload: bytes) -> Optional[str]:
+    if len(payload) < 2 or payload[0] != FRAME_TYPE_STATS:
+        return None
+    fmt = STATS_FORMATS.get(payload[1], STATS_FORMATS[max(STATS_FORMATS)])
+    if len(payload) < 1 + struct.calcsize(fmt):
+        return None
+    values = list(struct.unpack_from(fmt, payload, 1))
+    if len(values) > STATS_FIELDS.index("reset_cause"):
+        cause = values[STATS_FIELDS.index("reset_cause")]
+        values[STATS_FIELDS.index("reset_cause")] = (
+            RESET_CAUSES[cause].replace(" ", "_") if cause < len(RESET_CAUSES) else cause
+        )
+    return "stats: " + " ".join(f"{k}={v}" for k, v in zip(STATS_FIELDS, values))
+
+
+def decode_latency_frame(payload: bytes) -> Optional[str]:
+    if len(payload) < 3 or payload[0] != FRAME_TYPE_LATENCY:
+        return None
+    stage, count = payload[1], payload[2]
+    if len(payload) < 3 + 4 * count:
+        return None
+    buckets = struct.unpack_from(f"<{count}I", payload, 3)
+    name = LATENCY_STAGES[stage] if stage < len(LATENCY_STAGES) else f"stage{stage}"
+    parts = []
+    for index, value in enumerate(buckets):
+        if not value:
+            continue
+        low = 0 if index == 0 else 1 << (index - 1)
+        if index == count - 1:
+            label = f">={low}us"
+        elif index == 0:
+            label = "0us"
+        else:
+            label = f"{low}-{(1 << index) - 1}us"
+        parts.append(f"{label}={value}")
+    return f"latency {name}: " + (" ".join(parts) or "empty")
+
+
+def decode_baud_frame(payload: bytes) -> Optional[str]:
+    if len(payload) < 6 or payload[0] != FRAME_TYPE_BAUD:
+        return None
+    result = payload[1]
+    (baud,) = struct.unpack_from("<I", payload, 2)
+    name = BAUD_RESULTS[result] if result < len(BAUD_RESULTS) else f"result{result}"
+    return f"baud {name}: {baud}"
+
+
+def decode_address_frame(payload: bytes) -> Optional[str]:
+    if len(payload) < 12 or payload[0] != FRAME_TYPE_ADDRESS:
+        return None
+    result, address, flags = payload[1], payload[2], payload[3]
+    name = ADDRESS_RESULTS[result] if result < len(ADDRESS_RESULTS) else f"result{result}"
+    return f"address {name}: {address} flags=0x{flags:02x} board={payload[4:12].hex()}"
+
+
+def decode_config_frame(payload: bytes) -> Optional[str]:
+    if len(payload) < 8 or payload[0] != FRAME_TYPE_CONFIG:
+        return None
+    result = payload[1]
+    (baud,) = struct.unpack_from("<I", payload, 2)
+    interval, mode = payload[6], payload[7]
+    name = CONFIG_RESULTS[result] if result < len(CONFIG_RESULTS) else f"result{result}"
+    mode_name = CONFIG_MODES[mode] if mode < len(CONFIG_MODES) else f"mode{mode}"
+    return (
+        f"config {name}: baud={baud or 'default'} "
+        f"interval={interval or 'default'}ms mode={mode_name}"
+    )
+
+
+def decode_hid_ack_frame(payload: bytes) -> Optional[str]:
+    size = struct.calcsize(HID_ACK_FORMAT)
+    if len(payload) < 1 + size or payload[0] != FRAME_TYPE_HID_ACK:
+        return None
+    kind, itf, report_id, data, time_us, events, latency_us = struct.unpack_from(
+        HID_ACK_FORMAT, payload, 1
+    )
+    name = HID_ACK_KINDS[kind] if kind < len(HID_ACK_KINDS) else f"kind{kind}"
+    return (
+        f"ack {name}: itf={itf} id={report_id} data=0x{data:02x} t={time_us}us "
+        f"events={events} latency={latency_us}us"
+    )
+
+
+def encode_addressed(address: int, payload: bytes) -> bytes:
+    """Frame for one board of a multidrop link (ADDRESS_BROADCAST for all)."""
+    return encode_frame(bytes([FRAME_ADDRESSED, address]) + payload)
+
+
+def unwrap_addressed(payload: bytes) -> Tuple[Optional[int], bytes]:
+    """Splits a reply from a multidrop board into (address, inner payload)."""
+    if len(payload) >= 3 and payload[0] == FRAME_ADDRESSED:
+        return payload[1], payload[2:]
+    return None, payload
+
+
+def open_source(args: argparse.Namespace) -> Union[BinaryIO, "serial.Serial"]:
+    if args.input:
+        if args.input == "-":
+            return sys.stdin.buffer
+        return open(args.input, "rb")
+    try:
+        import serial  # type: ignore
+    except ImportError:
+        raise SystemExit("pyserial is required for --port (pip install pyserial)")
+    return serial.Serial(args.port, args.baud, timeout=0.1)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Decode PicoUSBKeyBridge logs.")
+    parser.add_argument(
+        "--elf",
+        default="build/PicoUSBKeyBridge.elf",
+        help="Path to the ELF file the device is running.",
+    )
+    source = parser.add_mutually_exclusive_group(required=True)
+    source.add_argument("--port", help="Serial port to read (needs pyserial).")
+    source.add_argument("--input", help="Raw capture file to decode ('-' for stdin).")
+    parser.add_argument("--baud", type=int, default=115200, help="Serial baud rate.")
+    args = parser.parse_args()
+
+    elf_path = Path(args.elf)
+    if not elf_path.exists():
+        print(f"ELF file not found: {elf_path}")
+        return 1
+    elf = ElfImage(elf_path)
+    reader = FrameReader()
+    stream = open_source(args)
+    try:
+        while True:
+            data = stream.read(256)
+            if not data:
+                if args.input:
+                    break
+                continue
+            for kind, chunk in reader.feed(data):
+                if kind == "text":
+                    sys.stdout.write(chunk.decode("utf-8", errors="replace"))
+                    continue
+                address, chunk = unwrap_addressed(chunk)
+                line = (
+                    decode_log_frame(elf, chunk)
+                    or decode_stats_frame(chunk)
+                    or decode_latency_frame(chunk)
+                    or decode_baud_frame(chunk)
+                    or decode_credit_frame(chunk)
+                    or decode_address_frame(chunk)
+                    or decode_config_frame(chunk)
+                    or decode_hid_ack_frame(chunk)
+                )
+                if line is None:
+                    line = f"<frame 0x{chunk[0]:02x}: {chunk[1:].hex(' ')}>"
+                if address is not None:
+                    line = f"[{address}] {line}"
+                sys.stdout.write(line + "\n")
+            sys.stdout.flush()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
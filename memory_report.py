@@ -6,6 +6,7 @@ Usage:
   ./memory_report.py
   ./memory_report.py --elf build/PicoUSBKeyBridge.elf
   ./memory_report.py --map build/PicoUSBKeyBridge.elf.map --top 15
+  ./memory_report.py --budget   # exit 2 if the SRAM hot path outgrew its budget
 """
 
 from __future__ import annotations
@@ -20,8 +21,24 @@ from typing import Dict, Iterable, List, Tuple
 PICO_RAM_BYTES = 520 * 1024
 # Waveshare RP2350-USB-A ships with 2 MB flash.
 PICO_FLASH_BYTES = 2 * 1024 * 1024
+# Macro slots at the end of flash (PUSBKB_MACRO_SLOTS x PUSBKB_MACRO_SLOT_SIZE).
+PUSBKB_MACRO_REGION_BYTES = 8 * 4096
 PICO_DEVICE_NAME = "RP2350 (Waveshare)"
 
+# Hot path budgets (PUSBKB_RAM_HOT_PATH). Code copied to SRAM at boot, and the
+# part of each 4 KB scratch bank left next to the 2 KB default core stack in it
+# (core0 uses SCRATCH_Y, core1 SCRATCH_X).
+HOT_TEXT_BUDGET_BYTES = 12 * 1024
+HOT_SCRATCH_BUDGET_BYTES = 2 * 1024
+
+# Input section prefixes of the hot path, as placed by PUSBKB_RAM_FUNC,
+# PUSBKB_CORE0_DATA and PUSBKB_CORE1_DATA (and the SDK's own RAM functions).
+HOT_SECTIONS = (
+    (".time_critical", "RAM code"),
+    (".scratch_y", "core0 scratch"),
+    (".scratch_x", "core1 scratch"),
+)
+
 SECTION_TOTALS = {
     ".boot2",
     ".text",
@@ -31,10 +48,23 @@ SECTION_TOTALS = {
     ".data",
     ".bss",
     ".heap",
+    ".scratch_x",
+    ".scratch_y",
     ".stack1_dummy",
     ".stack_dummy",
 }
 
+# Sections stored in flash (the RAM ones among them are copied at boot).
+FLASH_SECTIONS = (
+    ".boot2",
+    ".text",
+    ".rodata",
+    ".binary_info",
+    ".data",
+    ".scratch_x",
+    ".scratch_y",
+)
+
 
 def format_bytes(value: int) -> str:
     if value >= 1024:
@@ -101,15 +131,90 @@ def parse_bss_data_entries(lines: List[str]) -> List[Tuple[int, str, str]]:
     return sorted(entries, reverse=True)
 
 
+def parse_hot_entries(lines: List[str]) -> Dict[str, List[Tuple[int, str, str]]]:
+    """Input sections of the hot path by prefix, largest first.
+
+    Only the memory map part counts: the discarded input sections listed before
+    it were garbage collected.
+    """
+    prefixes = tuple(prefix + "." for prefix, _ in HOT_SECTIONS)
+    entries: Dict[str, List[Tuple[int, str, str]]] = {
+        prefix: [] for prefix, _ in HOT_SECTIONS
+    }
+    in_map = False
+    for idx, line in enumerate(lines):
+        if line.startswith("Linker script and memory map"):
+            in_map = True
+            continue
+        if not in_map:
+            continue
+        # " .name  0xaddr  0xsize  obj", or the name alone when it is long.
+        match = re.match(
+            r"^ (\.\S+)(?:\s+0x[0-9a-fA-F]+\s+0x([0-9a-fA-F]+)\s+(.*))?$", line
+        )
+        if not match or not match.group(1).startswith(prefixes):
+            continue
+        name = match.group(1)
+        if match.group(2) is None:
+            if idx + 1 >= len(lines):
+                continue
+            match_next = re.match(
+                r"^\s+0x[0-9a-fA-F]+\s+0x([0-9a-fA-F]+)\s+(.*)$", lines[idx + 1]
+            )
+            if not match_next:
+                continue
+            size_hex, obj = match_next.group(1), match_next.group(2)
+        else:
+            size_hex, obj = match.group(2), match.group(3)
+        size = int(size_hex, 16)
+        if size == 0:
+            continue
+        prefix = name[: name.index(".", 1)]
+        entries[prefix].append((size, name, obj.strip()))
+    for items in entries.values():
+        items.sort(reverse=True)
+    return entries
+
+
+def print_hot_summary(
+    entries: Dict[str, List[Tuple[int, str, str]]],
+    budgets: Dict[str, int],
+    top: int,
+) -> bool:
+    """Prints the hot path sizes; returns False if one is over its budget."""
+    ok = True
+    print()
+    print("Hot path (SRAM):")
+    for prefix, label in HOT_SECTIONS:
+        used = sum(size for size, _, _ in entries[prefix])
+        budget = budgets.get(prefix)
+        line = f"  {label:16} {format_bytes(used)}"
+        if budget is not None:
+            line += f" of {format_bytes(budget)} budget"
+            if used > budget:
+                line += "  OVER BUDGET"
+                ok = False
+        print(line)
+    for prefix, label in HOT_SECTIONS:
+        if not entries[prefix]:
+            continue
+        print()
+        print(f"Top {top} {label} entries:")
+        for size, name, obj in entries[prefix][:top]:
+            print(f"  {format_bytes(size):18} {name}  ({obj})")
+    return ok
+
+
 def print_section_summary(
     totals: Dict[str, int],
     ram_size: int,
     flash_size: int,
     device_name: str,
+    reserved_flash: int = 0,
 ) -> None:
     flash_used = sum(
         totals.get(name, 0)
-        for name in (".boot2", ".text", ".rodata", ".binary_info", ".data")
+        for name in FLASH_SECTIONS
     )
     ram_used = sum(
         totals.get(name, 0)
@@ -118,6 +223,8 @@ def print_section_summary(
             ".data",
             ".bss",
             ".heap",
+            ".scratch_x",
+            ".scratch_y",
             ".stack1_dummy",
             ".stack_dummy",
         )
@@ -130,12 +237,14 @@ def print_section_summary(
     print(f"  {'RAM':16} {format_bytes(ram_size)}")
     print()
     print("Flash used:")
-    for name in (".boot2", ".text", ".rodata", ".binary_info", ".data"):
+    for name in FLASH_SECTIONS:
         if name in totals:
             print(f"  {name:16} {format_bytes(totals[name])}")
     print(f"  {'TOTAL USED':16} {format_bytes(flash_used)}")
+    if reserved_flash:
+        print(f"  {'macro region':16} {format_bytes(reserved_flash)} (reserved)")
     print()
-    remaining_flash = max(flash_size - flash_used, 0)
+    remaining_flash = max(flash_size - flash_used - reserved_flash, 0)
     print("Flash remaining:")
     print(f"  {format_bytes(remaining_flash)}")
     print()
@@ -145,6 +254,8 @@ def print_section_summary(
         ".data",
         ".bss",
         ".heap",
+        ".scratch_x",
+        ".scratch_y",
         ".stack1_dummy",
         ".stack_dummy",
     ):
@@ -188,6 +299,15 @@ def main() -> int:
         default=PICO_FLASH_BYTES,
         help="Total flash size in bytes (default: 2 MB for Waveshare RP2350-USB-A).",
     )
+    parser.add_argument(
+        "--reserved-flash",
+        type=int,
+        default=PUSBKB_MACRO_REGION_BYTES,
+        help=(
+            "Flash reserved at the end for macros (default: 8 x 4 KB slots; 0 if PUSBKB_MACROS=OFF)"
+            " plus 4096 for the PUSBKB_MULTIDROP / PUSBKB_FAST_BOOT config sector."
+        ),
+    )
     parser.add_argument(
         "--device-name",
         default=PICO_DEVICE_NAME,
@@ -196,6 +316,26 @@ def main() -> int:
     parser.add_argument(
         "--top", type=int, default=15, help="Number of top RAM entries to show."
     )
+    parser.add_argument(
+        "--budget",
+        action="store_true",
+        help="Exit with status 2 if a hot path section is over its budget.",
+    )
+    parser.add_argument(
+        "--hot-text-budget",
+        type=int,
+        default=HOT_TEXT_BUDGET_BYTES,
+        help="Budget for code run from SRAM (default: 12 KB).",
+    )
+    parser.add_argument(
+        "--scratch-budget",
+        type=int,
+        default=HOT_SCRATCH_BUDGET_BYTES,
+        help=(
+            "Budget for data in each scratch bank (default: 2 KB, what the 2 KB"
+            " default core stack leaves of the 4 KB bank)."
+        ),
+    )
     args = parser.parse_args()
 
     map_path = Path(args.map) if args.map else Path(args.elf).with_suffix(".elf.map")
@@ -209,8 +349,23 @@ def main() -> int:
         totals = parse_section_totals(lines)
     entries = parse_bss_data_entries(lines)
 
-    print_section_summary(totals, args.ram_size, args.flash_size, args.device_name)
+    print_section_summary(
+        totals, args.ram_size, args.flash_size, args.device_name, args.reserved_flash
+    )
     print_top_entries(entries, args.top)
+    hot_ok = print_hot_summary(
+        parse_hot_entries(lines),
+        {
+            ".time_critical": args.hot_text_budget,
+            ".scratch_y": args.scratch_budget,
+            ".scratch_x": args.scratch_budget,
+        },
+        args.top,
+    )
+    if args.budget and not hot_ok:
+        print()
+        print("Hot path over budget.")
+        return 2
     return 0
 
 
@@ -0,0 +1,111 @@
+/*
+ * Persistent board settings in a reserved flash sector.
+ */
+
+#include "config.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+
+#include "frame.h"
+#include "log.h"
+#include "macro.h"
+
+#ifndef PUSBKB_MACROS
+#define PUSBKB_MACROS 0
+#endif
+
+#if PUSBKB_MACROS
+#define CONFIG_REGION_END \
+  ((uint32_t)PICO_FLASH_SIZE_BYTES - (uint32_t)PUSBKB_MACRO_SLOTS * PUSBKB_MACRO_SLOT_SIZE)
+#else
+#define CONFIG_REGION_END ((uint32_t)PICO_FLASH_SIZE_BYTES)
+#endif
+#define CONFIG_OFFSET (CONFIG_REGION_END - FLASH_SECTOR_SIZE)
+
+_Static_assert(sizeof(pusbkb_config_t) <= FLASH_PAGE_SIZE,
+               "pusbkb_config_t must fit one flash page");
+
+// Where a version 1 sector kept its CRC.
+#define CONFIG_V1_CRC_OFFSET 10
+
+// End of the program image in flash, from the SDK linker script.
+extern char __flash_binary_end;
+
+static pusbkb_config_t config;
+static bool config_sector_ok = false;
+// Page image for programming (flash_range_program takes whole pages).
+static uint8_t config_page[FLASH_PAGE_SIZE];
+
+static uint16_t config_crc(const pusbkb_config_t *c) {
+  return frame_crc16(0xFFFF, (const uint8_t *)c,
+                     offsetof(pusbkb_config_t, crc));
+}
+
+static void config_defaults(pusbkb_config_t *c) {
+  memset(c, 0, sizeof(*c));
+  c->magic = PUSBKB_CONFIG_MAGIC;
+  c->version = PUSBKB_CONFIG_VERSION;
+  c->address = PUSBKB_UART_ADDRESS;
+}
+
+void config_init(void) {
+  config_defaults(&config);
+  uintptr_t image_end = (uintptr_t)&__flash_binary_end - XIP_BASE;
+  config_sector_ok = image_end <= CONFIG_OFFSET;
+  if (!config_sector_ok) {
+    LOG_ERROR("Config sector overlaps firmware (image ends at 0x%08lx); using defaults",
+              (unsigned long)image_end);
+    return;
+  }
+  const pusbkb_config_t *stored =
+      (const pusbkb_config_t *)(uintptr_t)(XIP_BASE + CONFIG_OFFSET);
+  if (stored->magic != PUSBKB_CONFIG_MAGIC) {
+    return;
+  }
+  if (stored->version == PUSBKB_CONFIG_VERSION &&
+      stored->crc == config_crc(stored)) {
+    config = *stored;
+  } else if (stored->version == 1) {
+    // Address only, CRC in the bytes the v2 fields now use.
+    const uint8_t *bytes = (const uint8_t *)stored;
+    if (frame_crc16(0xFFFF, bytes, CONFIG_V1_CRC_OFFSET) ==
+        frame_get_u16(&bytes[CONFIG_V1_CRC_OFFSET])) {
+      config.address = stored->address;
+      config.address_flags = stored->address_flags;
+    }
+  }
+}
+
+const pusbkb_config_t *config_get(void) {
+  return &config;
+}
+
+// Runs with interrupts off on this core and the other core locked out.
+static void config_flash_op(void *param) {
+  (void)param;
+  flash_range_erase(CONFIG_OFFSET, FLASH_SECTOR_SIZE);
+  flash_range_program(CONFIG_OFFSET, config_page, FLASH_PAGE_SIZE);
+}
+
+bool config_store(const pusbkb_config_t *new_config) {
+  config = *new_config;
+  config.magic = PUSBKB_CONFIG_MAGIC;
+  config.version = PUSBKB_CONFIG_VERSION;
+  config.crc = config_crc(&config);
+  if (!config_sector_ok) {
+    return false;
+  }
+  memset(config_page, 0xFF, sizeof(config_page));
+  memcpy(config_page, &config, sizeof(config));
+  int rc = flash_safe_execute(config_flash_op, NULL, 100);
+  if (rc != PICO_OK) {
+    LOG_ERROR("Config flash write failed (%d)", rc);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Board settings kept across reboots, in the flash sector just below the macro
+// region (or at the very end of flash without macros). PUSBKB_MULTIDROP and
+// PUSBKB_FAST_BOOT builds have one; an erased or corrupted sector reads as the
+// build defaults.
+#ifndef PUSBKB_MULTIDROP
+#define PUSBKB_MULTIDROP 0
+#endif
+#ifndef PUSBKB_FAST_BOOT
+#define PUSBKB_FAST_BOOT 0
+#endif
+#define PUSBKB_CONFIG_STORE (PUSBKB_MULTIDROP || PUSBKB_FAST_BOOT)
+
+#ifndef PUSBKB_UART_ADDRESS
+#define PUSBKB_UART_ADDRESS 0
+#endif
+
+#define PUSBKB_CONFIG_MAGIC   0x31474643u // "CFG1"
+#define PUSBKB_CONFIG_VERSION 2
+
+// Report mode restored at boot (PUSBKB_FAST_BOOT).
+#define PUSBKB_CONFIG_MODE_DEFAULT 0 // as built: NKRO when PUSBKB_HID_NKRO is on
+#define PUSBKB_CONFIG_MODE_BOOT    1
+#define PUSBKB_CONFIG_MODE_NKRO    2
+
+// Version 1 was the first 10 bytes plus its CRC, and still loads. The runtime
+// settings after the address are only applied by PUSBKB_FAST_BOOT builds; 0
+// means the build default.
+typedef struct {
+  uint32_t magic;
+  uint8_t version;
+  uint8_t address;         // multidrop address, never PUSBKB_ADDRESS_BROADCAST
+  uint8_t address_flags;   // PUSBKB_ADDRESS_FLAG_*
+  uint8_t hid_interval_ms; // HID bInterval
+  uint32_t baud;           // UART rate at boot
+  uint8_t report_mode;     // PUSBKB_CONFIG_MODE_*
+  uint8_t reserved;
+  uint16_t crc;            // frame_crc16() over the bytes before it
+} pusbkb_config_t;
+
+_Static_assert(sizeof(pusbkb_config_t) == 16, "pusbkb_config_t layout");
+
+// Loads the stored settings. Call once at boot, before the other core starts.
+void config_init(void);
+const pusbkb_config_t *config_get(void);
+// Replaces the stored settings. Erasing the sector blocks both cores for tens
+// of ms. Returns false if the sector could not be written; the new settings
+// are still in effect until reboot.
+bool config_store(const pusbkb_config_t *config);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Binary frame used for everything that is not a plain 5-byte packet or a
+// text log line:
+//
+//   [0xA5] [len] [payload: len bytes] [crc16 lo] [crc16 hi]
+//
+// The CRC is CRC-16/CCITT-FALSE over len + payload. 0xA5 never appears in the
+// ASCII log text, so a reader can pick frames out of the TX stream by sync
+// byte and CRC. The first payload byte is the frame type.
+#define PUSBKB_FRAME_SYNC        0xA5
+#define PUSBKB_FRAME_MAX_PAYLOAD 255
+#define PUSBKB_FRAME_OVERHEAD    4
+
+// Multidrop addressing (PUSBKB_MULTIDROP): a frame whose payload starts with
+// this type carries [address] and then a normal payload, taken only by the
+// board with that address (or by all of them, for the broadcast address).
+// Replies to an addressed command are wrapped the same way with the board's
+// own address.
+#define PUSBKB_FRAME_ADDRESSED    0x10 // [address] [payload...]
+#define PUSBKB_ADDRESS_BROADCAST  0xFF
+// Address flags, stored with the address. ONLY: ignore legacy packets and
+// frames without an address, for links shared with other boards.
+#define PUSBKB_ADDRESS_FLAG_ONLY  0x01
+
+// Host -> device command types (0x20-0x2F). Event packets keep using the
+// pusbkb_pkt_type_t values as their type byte.
+#define PUSBKB_FRAME_CMD_MASK       0xF0
+#define PUSBKB_FRAME_CMD_BASE       0x20
+#define PUSBKB_FRAME_CMD_GET_CREDIT 0x20 // no body; answered with a credit frame
+// Macro commands (see macro.h), each answered with a macro frame.
+#define PUSBKB_FRAME_CMD_MACRO_RECORD 0x21 // [slot] [name, up to 16 bytes]
+#define PUSBKB_FRAME_CMD_MACRO_COMMIT 0x22 // no body
+#define PUSBKB_FRAME_CMD_MACRO_PLAY   0x23 // [slot]
+#define PUSBKB_FRAME_CMD_MACRO_ERASE  0x24 // [slot]
+#define PUSBKB_FRAME_CMD_MACRO_INFO   0x25 // [slot]
+#define PUSBKB_FRAME_CMD_SET_NKRO     0x26 // [0 = boot keyboard, 1 = NKRO keyboard]
+#define PUSBKB_FRAME_CMD_GET_STATS    0x27 // no body; answered with a stats frame
+#define PUSBKB_FRAME_CMD_GET_LATENCY  0x28 // [flags: bit 0 = reset after]; latency frames
+// PUSBKB_HID_TEST builds only: restart the synthetic tap generator.
+#define PUSBKB_FRAME_CMD_TEST_GEN     0x29 // [pattern] [rate_hz u16] [count u32, 0 = endless]
+// UART only: move the link to another rate; answered with baud frames.
+#define PUSBKB_FRAME_CMD_SET_BAUD     0x2A // [baud u32]
+// PUSBKB_MULTIDROP builds only, answered with an address frame. SET_ADDRESS
+// is stored in flash; with a board ID it only applies to that board, so it
+// can be broadcast.
+#define PUSBKB_FRAME_CMD_GET_ADDRESS  0x2B // no body
+#define PUSBKB_FRAME_CMD_SET_ADDRESS  0x2C // [address] [flags] [board id, 8 bytes, optional]
+// PUSBKB_HID_ACK builds only: send HID ack frames to the link this arrived on.
+#define PUSBKB_FRAME_CMD_HID_ACK      0x2D // [kinds: bit per pusbkb_hid_ack_kind_t, 0 = off]
+// PUSBKB_FAST_BOOT builds only, answered with a config frame. SAVE stores the
+// current baud rate and report mode, and the given bInterval (0 = keep), for
+// the next boot; CLEAR goes back to the build defaults.
+#define PUSBKB_FRAME_CMD_CONFIG       0x2E // [pusbkb_config_op_t] [hid_interval_ms, SAVE only, optional]
+
+// Generator patterns.
+#define PUSBKB_TEST_PATTERN_SHIFT_A  0 // Shift+A taps at rate_hz
+#define PUSBKB_TEST_PATTERN_ALPHABET 1 // a..z taps in order at rate_hz
+#define PUSBKB_TEST_PATTERN_FLOOD    2 // a..z taps as fast as the queue takes them
+
+// Device -> host frame types.
+#define PUSBKB_FRAME_TYPE_LOG    0x30 // [level] [ts_us u32] [format u32] [args u32...]
+// Credit fields per queue: keyboard (or the only) queue, then the aux queue
+// with PUSBKB_HID_AUX_QUEUE.
+#define PUSBKB_FRAME_TYPE_CREDIT 0x31 // ([free u16] [capacity u16] [consumed u32] [discarded u32]) x queues
+#define PUSBKB_FRAME_TYPE_MACRO  0x32 // [cmd] [slot] [result] [count u16] [name (INFO only)]
+#define PUSBKB_FRAME_TYPE_STATS  0x33 // [pusbkb_stats_t] (stats.h)
+#define PUSBKB_FRAME_TYPE_LATENCY 0x34 // [stage] [n] [count u32 x n] (stats.h)
+#define PUSBKB_FRAME_TYPE_TEST   0x35 // [pattern] [taps u32] [elapsed_us u32], run done
+#define PUSBKB_FRAME_TYPE_BAUD   0x36 // [pusbkb_baud_result_t] [baud u32]
+#define PUSBKB_FRAME_TYPE_ADDRESS 0x37 // [pusbkb_address_result_t] [address] [flags] [board id, 8 bytes]
+#define PUSBKB_FRAME_TYPE_HID_ACK 0x38 // [pusbkb_hid_ack_t] (stats.h)
+#define PUSBKB_FRAME_TYPE_CONFIG 0x39 // [pusbkb_config_result_t] [baud u32] [hid_interval_ms] [report_mode]
+
+// Baud frame results. A switch is answered with SWITCHING at the old rate,
+// then CONFIRMED at the new one once a valid frame arrives there, or REVERTED
+// at the old one if none does in time.
+typedef enum {
+  PUSBKB_BAUD_SWITCHING = 0,
+  PUSBKB_BAUD_CONFIRMED, // also: auto-baud locked, or SET_BAUD to the current rate
+  PUSBKB_BAUD_REVERTED,
+  PUSBKB_BAUD_REJECTED,  // unsupported rate, switch in progress, or not the UART
+} pusbkb_baud_result_t;
+
+// Address frame results.
+typedef enum {
+  PUSBKB_ADDRESS_OK = 0,
+  PUSBKB_ADDRESS_INVALID,   // the broadcast address, or unknown flags
+  PUSBKB_ADDRESS_FLASH_ERR, // applied, but not stored
+} pusbkb_address_result_t;
+
+// Config command operations and results. The frame carries the stored
+// settings (0 = build default), which take effect at the next boot.
+typedef enum {
+  PUSBKB_CONFIG_GET = 0,
+  PUSBKB_CONFIG_SAVE,
+  PUSBKB_CONFIG_CLEAR,
+} pusbkb_config_op_t;
+
+typedef enum {
+  PUSBKB_CONFIG_OK = 0,
+  PUSBKB_CONFIG_INVALID,   // unknown operation, or SAVE during a baud switch
+  PUSBKB_CONFIG_FLASH_ERR, // not stored
+} pusbkb_config_result_t;
+
+uint16_t frame_crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+// Wraps `payload` in a frame. Returns the encoded length, or 0 if `out` is too
+// small.
+size_t frame_encode(uint8_t *out, size_t out_size, const uint8_t *payload,
+                    uint8_t len);
+
+static inline void frame_put_u16(uint8_t *out, uint16_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+}
+
+static inline void frame_put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+  out[2] = (uint8_t)(value >> 16);
+  out[3] = (uint8_t)(value >> 24);
+}
+
+static inline uint16_t frame_get_u16(const uint8_t *in) {
+  return (uint16_t)(in[0] | (in[1] << 8));
+}
+
+static inline uint32_t frame_get_u32(const uint8_t *in) {
+  return (uint32_t)in[0] | ((uint32_t)in[1] << 8) | ((uint32_t)in[2] << 16) |
+         ((uint32_t)in[3] << 24);
+}
+
+#ifdef __cplusplus
+}
+#endif
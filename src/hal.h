@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The few platform calls the portable core (uart_parser.c, hid_sched.c) makes.
+// hal_pico.c implements them on the Pico SDK and TinyUSB; host/hal_host.c
+// provides fakes for the off-target benchmark and fuzzer.
+
+// Microseconds since boot, readable from either core and consistent between
+// them.
+uint64_t pusbkb_hal_time_us(void);
+
+// HID interface `itf` can take another IN report.
+bool pusbkb_hal_hid_ready(uint8_t itf);
+// Queues an IN report; returns false if the interface refused it.
+bool pusbkb_hal_hid_report(uint8_t itf, uint8_t report_id, const void *report,
+                           uint16_t len);
+// Start-of-frame callbacks (hid_sched_sof) on or off.
+void pusbkb_hal_sof_enable(bool enable);
+
+// Hot path placement (PUSBKB_RAM_HOT_PATH). PUSBKB_RAM_FUNC(name) wraps a
+// function name so it runs from SRAM instead of XIP flash, and
+// PUSBKB_CORE0_DATA / PUSBKB_CORE1_DATA put state only one core touches in
+// that core's scratch bank, next to its stack. memory_report.py --budget
+// gates their size. PUSBKB_RAM_DATA(group) is for constant data both cores
+// read on the hot path, kept in striped SRAM. PUSBKB_RAM_FUNC_NOINLINE is for a static function whose
+// caller stays in flash, which would otherwise inline it back there. Without
+// the profile (and off-target) they do nothing.
+#ifndef PUSBKB_RAM_HOT_PATH
+#define PUSBKB_RAM_HOT_PATH 0
+#endif
+#if PUSBKB_RAM_HOT_PATH
+#include "pico.h"
+#define PUSBKB_RAM_FUNC(name) __not_in_flash_func(name)
+#define PUSBKB_RAM_FUNC_NOINLINE(name) __no_inline_not_in_flash_func(name)
+#define PUSBKB_CORE0_DATA(group) __scratch_y(group)
+#define PUSBKB_CORE1_DATA(group) __scratch_x(group)
+#define PUSBKB_RAM_DATA(group) __not_in_flash(group)
+#else
+#define PUSBKB_RAM_FUNC(name) name
+#define PUSBKB_RAM_FUNC_NOINLINE(name) name
+#define PUSBKB_CORE0_DATA(group)
+#define PUSBKB_CORE1_DATA(group)
+#define PUSBKB_RAM_DATA(group)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Pico SDK / TinyUSB implementation of hal.h.
+ */
+
+#include "hal.h"
+
+#include "pico/time.h"
+#include "tusb.h"
+
+#include "hid_ack.h"
+
+// The 1 MHz system timer is shared by both cores; SysTick is per core and
+// could not time the hand-off between them.
+uint64_t PUSBKB_RAM_FUNC(pusbkb_hal_time_us)(void) {
+  return time_us_64();
+}
+
+bool PUSBKB_RAM_FUNC(pusbkb_hal_hid_ready)(uint8_t itf) {
+  return tud_hid_n_ready(itf);
+}
+
+bool PUSBKB_RAM_FUNC(pusbkb_hal_hid_report)(uint8_t itf, uint8_t report_id,
+                                            const void *report, uint16_t len) {
+#if PUSBKB_HID_ACK
+  if (!tud_hid_n_report(itf, report_id, report, len)) {
+    return false;
+  }
+  hid_ack_submitted(itf);
+  return true;
+#else
+  return tud_hid_n_report(itf, report_id, report, len);
+#endif
+}
+
+void pusbkb_hal_sof_enable(bool enable) {
+  tud_sof_cb_enable(enable);
+}
@@ -0,0 +1,131 @@
+/*
+ * HID delivery acknowledgments (see hid_ack.h).
+ */
+
+#include "hid_ack.h"
+
+#if PUSBKB_HID_ACK
+
+#include "hardware/sync.h"
+#include "pico/time.h"
+
+#include "hal.h"
+#include "hid_reports.h"
+
+_Static_assert((PUSBKB_HID_ACK_RING_LEN & (PUSBKB_HID_ACK_RING_LEN - 1)) == 0,
+               "PUSBKB_HID_ACK_RING_LEN must be a power of two");
+
+#define HID_ACK_ITFS 3
+
+// core1 produces, core0 consumes; same scheme as key_queue_t.
+static pusbkb_hid_ack_t hid_ack_ring[PUSBKB_HID_ACK_RING_LEN];
+static volatile uint32_t hid_ack_head = 0;
+static volatile uint32_t hid_ack_tail = 0;
+static volatile uint32_t hid_ack_drops = 0;
+static volatile uint8_t hid_ack_kinds = 0;
+
+// core1 only.
+static uint32_t hid_ack_submitted_us[HID_ACK_ITFS];
+// Last keyboard report with a key down that reached the host: a Lock key
+// toggles on press, and the release report usually completes before the
+// host gets round to the LED report.
+static uint32_t hid_ack_press_in_us = 0;
+
+void hid_ack_enable(uint8_t kinds) {
+  hid_ack_kinds = kinds;
+}
+
+static void PUSBKB_RAM_FUNC(hid_ack_push)(const pusbkb_hid_ack_t *ack) {
+  uint32_t head = hid_ack_head;
+  if (head - hid_ack_tail >= PUSBKB_HID_ACK_RING_LEN) {
+    hid_ack_drops++;
+    return;
+  }
+  hid_ack_ring[head & (PUSBKB_HID_ACK_RING_LEN - 1)] = *ack;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  hid_ack_head = head + 1;
+  // core0 may be asleep.
+  __sev();
+}
+
+void PUSBKB_RAM_FUNC(hid_ack_submitted)(uint8_t itf) {
+  if (itf < HID_ACK_ITFS) {
+    hid_ack_submitted_us[itf] = time_us_32();
+  }
+}
+
+static bool PUSBKB_RAM_FUNC(hid_ack_is_keyboard)(uint8_t itf) {
+  return itf == PUSBKB_HID_ITF_KEYBOARD || itf == PUSBKB_HID_ITF_NKRO;
+}
+
+// Boot and NKRO reports both keep the keys after the modifier and Fn bytes.
+static bool PUSBKB_RAM_FUNC(hid_ack_key_down)(const uint8_t *report,
+                                              uint16_t len) {
+  for (uint16_t i = 2; i < len; i++) {
+    if (report[i] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void PUSBKB_RAM_FUNC(hid_ack_in_complete)(uint8_t itf, const uint8_t *report,
+                                          uint16_t len, uint32_t events) {
+  uint32_t now_us = time_us_32();
+  if (hid_ack_is_keyboard(itf) && hid_ack_key_down(report, len)) {
+    hid_ack_press_in_us = now_us;
+  }
+  if ((hid_ack_kinds & (1u << PUSBKB_HID_ACK_IN)) == 0) {
+    return;
+  }
+  pusbkb_hid_ack_t ack = {
+    .kind = PUSBKB_HID_ACK_IN,
+    .itf = itf,
+    // Only the aux interface has report IDs; TinyUSB hands back the report
+    // with its ID in front.
+    .report_id = (itf == PUSBKB_HID_ITF_AUX && len != 0) ? report[0] : 0,
+    .data = (itf != PUSBKB_HID_ITF_AUX && len != 0) ? report[0] : 0,
+    .time_us = now_us,
+    .events = events,
+    .latency_us = (itf < HID_ACK_ITFS) ? now_us - hid_ack_submitted_us[itf] : 0,
+  };
+  hid_ack_push(&ack);
+}
+
+void hid_ack_output_report(uint8_t itf, uint8_t report_id,
+                           const uint8_t *buffer, uint16_t len,
+                           uint32_t events) {
+  if ((hid_ack_kinds & (1u << PUSBKB_HID_ACK_LED)) == 0 ||
+      !hid_ack_is_keyboard(itf) || len == 0) {
+    return;
+  }
+  uint32_t now_us = time_us_32();
+  pusbkb_hid_ack_t ack = {
+    .kind = PUSBKB_HID_ACK_LED,
+    .itf = itf,
+    .report_id = report_id,
+    .data = buffer[0],
+    .time_us = now_us,
+    .events = events,
+    .latency_us = now_us - hid_ack_press_in_us,
+  };
+  hid_ack_push(&ack);
+}
+
+bool hid_ack_pop(pusbkb_hid_ack_t *out) {
+  uint32_t tail = hid_ack_tail;
+  if (hid_ack_head == tail) {
+    return false;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  *out = hid_ack_ring[tail & (PUSBKB_HID_ACK_RING_LEN - 1)];
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  hid_ack_tail = tail + 1;
+  return true;
+}
+
+uint32_t hid_ack_dropped(void) {
+  return hid_ack_drops;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Delivery acknowledgments (PUSBKB_HID_ACK): what the USB host did with the
+// reports, forwarded to the controller as PUSBKB_FRAME_TYPE_HID_ACK frames.
+// The keyboard interfaces declare the standard LED output report, so the
+// host OS answers Caps/Num/Scroll Lock presses with a SET_REPORT once it has
+// processed them; IN completions say a report reached the host controller.
+// core1 records both from the TinyUSB callbacks into an SPSC ring, and core0
+// turns them into frames.
+
+#ifndef PUSBKB_HID_ACK
+#define PUSBKB_HID_ACK 0
+#endif
+
+// Records in flight between the cores (power of two). When core0 falls
+// behind, new records are dropped and counted.
+#ifndef PUSBKB_HID_ACK_RING_LEN
+#define PUSBKB_HID_ACK_RING_LEN 32
+#endif
+
+#if PUSBKB_HID_ACK
+// core0: which kinds to record, one bit per pusbkb_hid_ack_kind_t. Off at
+// boot.
+void hid_ack_enable(uint8_t kinds);
+
+// core1, from the TinyUSB callbacks. `events` is the number of events taken
+// off the queue so far.
+void hid_ack_submitted(uint8_t itf);
+void hid_ack_in_complete(uint8_t itf, const uint8_t *report, uint16_t len,
+                         uint32_t events);
+void hid_ack_output_report(uint8_t itf, uint8_t report_id,
+                           const uint8_t *buffer, uint16_t len,
+                           uint32_t events);
+
+// core0: takes the oldest record. Returns false if there is none.
+bool hid_ack_pop(pusbkb_hid_ack_t *out);
+// Records lost because the ring was full.
+uint32_t hid_ack_dropped(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,25 +1,167 @@
 #ifndef PUSBKB_HID_REPORTS_H
 #define PUSBKB_HID_REPORTS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Extra reports on the aux interface (default off: a mouse makes some hosts,
+// iPadOS among them, show a pointer).
+#ifndef PUSBKB_HID_POINTER
+#define PUSBKB_HID_POINTER 0 // relative mouse and absolute pointer
+#endif
+#ifndef PUSBKB_HID_SYSTEM
+#define PUSBKB_HID_SYSTEM 0  // system control (power down, sleep, wake up)
+#endif
+
 // Report IDs must match the HID report descriptor.
 #define PUSBKB_REPORT_ID_KEYBOARD 0
 #define PUSBKB_REPORT_ID_CONSUMER 1
+#define PUSBKB_REPORT_ID_STATS    2 // aux interface, feature report (stats.h)
+#define PUSBKB_REPORT_ID_MOUSE    3 // PUSBKB_HID_POINTER
+#define PUSBKB_REPORT_ID_ABSOLUTE 4 // PUSBKB_HID_POINTER
+#define PUSBKB_REPORT_ID_SYSTEM   5 // PUSBKB_HID_SYSTEM
+
+// Interrupt endpoint max packet size (full speed).
+#define PUSBKB_HID_EP_SIZE 64
 
 // HID interface instances.
 #define PUSBKB_HID_ITF_KEYBOARD 0
 #define PUSBKB_HID_ITF_AUX      1
+#define PUSBKB_HID_ITF_NKRO     2 // only with PUSBKB_HID_NKRO
 
 // UART packet types (0x00-prefixed packets).
 typedef enum {
   PUSBKB_PKT_TYPE_KEYBOARD = 0,
   PUSBKB_PKT_TYPE_CONSUMER = 1,
+  PUSBKB_PKT_TYPE_TEXT = 2, // [type] [len] [len ASCII bytes], typed on-device
+  PUSBKB_PKT_TYPE_MOUSE = 3,    // [type] [dx] [dy] [wheel] [flags]
+  PUSBKB_PKT_TYPE_ABSOLUTE = 4, // [type] [x, y: 12 bits each] [flags]
+  PUSBKB_PKT_TYPE_SYSTEM = 5,   // [type] [usage lo] [usage hi] [0] [flags]
 } pusbkb_pkt_type_t;
 
 // Packet type byte: low bits encode type, MSB encodes release.
 #define PUSBKB_PKT_FLAG_RELEASE 0x80
 #define PUSBKB_PKT_TYPE_MASK    0x0F
+// v2 frames only: the body carries a u32 delay_us (see uart_parser.h).
+#define PUSBKB_PKT_FLAG_TIMED   0x40
 
 // Keyboard flags byte.
 #define PUSBKB_KBD_FLAG_APPLE_FN 0x01
+// Press: keep the key (and modifiers/Fn) down until released. Release: let go
+// of only this key/modifiers/Fn instead of everything. Consumer packets use it
+// too (a held press skips the automatic release).
+#define PUSBKB_KBD_FLAG_HOLD     0x02
+// Keyboard and consumer packets, with PUSBKB_HID_AUX_QUEUE: send only after
+// everything queued before it on the other interface has gone out. Without
+// separate queues events are already sent in order and this is ignored.
+#define PUSBKB_KBD_FLAG_BARRIER  0x04
+
+// Pointer packets (mouse and absolute): the flags byte's high nibble holds
+// buttons (bit 4 left, 5 right, 6 middle), which are clicked (pressed for one
+// report) unless PUSBKB_KBD_FLAG_HOLD keeps them down. A release lets go of
+// the given buttons with the hold flag, of all of them without. A press with
+// no buttons only moves, and queued moves are merged.
+#define PUSBKB_PTR_BUTTONS_SHIFT 4
+#define PUSBKB_PTR_BUTTONS_MASK  0x07
+
+// Absolute pointer range; x and y are packed as in the report, x in the low
+// 12 bits of the first three bytes and y in the high 12.
+#define PUSBKB_ABSOLUTE_MAX 4095
+
+// System control usages (HID usage page 0x01), the values system packets take.
+#define PUSBKB_SYSTEM_POWER_DOWN 0x81
+#define PUSBKB_SYSTEM_SLEEP      0x82
+#define PUSBKB_SYSTEM_WAKE_UP    0x83
+
+// Keyboard usages the bridge itself needs (HID usage page 0x07).
+#define PUSBKB_KEY_NONE          0x00
+#define PUSBKB_KEY_ROLLOVER      0x01 // ErrorRollOver
+#define PUSBKB_KEY_A             0x04
+#define PUSBKB_KEY_MODIFIER_FIRST 0xE0 // Left Control
+#define PUSBKB_KEY_MODIFIER_LAST  0xE7 // Right GUI
+#define PUSBKB_MODIFIER_LEFTSHIFT 0x02
+
+// NKRO keyboard report: one bit per keycode below the modifier range.
+#define PUSBKB_NKRO_KEY_COUNT 0xE0
+
+// --------------------------------------------------------------------
+// Input report layouts, declared once. Each PUSBKB_REPORT_<NAME>(F, P) lists
+// the report's fields in order:
+//   F(name, usage page, usage min, usage max, logical min, logical max,
+//     bits, count, input item flags)
+//   P(name, bits)   constant padding
+// usb_descriptors.c expands the tables into the report descriptors, and the
+// scheduler builds reports through PUSBKB_REPORT_SIZE/OFFSET/FIELD_SIZE, so a
+// layout change is one edit and the two can't disagree. Single usages are
+// written as a range of one; the flags are TinyUSB's HID_* main item bits and
+// only expanded in the descriptors.
+// --------------------------------------------------------------------
+
+// Boot keyboard, with Apple Fn in the reserved byte.
+#define PUSBKB_REPORT_KEYBOARD(F, P)                                          \
+  F(modifier, 0x07, 0xE0, 0xE7, 0, 1, 1, 8, HID_DATA | HID_VARIABLE | HID_ABSOLUTE) \
+  F(apple_fn, 0xFF, 0x03, 0x03, 0, 1, 8, 1, HID_DATA | HID_VARIABLE | HID_ABSOLUTE) \
+  F(keys, 0x07, 0x00, 0x65, 0, 0x65, 8, 6, HID_DATA | HID_ARRAY | HID_ABSOLUTE)
+
+// Same up to the Fn byte, then a key bitmap instead of the 6-key array.
+#define PUSBKB_REPORT_NKRO(F, P)                                              \
+  F(modifier, 0x07, 0xE0, 0xE7, 0, 1, 1, 8, HID_DATA | HID_VARIABLE | HID_ABSOLUTE) \
+  F(apple_fn, 0xFF, 0x03, 0x03, 0, 1, 8, 1, HID_DATA | HID_VARIABLE | HID_ABSOLUTE) \
+  F(keys, 0x07, 0x00, PUSBKB_NKRO_KEY_COUNT - 1, 0, 1, 1, PUSBKB_NKRO_KEY_COUNT,    \
+    HID_DATA | HID_VARIABLE | HID_ABSOLUTE)
+
+// One consumer usage at a time (as TUD_HID_REPORT_DESC_CONSUMER).
+#define PUSBKB_REPORT_CONSUMER(F, P)                                          \
+  F(usage, 0x0C, 0x000, 0x3FF, 0, 0x3FF, 16, 1, HID_DATA | HID_ARRAY | HID_ABSOLUTE)
+
+// Relative mouse (as TUD_HID_REPORT_DESC_MOUSE).
+#define PUSBKB_REPORT_MOUSE(F, P)                                             \
+  F(buttons, 0x09, 1, 5, 0, 1, 1, 5, HID_DATA | HID_VARIABLE | HID_ABSOLUTE)  \
+  P(buttons_pad, 3)                                                           \
+  F(xy, 0x01, 0x30, 0x31, -127, 127, 8, 2, HID_DATA | HID_VARIABLE | HID_RELATIVE) \
+  F(wheel, 0x01, 0x38, 0x38, -127, 127, 8, 1, HID_DATA | HID_VARIABLE | HID_RELATIVE) \
+  F(pan, 0x0C, 0x238, 0x238, -127, 127, 8, 1, HID_DATA | HID_VARIABLE | HID_RELATIVE)
+
+// Absolute pointer: x and y as 12-bit fields across the whole screen.
+#define PUSBKB_REPORT_ABSOLUTE(F, P)                                          \
+  F(buttons, 0x09, 1, 3, 0, 1, 1, 3, HID_DATA | HID_VARIABLE | HID_ABSOLUTE)  \
+  P(buttons_pad, 5)                                                           \
+  F(xy, 0x01, 0x30, 0x31, 0, PUSBKB_ABSOLUTE_MAX, 12, 2,                      \
+    HID_DATA | HID_VARIABLE | HID_ABSOLUTE)
+
+// System control: one usage at a time, as its index from Power Down.
+#define PUSBKB_REPORT_SYSTEM(F, P)                                            \
+  F(usage, 0x01, PUSBKB_SYSTEM_POWER_DOWN, PUSBKB_SYSTEM_WAKE_UP, 1, 3, 2, 1, \
+    HID_DATA | HID_ARRAY | HID_ABSOLUTE)                                      \
+  P(usage_pad, 6)
+
+// Each table as a struct with one char per bit, so offsetof() and sizeof()
+// give bit positions at compile time.
+#define PUSBKB_REPORT_BITS_FIELD(name, page, umin, umax, lmin, lmax, bits, count, flags) \
+  char name[(bits) * (count)];
+#define PUSBKB_REPORT_BITS_PAD(name, bits) char name[bits];
+#define PUSBKB_REPORT_BITS(report)                                            \
+  struct pusbkb_report_bits_##report {                                        \
+    PUSBKB_REPORT_##report(PUSBKB_REPORT_BITS_FIELD, PUSBKB_REPORT_BITS_PAD)  \
+  };                                                                          \
+  _Static_assert(sizeof(struct pusbkb_report_bits_##report) % 8 == 0,         \
+                 #report " report is whole bytes")
+
+PUSBKB_REPORT_BITS(KEYBOARD);
+PUSBKB_REPORT_BITS(NKRO);
+PUSBKB_REPORT_BITS(CONSUMER);
+PUSBKB_REPORT_BITS(MOUSE);
+PUSBKB_REPORT_BITS(ABSOLUTE);
+PUSBKB_REPORT_BITS(SYSTEM);
+
+// Report length in bytes, and a field's byte offset and length. The field
+// macros only compile for fields that start on a byte boundary.
+#define PUSBKB_REPORT_SIZE(report) (sizeof(struct pusbkb_report_bits_##report) / 8)
+#define PUSBKB_REPORT_OFFSET(report, field)                                   \
+  (0 * sizeof(char[offsetof(struct pusbkb_report_bits_##report, field) % 8 == 0 ? 1 : -1]) + \
+   offsetof(struct pusbkb_report_bits_##report, field) / 8)
+#define PUSBKB_REPORT_FIELD_SIZE(report, field)                               \
+  ((sizeof(((struct pusbkb_report_bits_##report *)0)->field) + 7) / 8 +       \
+   0 * PUSBKB_REPORT_OFFSET(report, field))
 
 #endif /* PUSBKB_HID_REPORTS_H */
@@ -0,0 +1,901 @@
+/*
+ * HID report scheduler (portable; see hid_sched.h).
+ */
+
+#include "hid_sched.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "hal.h"
+#include "hid_reports.h"
+#include "latency.h"
+#include "log.h"
+
+// Keys in one boot keyboard report, and in one pending key (1 unless
+// batching; NKRO reports can carry more).
+#define HID_BOOT_KEY_SLOTS PUSBKB_REPORT_FIELD_SIZE(KEYBOARD, keys)
+#if PUSBKB_HID_NKRO
+#define HID_KEY_SLOTS 32
+#else
+#define HID_KEY_SLOTS HID_BOOT_KEY_SLOTS
+#endif
+
+// Interfaces a report can go to (PUSBKB_HID_ITF_*).
+#define HID_ITFS 3
+
+typedef struct {
+  uint8_t keycodes[HID_KEY_SLOTS];
+  uint8_t keycode_count;
+  uint8_t modifier;
+  bool apple_fn;
+} hid_key_t;
+
+#if PUSBKB_HID_NKRO
+volatile bool hid_nkro_requested = true;
+static bool hid_nkro_active = true;
+#endif
+
+volatile uint32_t hid_reports_saved = 0;
+volatile uint32_t hid_reports_keyboard = 0;
+volatile uint32_t hid_reports_aux = 0;
+volatile uint32_t hid_busy = 0;
+
+#if PUSBKB_HID_BATCH
+// How many keys one report can carry in the current mode.
+static uint8_t PUSBKB_RAM_FUNC(hid_key_slot_limit)(void) {
+#if PUSBKB_HID_NKRO
+  if (hid_nkro_active) {
+    return HID_KEY_SLOTS;
+  }
+#endif
+  return HID_BOOT_KEY_SLOTS;
+}
+#endif
+
+// Coalescing: the last report sent per interface/report ID. A report identical
+// to it would not change anything the host sees, so it is skipped and counted
+// instead of costing a polling interval. Order of actual changes is unchanged.
+#define HID_LAST_REPORT_SLOTS 6
+
+typedef struct {
+  bool valid;
+  uint8_t itf;
+  uint8_t report_id;
+  uint8_t len;
+  uint8_t data[PUSBKB_HID_EP_SIZE];
+} hid_last_report_t;
+
+static hid_last_report_t hid_last_reports[HID_LAST_REPORT_SLOTS]
+    PUSBKB_CORE1_DATA("hid_last_reports");
+
+static hid_last_report_t *PUSBKB_RAM_FUNC(hid_last_report)(uint8_t itf,
+                                                           uint8_t report_id) {
+  hid_last_report_t *free_slot = NULL;
+  for (size_t i = 0; i < HID_LAST_REPORT_SLOTS; i++) {
+    hid_last_report_t *last = &hid_last_reports[i];
+    if (!last->valid) {
+      if (free_slot == NULL) {
+        free_slot = last;
+      }
+    } else if (last->itf == itf && last->report_id == report_id) {
+      return last;
+    }
+  }
+  if (free_slot != NULL) {
+    free_slot->itf = itf;
+    free_slot->report_id = report_id;
+    free_slot->len = 0;
+  }
+  return free_slot;
+}
+
+#if PUSBKB_LATENCY_STATS
+// Per interface: the report in flight whose IN completion ends its event's
+// timing.
+static struct {
+  bool valid;
+  uint32_t rx_us;
+  uint32_t submitted_us;
+} hid_latency_report[HID_ITFS];
+#endif
+
+// Rendered reports in send order (core1 only). The scheduler builds each
+// report straight into the next free slot, up to PUSBKB_HID_RENDER_AHEAD
+// ahead of the host, and hid_ring_submit() hands the oldest one to TinyUSB as
+// soon as its endpoint is free: from the IN-complete callback when traffic is
+// back to back, so no report waits for a scheduler pass to be built.
+#if PUSBKB_HID_NKRO
+#define HID_REPORT_MAX PUSBKB_REPORT_SIZE(NKRO)
+#else
+#define HID_REPORT_MAX PUSBKB_REPORT_SIZE(KEYBOARD)
+#endif
+#define HID_RING_MASK (PUSBKB_HID_RENDER_AHEAD - 1)
+
+_Static_assert((PUSBKB_HID_RENDER_AHEAD & HID_RING_MASK) == 0 &&
+               PUSBKB_HID_RENDER_AHEAD >= 2 && PUSBKB_HID_RENDER_AHEAD <= 64,
+               "PUSBKB_HID_RENDER_AHEAD must be a power of two from 2 to 64");
+_Static_assert(HID_REPORT_MAX <= PUSBKB_HID_EP_SIZE, "report fits the endpoint");
+_Static_assert(PUSBKB_REPORT_SIZE(KEYBOARD) <= HID_REPORT_MAX &&
+               PUSBKB_REPORT_SIZE(CONSUMER) <= HID_REPORT_MAX &&
+               PUSBKB_REPORT_SIZE(MOUSE) <= HID_REPORT_MAX &&
+               PUSBKB_REPORT_SIZE(ABSOLUTE) <= HID_REPORT_MAX &&
+               PUSBKB_REPORT_SIZE(SYSTEM) <= HID_REPORT_MAX,
+               "every report fits a ring slot");
+
+typedef struct {
+  uint8_t data[HID_REPORT_MAX] __attribute__((aligned(4)));
+  uint8_t itf;
+  uint8_t report_id;
+  uint8_t len;
+#if PUSBKB_LATENCY_STATS
+  bool timed; // first report of its event
+  uint32_t rx_us;
+  uint32_t dequeued_us;
+#endif
+} hid_rendered_t;
+
+// One queue and the state of the event taken off it, with its own report
+// ring. Without PUSBKB_HID_AUX_QUEUE a single lane carries every event; with
+// it, aux interface events (consumer, pointer, system) have a lane of their
+// own and go out on the aux endpoint while the keyboard lane waits for its
+// own.
+typedef struct {
+  key_queue_t *queue;
+  hid_rendered_t ring[PUSBKB_HID_RENDER_AHEAD];
+  uint32_t ring_head;
+  uint32_t ring_tail;
+  // Event being rendered.
+  hid_key_t key;
+  uint8_t stage; // 0 = idle, 1 = send press, 2 = send release
+  pusbkb_pkt_type_t type;
+  uint16_t usage;
+#if PUSBKB_HID_POINTER
+  uint8_t motion[3]; // mouse: dx, dy, wheel; absolute: packed x and y
+  uint8_t buttons;   // clicked: down in the first report only
+#endif
+  bool hold;
+  bool waiting;  // counted in hid_busy for the report at the ring head
+  uint8_t last_itf;
+#if PUSBKB_LATENCY_STATS
+  // The event just taken off the queue, until its first report is rendered.
+  // Only the first report of each event is timed, and none if coalescing
+  // skipped it.
+  struct {
+    bool armed;
+    uint32_t rx_us;
+    uint32_t dequeued_us;
+  } latency;
+#endif
+#if PUSBKB_TIMED_EVENTS
+  // Due time of the timed event at the head of the queue.
+  uint64_t due_us;
+  bool due_valid;
+#endif
+#if PUSBKB_HID_AUX_QUEUE
+  // PUSBKB_KBD_FLAG_BARRIER at the head: the other lane's queue position it
+  // was pushed at, up to which that lane has to have sent out first.
+  bool barrier;
+  uint32_t barrier_seq;
+#endif
+} hid_lane_t;
+
+#define HID_LANES (1 + PUSBKB_HID_AUX_QUEUE)
+
+static hid_lane_t hid_lanes[HID_LANES] PUSBKB_CORE1_DATA("hid_lanes");
+
+// The lanes' queues again, for the core0 side: it pushes every event through
+// these, so they stay out of core1's scratch bank.
+static key_queue_t *hid_queues[HID_LANES];
+
+key_queue_t *PUSBKB_RAM_FUNC(hid_sched_queue)(uint8_t type) {
+#if PUSBKB_HID_AUX_QUEUE
+  if ((type & PUSBKB_PKT_TYPE_MASK) != PUSBKB_PKT_TYPE_KEYBOARD) {
+    return hid_queues[1];
+  }
+#else
+  (void)type;
+#endif
+  return hid_queues[0];
+}
+
+bool PUSBKB_RAM_FUNC(hid_sched_push)(const key_event_t *event) {
+#if PUSBKB_HID_AUX_QUEUE
+  // Stamp how far the other queue had been filled, for a barrier to wait on.
+  bool aux = (event->type & PUSBKB_PKT_TYPE_MASK) != PUSBKB_PKT_TYPE_KEYBOARD;
+  key_event_t stamped = *event;
+  stamped.reserved = (uint8_t)hid_queues[aux ? 0 : 1]->head;
+  return key_queue_push(hid_queues[aux ? 1 : 0], &stamped);
+#else
+  return key_queue_push(hid_queues[0], event);
+#endif
+}
+
+static bool PUSBKB_RAM_FUNC(hid_ring_full)(const hid_lane_t *lane) {
+  return lane->ring_head - lane->ring_tail >= PUSBKB_HID_RENDER_AHEAD;
+}
+
+// Slot to render the next report into; only valid while !hid_ring_full().
+static hid_rendered_t *PUSBKB_RAM_FUNC(hid_ring_slot)(hid_lane_t *lane) {
+  return &lane->ring[lane->ring_head & HID_RING_MASK];
+}
+
+// Queues the report rendered into hid_ring_slot() unless it repeats the
+// previous one on the same interface and report ID.
+static void PUSBKB_RAM_FUNC(hid_ring_commit)(hid_lane_t *lane, uint8_t itf,
+                                             uint8_t report_id, uint8_t len) {
+  hid_rendered_t *slot = hid_ring_slot(lane);
+  hid_last_report_t *last = hid_last_report(itf, report_id);
+  // Relative motion adds up on the host, so a repeated move is not redundant.
+  bool moves = PUSBKB_HID_POINTER && report_id == PUSBKB_REPORT_ID_MOUSE &&
+               (slot->data[PUSBKB_REPORT_OFFSET(MOUSE, xy)] |
+                slot->data[PUSBKB_REPORT_OFFSET(MOUSE, xy) + 1] |
+                slot->data[PUSBKB_REPORT_OFFSET(MOUSE, wheel)]) != 0;
+  if (!moves && last != NULL && last->valid && last->len == len &&
+      memcmp(last->data, slot->data, len) == 0) {
+    hid_reports_saved++;
+#if PUSBKB_LATENCY_STATS
+    lane->latency.armed = false;
+#endif
+    return;
+  }
+  if (last != NULL) {
+    memcpy(last->data, slot->data, len);
+    last->len = len;
+    last->valid = true;
+  }
+  slot->itf = itf;
+  slot->report_id = report_id;
+  slot->len = len;
+#if PUSBKB_LATENCY_STATS
+  slot->timed = lane->latency.armed;
+  slot->rx_us = lane->latency.rx_us;
+  slot->dequeued_us = lane->latency.dequeued_us;
+  lane->latency.armed = false;
+#endif
+  lane->ring_head++;
+}
+
+// pusbkb_hal_hid_ready() that counts, once per report, reports held back by a
+// busy endpoint.
+static bool PUSBKB_RAM_FUNC(hid_itf_ready)(hid_lane_t *lane, uint8_t itf) {
+  if (pusbkb_hal_hid_ready(itf)) {
+    lane->waiting = false;
+    return true;
+  }
+  if (!lane->waiting) {
+    hid_busy++;
+    lane->waiting = true;
+  }
+  return false;
+}
+
+// Submits rendered reports in order while their interfaces take them. A
+// report for another interface than the one in flight goes out alongside it,
+// as it would have without the ring. Returns true if it submitted any.
+static bool PUSBKB_RAM_FUNC(hid_ring_submit)(hid_lane_t *lane) {
+  bool submitted = false;
+  while (lane->ring_head != lane->ring_tail) {
+    const hid_rendered_t *report = &lane->ring[lane->ring_tail & HID_RING_MASK];
+    if (!hid_itf_ready(lane, report->itf) ||
+        !pusbkb_hal_hid_report(report->itf, report->report_id, report->data,
+                               report->len)) {
+      break;
+    }
+#if PUSBKB_LATENCY_STATS
+    if (report->timed && report->itf < HID_ITFS) {
+      uint32_t now_us = (uint32_t)pusbkb_hal_time_us();
+      latency_record(PUSBKB_LATENCY_SUBMIT, report->dequeued_us, now_us);
+      hid_latency_report[report->itf].valid = true;
+      hid_latency_report[report->itf].rx_us = report->rx_us;
+      hid_latency_report[report->itf].submitted_us = now_us;
+    }
+#endif
+    if (report->itf == PUSBKB_HID_ITF_AUX) {
+      hid_reports_aux++;
+    } else {
+      hid_reports_keyboard++;
+    }
+    lane->last_itf = report->itf;
+    lane->ring_tail++;
+    submitted = true;
+  }
+  return submitted;
+}
+
+void hid_sched_reset(void) {
+  memset(hid_last_reports, 0, sizeof(hid_last_reports));
+}
+
+// Keyboard state as the host sees it: a bit per held keycode plus the
+// modifier and Fn bytes. Keycodes 0xE0-0xE7 are kept as modifier bits.
+typedef struct {
+  uint8_t keys[256 / 8];
+  uint8_t modifier;
+  bool apple_fn;
+} hid_kbd_state_t;
+
+// Keys held by PUSBKB_KBD_FLAG_HOLD presses (core1 only). Taps are sent on top
+// of this and fall back to it, and only a plain release clears it.
+static hid_kbd_state_t hid_held PUSBKB_CORE1_DATA("hid_held");
+
+#if PUSBKB_HID_NKRO
+static bool PUSBKB_RAM_FUNC(hid_kbd_state_is_empty)(const hid_kbd_state_t *state) {
+  static const hid_kbd_state_t empty;
+  return memcmp(state, &empty, sizeof(empty)) == 0;
+}
+#endif
+
+static void PUSBKB_RAM_FUNC(hid_kbd_state_set_key)(hid_kbd_state_t *state,
+                                                   uint8_t keycode, bool down) {
+  if (keycode >= PUSBKB_KEY_MODIFIER_FIRST && keycode <= PUSBKB_KEY_MODIFIER_LAST) {
+    uint8_t bit = (uint8_t)(1u << (keycode - PUSBKB_KEY_MODIFIER_FIRST));
+    state->modifier = down ? (uint8_t)(state->modifier | bit)
+                           : (uint8_t)(state->modifier & ~bit);
+  } else if (keycode != PUSBKB_KEY_NONE) {
+    uint8_t bit = (uint8_t)(1u << (keycode & 7));
+    state->keys[keycode >> 3] = down ? (uint8_t)(state->keys[keycode >> 3] | bit)
+                                     : (uint8_t)(state->keys[keycode >> 3] & ~bit);
+  }
+}
+
+static void PUSBKB_RAM_FUNC(hid_kbd_state_add)(hid_kbd_state_t *state,
+                                               const hid_key_t *key) {
+  for (uint8_t i = 0; i < key->keycode_count; i++) {
+    hid_kbd_state_set_key(state, key->keycodes[i], true);
+  }
+  state->modifier |= key->modifier;
+  state->apple_fn = state->apple_fn || key->apple_fn;
+}
+
+// Renders `state` for the active keyboard interface. The ring must have room.
+static void PUSBKB_RAM_FUNC(hid_send_keyboard_state)(hid_lane_t *lane,
+                                                     const hid_kbd_state_t *state) {
+  uint8_t *report = hid_ring_slot(lane)->data;
+  report[PUSBKB_REPORT_OFFSET(KEYBOARD, modifier)] = state->modifier;
+  report[PUSBKB_REPORT_OFFSET(KEYBOARD, apple_fn)] = state->apple_fn ? 1 : 0;
+#if PUSBKB_HID_NKRO
+  _Static_assert(PUSBKB_REPORT_OFFSET(NKRO, modifier) == PUSBKB_REPORT_OFFSET(KEYBOARD, modifier) &&
+                 PUSBKB_REPORT_OFFSET(NKRO, apple_fn) == PUSBKB_REPORT_OFFSET(KEYBOARD, apple_fn),
+                 "NKRO and boot reports share the modifier and Fn bytes");
+  _Static_assert(PUSBKB_REPORT_FIELD_SIZE(NKRO, keys) <= sizeof(state->keys),
+                 "key bitmap covers the NKRO report");
+  if (hid_nkro_active) {
+    memcpy(&report[PUSBKB_REPORT_OFFSET(NKRO, keys)], state->keys,
+           PUSBKB_REPORT_FIELD_SIZE(NKRO, keys));
+    hid_ring_commit(lane, PUSBKB_HID_ITF_NKRO, 0, PUSBKB_REPORT_SIZE(NKRO));
+    return;
+  }
+#endif
+  uint8_t *keycodes = &report[PUSBKB_REPORT_OFFSET(KEYBOARD, keys)];
+  memset(keycodes, 0, HID_BOOT_KEY_SLOTS);
+  uint8_t count = 0;
+  // Whole bytes of the bitmap at a time: most are empty.
+  for (unsigned byte = 0; byte < PUSBKB_KEY_MODIFIER_FIRST / 8; byte++) {
+    uint8_t bits = state->keys[byte];
+    if (byte == 0) {
+      bits &= (uint8_t)~1u; // keycode 0 is no key
+    }
+    for (; bits != 0; bits &= (uint8_t)(bits - 1)) {
+      if (count == HID_BOOT_KEY_SLOTS) {
+        memset(keycodes, PUSBKB_KEY_ROLLOVER, HID_BOOT_KEY_SLOTS);
+        byte = PUSBKB_KEY_MODIFIER_FIRST / 8;
+        break;
+      }
+      keycodes[count++] = (uint8_t)(byte * 8 + (unsigned)__builtin_ctz(bits));
+    }
+  }
+  hid_ring_commit(lane, PUSBKB_HID_ITF_KEYBOARD, 0, PUSBKB_REPORT_SIZE(KEYBOARD));
+}
+
+// stage 1 sends the held keys plus the pending key, stage 2 the held keys
+// alone (the tap's release, or a held-state change).
+static void PUSBKB_RAM_FUNC(hid_send_press_release)(hid_lane_t *lane) {
+  if (hid_ring_full(lane)) {
+    return;
+  }
+  if (lane->stage == 1) {
+    hid_kbd_state_t tap = hid_held;
+    hid_kbd_state_add(&tap, &lane->key);
+    hid_send_keyboard_state(lane, &tap);
+    lane->stage = 2;
+  } else if (lane->stage == 2) {
+    hid_send_keyboard_state(lane, &hid_held);
+    lane->stage = 0;
+  }
+}
+
+// Consumer and system control reports: stage 1 sends the usage, stage 2 the
+// empty report that releases it.
+static void PUSBKB_RAM_FUNC(hid_send_consumer_press_release)(hid_lane_t *lane) {
+  if (hid_ring_full(lane)) {
+    return;
+  }
+  uint8_t report_id = PUSBKB_REPORT_ID_CONSUMER;
+  uint8_t len = PUSBKB_REPORT_SIZE(CONSUMER);
+#if PUSBKB_HID_SYSTEM
+  if (lane->type == PUSBKB_PKT_TYPE_SYSTEM) {
+    report_id = PUSBKB_REPORT_ID_SYSTEM;
+    len = PUSBKB_REPORT_SIZE(SYSTEM);
+  }
+#endif
+  // Both carry the usage little-endian in the first bytes; the system one
+  // only has the low byte.
+  _Static_assert(PUSBKB_REPORT_OFFSET(CONSUMER, usage) == 0 &&
+                 PUSBKB_REPORT_OFFSET(SYSTEM, usage) == 0,
+                 "usage leads the consumer and system reports");
+  uint8_t *report = hid_ring_slot(lane)->data;
+  if (lane->stage == 1) {
+    report[0] = (uint8_t)lane->usage;
+    report[1] = (uint8_t)(lane->usage >> 8);
+    hid_ring_commit(lane, PUSBKB_HID_ITF_AUX, report_id, len);
+    lane->stage = 2;
+  } else if (lane->stage == 2) {
+    report[0] = 0;
+    report[1] = 0;
+    hid_ring_commit(lane, PUSBKB_HID_ITF_AUX, report_id, len);
+    lane->stage = 0;
+  }
+}
+
+#if PUSBKB_HID_POINTER
+// Buttons held by PUSBKB_KBD_FLAG_HOLD presses, per pointer, and where the
+// absolute pointer was last sent to (core1 only).
+static uint8_t hid_mouse_held;
+static uint8_t hid_absolute_held;
+static uint8_t hid_absolute_xy[PUSBKB_REPORT_FIELD_SIZE(ABSOLUTE, xy)];
+
+static bool PUSBKB_RAM_FUNC(hid_pointer_is_move)(const key_event_t *event) {
+  uint8_t type = event->type & PUSBKB_PKT_TYPE_MASK;
+  return (type == PUSBKB_PKT_TYPE_MOUSE || type == PUSBKB_PKT_TYPE_ABSOLUTE) &&
+         (event->type & PUSBKB_PKT_FLAG_RELEASE) == 0 &&
+         ((event->flags >> PUSBKB_PTR_BUTTONS_SHIFT) & PUSBKB_PTR_BUTTONS_MASK) == 0;
+}
+
+// stage 1 sends the held plus clicked buttons with the motion, stage 2 the
+// held buttons alone without motion (the click's release).
+static void PUSBKB_RAM_FUNC(hid_send_pointer)(hid_lane_t *lane) {
+  if (hid_ring_full(lane)) {
+    return;
+  }
+  uint8_t *report = hid_ring_slot(lane)->data;
+  bool first = lane->stage == 1;
+  if (lane->type == PUSBKB_PKT_TYPE_ABSOLUTE) {
+    if (first) {
+      memcpy(hid_absolute_xy, lane->motion, sizeof(hid_absolute_xy));
+    }
+    report[PUSBKB_REPORT_OFFSET(ABSOLUTE, buttons)] =
+        (uint8_t)(hid_absolute_held | (first ? lane->buttons : 0));
+    memcpy(&report[PUSBKB_REPORT_OFFSET(ABSOLUTE, xy)], hid_absolute_xy,
+           PUSBKB_REPORT_FIELD_SIZE(ABSOLUTE, xy));
+    hid_ring_commit(lane, PUSBKB_HID_ITF_AUX, PUSBKB_REPORT_ID_ABSOLUTE,
+                    PUSBKB_REPORT_SIZE(ABSOLUTE));
+  } else {
+    // motion is dx, dy, wheel: the report's xy and wheel bytes back to back.
+    _Static_assert(PUSBKB_REPORT_OFFSET(MOUSE, wheel) ==
+                       PUSBKB_REPORT_OFFSET(MOUSE, xy) + 2 &&
+                   sizeof(lane->motion) == 3,
+                   "motion matches the mouse report");
+    report[PUSBKB_REPORT_OFFSET(MOUSE, buttons)] =
+        (uint8_t)(hid_mouse_held | (first ? lane->buttons : 0));
+    if (first) {
+      memcpy(&report[PUSBKB_REPORT_OFFSET(MOUSE, xy)], lane->motion,
+             sizeof(lane->motion));
+    } else {
+      memset(&report[PUSBKB_REPORT_OFFSET(MOUSE, xy)], 0, sizeof(lane->motion));
+    }
+    report[PUSBKB_REPORT_OFFSET(MOUSE, pan)] = 0;
+    hid_ring_commit(lane, PUSBKB_HID_ITF_AUX, PUSBKB_REPORT_ID_MOUSE,
+                    PUSBKB_REPORT_SIZE(MOUSE));
+  }
+  lane->stage = (first && lane->buttons != 0) ? 2 : 0;
+}
+
+static bool PUSBKB_RAM_FUNC(hid_add_delta)(uint8_t *sum, uint8_t delta) {
+  int total = (int8_t)*sum + (int8_t)delta;
+  if (total < -127 || total > 127) {
+    return false;
+  }
+  *sum = (uint8_t)(int8_t)total;
+  return true;
+}
+
+// Folds the moves queued behind a move into it, so a fast pointer stream
+// costs one report per polling interval instead of one per event. Relative
+// deltas add up as long as they fit a report; an absolute move just takes the
+// latest position. Stops at anything else, clicks and button changes
+// included, which keep their place.
+static void PUSBKB_RAM_FUNC(hid_merge_pointer_moves)(hid_lane_t *lane,
+                                                     uint8_t type_byte) {
+  size_t taken = 0;
+  key_event_t next;
+  while (key_queue_peek(lane->queue, taken, &next)) {
+    if (next.type != type_byte || !hid_pointer_is_move(&next) ||
+#if PUSBKB_TIMED_EVENTS
+        next.delay_us != 0 ||
+#endif
+        (next.flags & PUSBKB_KBD_FLAG_BARRIER) != 0) {
+      break;
+    }
+    uint8_t motion[3] = {(uint8_t)next.code, (uint8_t)(next.code >> 8),
+                         next.modifier};
+    if (lane->type == PUSBKB_PKT_TYPE_ABSOLUTE) {
+      memcpy(lane->motion, motion, sizeof(motion));
+    } else {
+      uint8_t sum[3];
+      memcpy(sum, lane->motion, sizeof(sum));
+      if (!hid_add_delta(&sum[0], motion[0]) ||
+          !hid_add_delta(&sum[1], motion[1]) ||
+          !hid_add_delta(&sum[2], motion[2])) {
+        break;
+      }
+      memcpy(lane->motion, sum, sizeof(sum));
+    }
+    taken++;
+  }
+  key_queue_drop(lane->queue, taken);
+}
+#endif
+
+#if PUSBKB_HID_BATCH
+// Extends a keyboard tap with the queued taps behind it so they go out in one
+// press report and one shared release. Only plain taps with the same modifier
+// and Fn state are merged, in queue order, and never the same key twice (that
+// has to be two separate presses for the host to see it twice).
+static void PUSBKB_RAM_FUNC(hid_batch_key_taps)(hid_lane_t *lane,
+                                                uint8_t flags) {
+  hid_key_t *key = &lane->key;
+  if (key->keycode_count == 0 || key->keycodes[0] >= PUSBKB_KEY_MODIFIER_FIRST) {
+    return;
+  }
+  size_t taken = 0;
+  uint8_t limit = hid_key_slot_limit();
+  key_event_t next;
+  while (key->keycode_count < limit &&
+         key_queue_peek(lane->queue, taken, &next)) {
+    uint16_t code = next.code;
+    if (next.type != PUSBKB_PKT_TYPE_KEYBOARD ||
+        next.modifier != key->modifier ||
+        next.flags != flags ||
+#if PUSBKB_TIMED_EVENTS
+        next.delay_us != 0 ||
+#endif
+        code == 0 || code >= PUSBKB_KEY_MODIFIER_FIRST ||
+        memchr(key->keycodes, (int)code, key->keycode_count) != NULL) {
+      break;
+    }
+    key->keycodes[key->keycode_count++] = (uint8_t)code;
+    taken++;
+  }
+  key_queue_drop(lane->queue, taken);
+}
+#endif
+
+#if PUSBKB_TIMED_EVENTS
+// Press time of the previous event, which a timed event's delay counts from.
+// For timed events this is the scheduled time rather than the actual one, so
+// rounding to USB frames does not accumulate over a long sequence. Shared by
+// the lanes: delays count from the previous press on either interface.
+static uint64_t hid_sched_anchor_us;
+static bool hid_sched_anchor_valid = false;
+
+static void PUSBKB_RAM_FUNC(hid_sched_update_sof)(void) {
+  bool waiting = false;
+  for (size_t i = 0; i < HID_LANES; i++) {
+    waiting = waiting || hid_lanes[i].due_valid;
+  }
+  pusbkb_hal_sof_enable(waiting);
+}
+
+// Returns true once the head event may be sent. While a timed event waits, SOF
+// callbacks poll the scheduler so the press goes out in the first frame after
+// its due time.
+static bool PUSBKB_RAM_FUNC(hid_sched_event_due)(hid_lane_t *lane,
+                                                 const key_event_t *event) {
+  uint64_t now_us = pusbkb_hal_time_us();
+  if (event->delay_us == 0) {
+    hid_sched_anchor_us = now_us;
+    hid_sched_anchor_valid = true;
+    return true;
+  }
+  if (!lane->due_valid) {
+    lane->due_us =
+        (hid_sched_anchor_valid ? hid_sched_anchor_us : now_us) + event->delay_us;
+    // More than a frame late (the host fell behind or the previous tap took
+    // longer than the delay): restart the timeline here rather than bursting
+    // to catch up.
+    if (now_us > lane->due_us + 1000) {
+      lane->due_us = now_us;
+    }
+    lane->due_valid = true;
+    hid_sched_update_sof();
+  }
+  if (now_us < lane->due_us) {
+    return false;
+  }
+  hid_sched_anchor_us = lane->due_us;
+  hid_sched_anchor_valid = true;
+  lane->due_valid = false;
+  hid_sched_update_sof();
+  return true;
+}
+#endif
+
+#if PUSBKB_HID_AUX_QUEUE
+// Whether `lane` has sent everything up to its queue position `seq`: taken off
+// the queue, rendered, submitted, and the last report through its endpoint.
+static bool PUSBKB_RAM_FUNC(hid_lane_sent)(hid_lane_t *lane, uint32_t seq) {
+  return (int32_t)(lane->queue->tail - seq) >= 0 && lane->stage == 0 &&
+         lane->ring_head == lane->ring_tail &&
+         pusbkb_hal_hid_ready(lane->last_itf);
+}
+
+// Holds a PUSBKB_KBD_FLAG_BARRIER event at the head of `lane` until the other
+// lane has sent out what was queued there before it. hid_sched_push() stamped
+// the low byte of the other queue's head into the event; the last position
+// with that low byte is it, unless 256 or more events went onto the other
+// queue since, in which case this waits for some of those too.
+static bool PUSBKB_RAM_FUNC(hid_lane_barrier_clear)(hid_lane_t *lane,
+                                                    const key_event_t *event) {
+  if ((event->flags & PUSBKB_KBD_FLAG_BARRIER) == 0) {
+    return true;
+  }
+  hid_lane_t *other = &hid_lanes[lane == &hid_lanes[0] ? 1 : 0];
+  if (!lane->barrier) {
+    uint32_t head = other->queue->head;
+    lane->barrier = true;
+    lane->barrier_seq = head - (uint8_t)((uint8_t)head - event->reserved);
+  }
+  if (!hid_lane_sent(other, lane->barrier_seq)) {
+    // Each lane held at a barrier that waits for the other's: only possible
+    // when a stamp was further back than it could tell, and would never end.
+    // The keyboard lane goes first.
+    bool deadlock = other->barrier &&
+                    (int32_t)(lane->queue->tail - other->barrier_seq) < 0 &&
+                    other->ring_head == other->ring_tail &&
+                    pusbkb_hal_hid_ready(other->last_itf);
+    if (lane != &hid_lanes[0] || !deadlock) {
+      return false;
+    }
+  }
+  lane->barrier = false;
+  return true;
+}
+#endif
+
+// Renders the next report(s) of the lane's current event, or takes the next
+// event off its queue. Returns true if it got further.
+static bool PUSBKB_RAM_FUNC(hid_lane_render)(hid_lane_t *lane) {
+  if (lane->stage != 0) {
+    uint8_t stage_before = lane->stage;
+    if (lane->type == PUSBKB_PKT_TYPE_KEYBOARD) {
+      hid_send_press_release(lane);
+    } else if (lane->type == PUSBKB_PKT_TYPE_CONSUMER ||
+               lane->type == PUSBKB_PKT_TYPE_SYSTEM) {
+      hid_send_consumer_press_release(lane);
+      if (lane->hold && lane->stage == 2) {
+        lane->stage = 0;
+      }
+#if PUSBKB_HID_POINTER
+    } else if (lane->type == PUSBKB_PKT_TYPE_MOUSE ||
+               lane->type == PUSBKB_PKT_TYPE_ABSOLUTE) {
+      hid_send_pointer(lane);
+#endif
+    } else {
+      lane->stage = 0;
+    }
+    return lane->stage != stage_before;
+  }
+#if PUSBKB_LATENCY_STATS
+  // The last event has sent everything it will; don't time unrelated reports.
+  lane->latency.armed = false;
+#endif
+
+#if PUSBKB_HID_NKRO
+  if (lane == &hid_lanes[0] && hid_nkro_active != hid_nkro_requested) {
+    if (hid_ring_full(lane)) {
+      return false;
+    }
+    static const hid_kbd_state_t released;
+    hid_send_keyboard_state(lane, &released);
+    hid_nkro_active = hid_nkro_requested;
+    LOG_INFO("Keyboard mode: %s", hid_nkro_active ? "NKRO" : "boot");
+    if (!hid_kbd_state_is_empty(&hid_held)) {
+      // Re-press the held keys on the new interface.
+      lane->type = PUSBKB_PKT_TYPE_KEYBOARD;
+      lane->stage = 2;
+    }
+    return true;
+  }
+#endif
+
+  key_event_t event;
+  if (!key_queue_peek(lane->queue, 0, &event)) {
+    return false;
+  }
+#if PUSBKB_HID_POINTER
+  // A move waits for the aux endpoint to be free with nothing rendered ahead,
+  // so the moves queued meanwhile merge into it.
+  if (hid_pointer_is_move(&event) &&
+      (lane->ring_head != lane->ring_tail ||
+       !pusbkb_hal_hid_ready(PUSBKB_HID_ITF_AUX))) {
+    return false;
+  }
+#endif
+#if PUSBKB_HID_AUX_QUEUE
+  if (!hid_lane_barrier_clear(lane, &event)) {
+    return false;
+  }
+#endif
+#if PUSBKB_TIMED_EVENTS
+  if (!hid_sched_event_due(lane, &event)) {
+    return false;
+  }
+#endif
+  if (!key_queue_pop(lane->queue, &event)) {
+    return false;
+  }
+#if PUSBKB_LATENCY_STATS
+  uint32_t dequeued_us = (uint32_t)pusbkb_hal_time_us();
+  latency_record(PUSBKB_LATENCY_QUEUE, event.queued_us, dequeued_us);
+  lane->latency.armed = true;
+  lane->latency.rx_us = event.rx_us;
+  lane->latency.dequeued_us = dequeued_us;
+#endif
+  uint8_t type_byte = event.type;
+  lane->type = (pusbkb_pkt_type_t)(type_byte & PUSBKB_PKT_TYPE_MASK);
+  bool is_release = (type_byte & PUSBKB_PKT_FLAG_RELEASE) != 0;
+  lane->hold = (event.flags & PUSBKB_KBD_FLAG_HOLD) != 0;
+
+  if (lane->type == PUSBKB_PKT_TYPE_KEYBOARD) {
+    hid_key_t *key = &lane->key;
+    uint8_t keycode = (uint8_t)event.code;
+    // The barrier only orders; it does not keep this event out of a batch.
+    uint8_t flags = event.flags & (uint8_t)~PUSBKB_KBD_FLAG_BARRIER;
+    memset(key->keycodes, 0, sizeof(key->keycodes));
+    key->keycodes[0] = keycode;
+    key->keycode_count = (keycode != 0) ? 1 : 0;
+    key->modifier = event.modifier;
+    key->apple_fn = (flags & PUSBKB_KBD_FLAG_APPLE_FN) != 0;
+    if (is_release || lane->hold) {
+      // Held-state change: a held press adds the key, a held release drops
+      // just this key/modifiers/Fn, a plain release drops everything. Only
+      // an actual change costs a report.
+      hid_kbd_state_t before = hid_held;
+      if (!is_release) {
+        hid_kbd_state_add(&hid_held, key);
+      } else if (lane->hold) {
+        hid_kbd_state_set_key(&hid_held, keycode, false);
+        hid_held.modifier &= (uint8_t)~key->modifier;
+        if (key->apple_fn) {
+          hid_held.apple_fn = false;
+        }
+      } else {
+        memset(&hid_held, 0, sizeof(hid_held));
+      }
+      if (memcmp(&before, &hid_held, sizeof(hid_held)) != 0) {
+        lane->stage = 2;
+      }
+      return true;
+    }
+#if PUSBKB_HID_BATCH
+    hid_batch_key_taps(lane, flags);
+#endif
+    lane->stage = 1;
+    return true;
+  }
+
+#if PUSBKB_HID_POINTER
+  if (lane->type == PUSBKB_PKT_TYPE_MOUSE ||
+      lane->type == PUSBKB_PKT_TYPE_ABSOLUTE) {
+    uint8_t *held = (lane->type == PUSBKB_PKT_TYPE_ABSOLUTE) ? &hid_absolute_held
+                                                             : &hid_mouse_held;
+    uint8_t buttons = (event.flags >> PUSBKB_PTR_BUTTONS_SHIFT) &
+                      PUSBKB_PTR_BUTTONS_MASK;
+    lane->motion[0] = (uint8_t)event.code;
+    lane->motion[1] = (uint8_t)(event.code >> 8);
+    lane->motion[2] = event.modifier;
+    lane->buttons = 0;
+    if (is_release) {
+      *held = lane->hold ? (uint8_t)(*held & ~buttons) : 0;
+    } else if (lane->hold) {
+      *held |= buttons;
+    } else if (buttons != 0) {
+      lane->buttons = buttons;
+    } else {
+      hid_merge_pointer_moves(lane, type_byte);
+    }
+    lane->stage = 1;
+    return true;
+  }
+#endif
+
+#if PUSBKB_HID_SYSTEM
+  if (lane->type == PUSBKB_PKT_TYPE_SYSTEM) {
+    // The report holds the usage's index in the descriptor's range.
+    bool known = event.code >= PUSBKB_SYSTEM_POWER_DOWN &&
+                 event.code <= PUSBKB_SYSTEM_WAKE_UP;
+    lane->usage = known ? (uint16_t)(event.code - PUSBKB_SYSTEM_POWER_DOWN + 1)
+                        : 0;
+    lane->stage = is_release ? 2 : 1;
+    return true;
+  }
+#endif
+
+  if (lane->type == PUSBKB_PKT_TYPE_CONSUMER) {
+    lane->usage = event.code;
+    // A release sends the zero report once the endpoint is free; a held
+    // press stops after the press report.
+    lane->stage = is_release ? 2 : 1;
+  }
+  return true;
+}
+
+bool PUSBKB_RAM_FUNC(hid_sched_task)(void) {
+  bool progress = false;
+  for (size_t i = 0; i < HID_LANES; i++) {
+    hid_lane_t *lane = &hid_lanes[i];
+    if (hid_ring_submit(lane)) {
+      progress = true;
+    }
+    if (hid_lane_render(lane)) {
+      // Goes straight out if the endpoint is idle.
+      (void)hid_ring_submit(lane);
+      progress = true;
+    }
+  }
+  return progress;
+}
+
+void PUSBKB_RAM_FUNC(hid_sched_report_complete)(uint8_t itf) {
+#if PUSBKB_LATENCY_STATS
+  if (itf < HID_ITFS && hid_latency_report[itf].valid) {
+    uint32_t now_us = (uint32_t)pusbkb_hal_time_us();
+    latency_record(PUSBKB_LATENCY_USB, hid_latency_report[itf].submitted_us,
+                   now_us);
+    latency_record(PUSBKB_LATENCY_TOTAL, hid_latency_report[itf].rx_us, now_us);
+    hid_latency_report[itf].valid = false;
+  }
+#else
+  (void)itf;
+#endif
+  // Submit the next rendered report right away instead of waiting for the main
+  // loop to notice the endpoint is free, so back-to-back reports land in
+  // consecutive polling intervals; then render another behind it.
+  (void)hid_sched_task();
+}
+
+void PUSBKB_RAM_FUNC(hid_sched_sof)(void) {
+  (void)hid_sched_task();
+}
+
+void hid_sched_init(key_queue_t *queue) {
+  // Everything back to its boot state, so host harnesses can start over.
+  memset(hid_lanes, 0, sizeof(hid_lanes));
+  memset(hid_queues, 0, sizeof(hid_queues));
+  hid_lanes[0].queue = queue;
+  hid_queues[0] = queue;
+  hid_sched_reset();
+  memset(&hid_held, 0, sizeof(hid_held));
+#if PUSBKB_HID_NKRO
+  hid_nkro_active = true;
+#endif
+#if PUSBKB_HID_POINTER
+  hid_mouse_held = 0;
+  hid_absolute_held = 0;
+  memset(hid_absolute_xy, 0, sizeof(hid_absolute_xy));
+#endif
+#if PUSBKB_TIMED_EVENTS
+  hid_sched_anchor_valid = false;
+#endif
+#if PUSBKB_LATENCY_STATS
+  memset(hid_latency_report, 0, sizeof(hid_latency_report));
+#endif
+}
+
+#if PUSBKB_HID_AUX_QUEUE
+void hid_sched_init_aux(key_queue_t *queue) {
+  hid_lanes[1].queue = queue;
+  hid_queues[1] = queue;
+}
+#endif
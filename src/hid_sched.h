@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "key_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HID report scheduler (core1): turns queued key events into keyboard,
+// consumer and (PUSBKB_HID_POINTER / PUSBKB_HID_SYSTEM) pointer and system
+// control reports. Portable; reports go out through hal.h.
+
+#ifndef PUSBKB_HID_BATCH
+#define PUSBKB_HID_BATCH 0
+#endif
+#ifndef PUSBKB_HID_NKRO
+#define PUSBKB_HID_NKRO 0
+#endif
+
+// Reports rendered ahead of the host (power of two, 2-64). A tap is two
+// reports, so the default keeps two taps ready behind the one in flight.
+#ifndef PUSBKB_HID_RENDER_AHEAD
+#define PUSBKB_HID_RENDER_AHEAD 4
+#endif
+
+#if PUSBKB_HID_NKRO
+// Keyboard report mode requested by core0 (SET_NKRO). The scheduler switches
+// between events, releasing everything on the old interface.
+extern volatile bool hid_nkro_requested;
+#endif
+
+// Counters for pusbkb_stats_t (written by core1).
+extern volatile uint32_t hid_reports_saved; // skipped by coalescing
+extern volatile uint32_t hid_reports_keyboard;
+extern volatile uint32_t hid_reports_aux;
+extern volatile uint32_t hid_busy;
+
+// Events are popped from `queue`. Resets all scheduler state, so call it
+// before hid_sched_init_aux().
+void hid_sched_init(key_queue_t *queue);
+#if PUSBKB_HID_AUX_QUEUE
+// Consumer events are popped from `queue` and scheduled apart from the
+// keyboard ones, so neither interface waits for the other's endpoint.
+// PUSBKB_KBD_FLAG_BARRIER on an event holds it until the other queue has sent
+// out everything pushed before it.
+void hid_sched_init_aux(key_queue_t *queue);
+#endif
+// Producer side (core0): the queue events with packet type byte `type` go on,
+// and pushing onto it. Returns false if the queue is full.
+key_queue_t *hid_sched_queue(uint8_t type);
+bool hid_sched_push(const key_event_t *event);
+// Sends the next report if the interface is ready. Call from the main loop
+// and the USB callbacks below. Returns true if it got further, so calling it
+// again may get further still; false means it waits for an IN transfer to
+// complete, a SOF, or a new event.
+bool hid_sched_task(void);
+// An IN transfer on `itf` completed.
+void hid_sched_report_complete(uint8_t itf);
+// Start of frame, while pusbkb_hal_sof_enable(true) is in effect.
+void hid_sched_sof(void);
+// The host forgot all key state (bus reset, remount): resend from scratch.
+void hid_sched_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef PUSBKB_TIMED_EVENTS
+#define PUSBKB_TIMED_EVENTS 0
+#endif
+#ifndef PUSBKB_LATENCY_STATS
+#define PUSBKB_LATENCY_STATS 0
+#endif
+
+// Queued input event: one parsed packet, 6 bytes instead of a padded uint64_t
+// (12 with timed events, 8 more with latency timestamps).
+typedef struct {
+  uint16_t code;     // keycode or consumer usage
+  uint8_t type;      // packet type byte (type + PUSBKB_PKT_FLAG_RELEASE)
+  uint8_t modifier;
+  uint8_t flags;
+  uint8_t reserved;  // set by hid_sched_push()
+#if PUSBKB_TIMED_EVENTS
+  uint32_t delay_us; // 0 = send as soon as possible
+#endif
+#if PUSBKB_LATENCY_STATS
+  uint32_t rx_us;      // pusbkb_hal_time_us() of the UART IRQ that delivered it
+  uint32_t queued_us;  // pusbkb_hal_time_us() when it was pushed
+#endif
+} key_event_t;
+
+_Static_assert(sizeof(key_event_t) ==
+                   ((PUSBKB_TIMED_EVENTS || PUSBKB_LATENCY_STATS)
+                        ? 8 + 4 * PUSBKB_TIMED_EVENTS + 8 * PUSBKB_LATENCY_STATS
+                        : 6),
+               "key_event_t must stay compact");
+
+// Event queue depth (power of two, overridable via compile definitions).
+#ifndef PUSBKB_QUEUE_LEN
+#define PUSBKB_QUEUE_LEN 256
+#endif
+
+_Static_assert((PUSBKB_QUEUE_LEN & (PUSBKB_QUEUE_LEN - 1)) == 0 &&
+               PUSBKB_QUEUE_LEN <= 32768,
+               "PUSBKB_QUEUE_LEN must be a power of two <= 32768");
+
+// Separate queue for consumer events (PUSBKB_HID_AUX_QUEUE), so media keys
+// go out on their own endpoint without waiting behind keyboard reports.
+#ifndef PUSBKB_HID_AUX_QUEUE
+#define PUSBKB_HID_AUX_QUEUE 0
+#endif
+#ifndef PUSBKB_AUX_QUEUE_LEN
+#define PUSBKB_AUX_QUEUE_LEN 32
+#endif
+
+_Static_assert((PUSBKB_AUX_QUEUE_LEN & (PUSBKB_AUX_QUEUE_LEN - 1)) == 0 &&
+               PUSBKB_AUX_QUEUE_LEN <= 32768,
+               "PUSBKB_AUX_QUEUE_LEN must be a power of two <= 32768");
+
+// Single-producer/single-consumer event queue between the cores: core0 parses
+// UART packets and pushes, core1 pops in hid_sched_task. Each side only writes
+// its own free-running index; the fences order the slot access against the
+// index update. The storage is a power-of-two array (KEY_QUEUE_INIT).
+typedef struct {
+  key_event_t *events;
+  uint32_t mask;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  // Events the consumer has taken off the queue; reported in credit frames.
+  volatile uint32_t consumed;
+  // Deepest the queue has been since boot.
+  uint32_t high_water;
+} key_queue_t;
+
+// Static initializer for a queue backed by a power-of-two sized array.
+#define KEY_QUEUE_INIT(storage) \
+  { .events = (storage), .mask = sizeof(storage) / sizeof((storage)[0]) - 1 }
+
+static inline size_t key_queue_capacity(const key_queue_t *queue) {
+  return (size_t)queue->mask + 1;
+}
+
+static inline size_t key_queue_used(const key_queue_t *queue) {
+  return queue->head - queue->tail;
+}
+
+static inline bool key_queue_is_empty(const key_queue_t *queue) {
+  return key_queue_used(queue) == 0;
+}
+
+static inline size_t key_queue_free_space(const key_queue_t *queue) {
+  return key_queue_capacity(queue) - key_queue_used(queue);
+}
+
+// Producer only.
+static inline bool key_queue_push(key_queue_t *queue, const key_event_t *event) {
+  uint32_t head = queue->head;
+  uint32_t used = head - queue->tail;
+  if (used > queue->mask) {
+    return false;
+  }
+  queue->events[head & queue->mask] = *event;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  queue->head = head + 1;
+  if (used + 1 > queue->high_water) {
+    queue->high_water = used + 1;
+  }
+  return true;
+}
+
+// Consumer only.
+static inline bool key_queue_pop(key_queue_t *queue, key_event_t *out) {
+  if (key_queue_is_empty(queue)) {
+    return false;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint32_t tail = queue->tail;
+  *out = queue->events[tail & queue->mask];
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  queue->tail = tail + 1;
+  queue->consumed++;
+  return true;
+}
+
+// Consumer only: read the entry `offset` slots behind the next one to pop.
+static inline bool key_queue_peek(const key_queue_t *queue, size_t offset,
+                                  key_event_t *out) {
+  if (offset >= key_queue_used(queue)) {
+    return false;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  *out = queue->events[(queue->tail + offset) & queue->mask];
+  return true;
+}
+
+// Consumer only: discard entries already consumed through key_queue_peek().
+static inline void key_queue_drop(key_queue_t *queue, size_t count) {
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  queue->tail += (uint32_t)count;
+  queue->consumed += (uint32_t)count;
+}
+
+#ifdef __cplusplus
+}
+#endif
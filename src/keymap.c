@@ -0,0 +1,138 @@
+/*
+ * US-layout ASCII keymap for text packets.
+ */
+
+#include "keymap.h"
+
+// Same mapping as TinyUSB's HID_ASCII_TO_KEYCODE, kept here so the parser
+// builds without TinyUSB (see host/).
+const uint8_t pusbkb_ascii_keymap[128][2] = {
+  {0, 0x00},    // 0x00
+  {0, 0x00},    // 0x01
+  {0, 0x00},    // 0x02
+  {0, 0x00},    // 0x03
+  {0, 0x00},    // 0x04
+  {0, 0x00},    // 0x05
+  {0, 0x00},    // 0x06
+  {0, 0x00},    // 0x07
+  {0, 0x2a},    // 0x08 Backspace
+  {0, 0x2b},    // 0x09 Tab
+  {0, 0x28},    // 0x0a Line feed
+  {0, 0x00},    // 0x0b
+  {0, 0x00},    // 0x0c
+  {0, 0x28},    // 0x0d Carriage return
+  {0, 0x00},    // 0x0e
+  {0, 0x00},    // 0x0f
+  {0, 0x00},    // 0x10
+  {0, 0x00},    // 0x11
+  {0, 0x00},    // 0x12
+  {0, 0x00},    // 0x13
+  {0, 0x00},    // 0x14
+  {0, 0x00},    // 0x15
+  {0, 0x00},    // 0x16
+  {0, 0x00},    // 0x17
+  {0, 0x00},    // 0x18
+  {0, 0x00},    // 0x19
+  {0, 0x00},    // 0x1a
+  {0, 0x29},    // 0x1b Escape
+  {0, 0x00},    // 0x1c
+  {0, 0x00},    // 0x1d
+  {0, 0x00},    // 0x1e
+  {0, 0x00},    // 0x1f
+  {0, 0x2c},    // 0x20 Space
+  {1, 0x1e},    // 0x21 '!'
+  {1, 0x34},    // 0x22 '"'
+  {1, 0x20},    // 0x23 '#'
+  {1, 0x21},    // 0x24 '$'
+  {1, 0x22},    // 0x25 '%'
+  {1, 0x24},    // 0x26 '&'
+  {0, 0x34},    // 0x27 '\''
+  {1, 0x26},    // 0x28 '('
+  {1, 0x27},    // 0x29 ')'
+  {1, 0x25},    // 0x2a '*'
+  {1, 0x2e},    // 0x2b '+'
+  {0, 0x36},    // 0x2c ','
+  {0, 0x2d},    // 0x2d '-'
+  {0, 0x37},    // 0x2e '.'
+  {0, 0x38},    // 0x2f '/'
+  {0, 0x27},    // 0x30 '0'
+  {0, 0x1e},    // 0x31 '1'
+  {0, 0x1f},    // 0x32 '2'
+  {0, 0x20},    // 0x33 '3'
+  {0, 0x21},    // 0x34 '4'
+  {0, 0x22},    // 0x35 '5'
+  {0, 0x23},    // 0x36 '6'
+  {0, 0x24},    // 0x37 '7'
+  {0, 0x25},    // 0x38 '8'
+  {0, 0x26},    // 0x39 '9'
+  {1, 0x33},    // 0x3a ':'
+  {0, 0x33},    // 0x3b ';'
+  {1, 0x36},    // 0x3c '<'
+  {0, 0x2e},    // 0x3d '='
+  {1, 0x37},    // 0x3e '>'
+  {1, 0x38},    // 0x3f '?'
+  {1, 0x1f},    // 0x40 '@'
+  {1, 0x04},    // 0x41 'A'
+  {1, 0x05},    // 0x42 'B'
+  {1, 0x06},    // 0x43 'C'
+  {1, 0x07},    // 0x44 'D'
+  {1, 0x08},    // 0x45 'E'
+  {1, 0x09},    // 0x46 'F'
+  {1, 0x0a},    // 0x47 'G'
+  {1, 0x0b},    // 0x48 'H'
+  {1, 0x0c},    // 0x49 'I'
+  {1, 0x0d},    // 0x4a 'J'
+  {1, 0x0e},    // 0x4b 'K'
+  {1, 0x0f},    // 0x4c 'L'
+  {1, 0x10},    // 0x4d 'M'
+  {1, 0x11},    // 0x4e 'N'
+  {1, 0x12},    // 0x4f 'O'
+  {1, 0x13},    // 0x50 'P'
+  {1, 0x14},    // 0x51 'Q'
+  {1, 0x15},    // 0x52 'R'
+  {1, 0x16},    // 0x53 'S'
+  {1, 0x17},    // 0x54 'T'
+  {1, 0x18},    // 0x55 'U'
+  {1, 0x19},    // 0x56 'V'
+  {1, 0x1a},    // 0x57 'W'
+  {1, 0x1b},    // 0x58 'X'
+  {1, 0x1c},    // 0x59 'Y'
+  {1, 0x1d},    // 0x5a 'Z'
+  {0, 0x2f},    // 0x5b '['
+  {0, 0x31},    // 0x5c '\\'
+  {0, 0x30},    // 0x5d ']'
+  {1, 0x23},    // 0x5e '^'
+  {1, 0x2d},    // 0x5f '_'
+  {0, 0x35},    // 0x60 '`'
+  {0, 0x04},    // 0x61 'a'
+  {0, 0x05},    // 0x62 'b'
+  {0, 0x06},    // 0x63 'c'
+  {0, 0x07},    // 0x64 'd'
+  {0, 0x08},    // 0x65 'e'
+  {0, 0x09},    // 0x66 'f'
+  {0, 0x0a},    // 0x67 'g'
+  {0, 0x0b},    // 0x68 'h'
+  {0, 0x0c},    // 0x69 'i'
+  {0, 0x0d},    // 0x6a 'j'
+  {0, 0x0e},    // 0x6b 'k'
+  {0, 0x0f},    // 0x6c 'l'
+  {0, 0x10},    // 0x6d 'm'
+  {0, 0x11},    // 0x6e 'n'
+  {0, 0x12},    // 0x6f 'o'
+  {0, 0x13},    // 0x70 'p'
+  {0, 0x14},    // 0x71 'q'
+  {0, 0x15},    // 0x72 'r'
+  {0, 0x16},    // 0x73 's'
+  {0, 0x17},    // 0x74 't'
+  {0, 0x18},    // 0x75 'u'
+  {0, 0x19},    // 0x76 'v'
+  {0, 0x1a},    // 0x77 'w'
+  {0, 0x1b},    // 0x78 'x'
+  {0, 0x1c},    // 0x79 'y'
+  {0, 0x1d},    // 0x7a 'z'
+  {1, 0x2f},    // 0x7b '{'
+  {1, 0x31},    // 0x7c '|'
+  {1, 0x30},    // 0x7d '}'
+  {1, 0x35},    // 0x7e '~'
+  {0, 0x4c},    // 0x7f Delete
+};
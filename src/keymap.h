@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// ASCII -> {shift, keycode} (US layout). Keycode 0 means unmapped.
+extern const uint8_t pusbkb_ascii_keymap[128][2];
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,21 @@
+/*
+ * Per-stage latency histograms (PUSBKB_LATENCY_STATS).
+ */
+
+#include "latency.h"
+
+#include "hal.h"
+
+#if PUSBKB_LATENCY_STATS
+volatile uint32_t latency_hist[PUSBKB_LATENCY_STAGES][PUSBKB_LATENCY_BUCKETS];
+
+void PUSBKB_RAM_FUNC(latency_record)(pusbkb_latency_stage_t stage,
+                                     uint32_t start_us, uint32_t end_us) {
+  uint32_t delta = end_us - start_us;
+  uint32_t bucket = (delta == 0) ? 0 : 32 - (uint32_t)__builtin_clz(delta);
+  if (bucket >= PUSBKB_LATENCY_BUCKETS) {
+    bucket = PUSBKB_LATENCY_BUCKETS - 1;
+  }
+  latency_hist[stage][bucket]++;
+}
+#endif
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "key_queue.h"
+#include "stats.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if PUSBKB_LATENCY_STATS
+// Per-stage latency histograms (pusbkb_latency_stage_t). Each stage has one
+// writing core (PARSE: core0, the rest: core1), so no locking.
+extern volatile uint32_t latency_hist[PUSBKB_LATENCY_STAGES][PUSBKB_LATENCY_BUCKETS];
+
+// Counts `end_us - start_us` (taken from pusbkb_hal_time_us(), truncated) in
+// its power-of-two bucket.
+void latency_record(pusbkb_latency_stage_t stage, uint32_t start_us,
+                    uint32_t end_us);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,5 +1,9 @@
 /*
- * UART log output (stdio).
+ * UART log output.
+ *
+ * Log lines are copied into a ring buffer and drained to UART TX by the UART
+ * IRQ, so callers never wait for the wire. Lines that do not fit are dropped
+ * and counted; a marker line reports the loss once space frees up.
  */
 
 #include "log.h"
@@ -10,28 +14,144 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "pico/stdio.h"
+#include "hardware/sync.h"
+#include "hardware/uart.h"
+#include "pico/critical_section.h"
+#include "pico/time.h"
+
+#include "frame.h"
+#include "hal.h"
+#include "spsc_ring.h"
+
+#ifndef PUSBKB_LOG_RING_LEN
+#define PUSBKB_LOG_RING_LEN 4096
+#endif
+#ifndef PUSBKB_LOG_DEFERRED_RECORDS
+#define PUSBKB_LOG_DEFERRED_RECORDS 64
+#endif
+
+_Static_assert((PUSBKB_LOG_RING_LEN & (PUSBKB_LOG_RING_LEN - 1)) == 0,
+               "PUSBKB_LOG_RING_LEN must be a power of two");
+
+// Both cores log. Producers serialize on log_lock, which turns the SPSC ring
+// into a safe MPSC one; the TX pump takes the same lock.
+static critical_section_t log_lock;
+static uint8_t log_ring_storage[PUSBKB_LOG_RING_LEN];
+static spsc_ring_t log_ring = SPSC_RING_INIT(log_ring_storage);
+static uart_inst_t *log_uart = NULL;
+static uint32_t log_dropped = 0;
+static uint32_t log_dropped_reported = 0;
+
+#if PUSBKB_LOG_DEFERRED
+typedef struct {
+  const char *level;
+  const char *format;
+  uint32_t nargs;
+  uint32_t args[LOG_DEFERRED_MAX_ARGS];
+} log_record_t;
+
+_Static_assert((PUSBKB_LOG_DEFERRED_RECORDS &
+                (PUSBKB_LOG_DEFERRED_RECORDS - 1)) == 0,
+               "PUSBKB_LOG_DEFERRED_RECORDS must be a power of two");
+
+static log_record_t log_records[PUSBKB_LOG_DEFERRED_RECORDS];
+static uint32_t log_records_head = 0;
+static uint32_t log_records_tail = 0;
+#endif
+
+// Caller holds log_lock. Moves ring bytes into the TX FIFO and keeps the TX
+// interrupt enabled only while there is something left to send.
+static void PUSBKB_RAM_FUNC(log_tx_pump_locked)(void) {
+  if (log_uart == NULL) {
+    return;
+  }
+  uart_hw_t *hw = uart_get_hw(log_uart);
+  const uint8_t *data;
+  uint32_t len;
+  while ((len = spsc_ring_peek(&log_ring, &data)) != 0) {
+    uint32_t sent = 0;
+    while (sent < len && (hw->fr & UART_UARTFR_TXFF_BITS) == 0) {
+      hw->dr = data[sent++];
+    }
+    spsc_ring_consume(&log_ring, sent);
+    if (sent < len) {
+      break;
+    }
+  }
+  if (spsc_ring_used(&log_ring) != 0) {
+    hw_set_bits(&hw->imsc, UART_UARTIMSC_TXIM_BITS);
+  } else {
+    hw_clear_bits(&hw->imsc, UART_UARTIMSC_TXIM_BITS);
+  }
+}
+
+// Caller holds log_lock.
+static void log_enqueue_locked(const char *data, size_t len) {
+  if (log_dropped != log_dropped_reported) {
+    char marker[48];
+    int marker_len = snprintf(marker, sizeof(marker),
+                              "WARN: %lu log lines dropped\r\n",
+                              (unsigned long)(log_dropped - log_dropped_reported));
+    if (marker_len > 0 &&
+        spsc_ring_write(&log_ring, (const uint8_t *)marker,
+                        (uint32_t)marker_len)) {
+      log_dropped_reported = log_dropped;
+    }
+  }
+  if (!spsc_ring_write(&log_ring, (const uint8_t *)data, (uint32_t)len)) {
+    log_dropped++;
+  }
+  log_tx_pump_locked();
+}
+
+void log_init(uart_inst_t *uart) {
+  if (!critical_section_is_initialized(&log_lock)) {
+    critical_section_init(&log_lock);
+  }
+  critical_section_enter_blocking(&log_lock);
+  log_uart = uart;
+  log_tx_pump_locked();
+  critical_section_exit(&log_lock);
+}
+
+void PUSBKB_RAM_FUNC(log_uart_tx_irq)(void) {
+  critical_section_enter_blocking(&log_lock);
+  log_tx_pump_locked();
+  critical_section_exit(&log_lock);
+}
+
+uint32_t log_dropped_count(void) {
+  return log_dropped;
+}
 
 static int log_write_line_v(const char *level, const char *format, va_list args) {
   if (format == NULL) {
     return 0;
   }
+  // level + message + CRLF, queued as one unit so lines never interleave.
   char buffer[256];
-  int len = vsnprintf(buffer, sizeof(buffer), format, args);
+  size_t level_len = (level != NULL) ? strlen(level) : 0;
+  if (level_len > 32) {
+    level_len = 32;
+  }
+  if (level_len > 0) {
+    memcpy(buffer, level, level_len);
+  }
+  size_t body_size = sizeof(buffer) - level_len - 2;
+  int len = vsnprintf(buffer + level_len, body_size, format, args);
   if (len <= 0) {
     return len;
   }
   size_t write_len = (size_t)len;
-  if (write_len >= sizeof(buffer)) {
-    write_len = sizeof(buffer) - 1;
+  if (write_len >= body_size) {
+    write_len = body_size - 1;
   }
-  if (level != NULL && level[0] != '\0') {
-    log_write(level, strlen(level));
+  write_len += level_len;
+  if (buffer[write_len - 1] != '\n') {
+    buffer[write_len++] = '\r';
+    buffer[write_len++] = '\n';
   }
   log_write(buffer, write_len);
-  if (write_len == 0 || buffer[write_len - 1] != '\n') {
-    log_write("\r\n", 2);
-  }
   return len;
 }
 
@@ -42,16 +162,128 @@ void log_write_line(const char *level, const char *format, ...) {
   va_end(args);
 }
 
+#if PUSBKB_LOG_DEFERRED
+void log_write_deferred(const char *level, uint32_t nargs,
+                        const char *format, ...) {
+  if (format == NULL) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  critical_section_enter_blocking(&log_lock);
+  if (log_records_head - log_records_tail >= PUSBKB_LOG_DEFERRED_RECORDS) {
+    log_dropped++;
+  } else {
+    log_record_t *record =
+        &log_records[log_records_head & (PUSBKB_LOG_DEFERRED_RECORDS - 1)];
+    record->level = level;
+    record->format = format;
+    record->nargs = nargs;
+    for (uint32_t i = 0; i < nargs && i < LOG_DEFERRED_MAX_ARGS; i++) {
+      record->args[i] = va_arg(args, uint32_t);
+    }
+    log_records_head++;
+  }
+  critical_section_exit(&log_lock);
+  va_end(args);
+  // Wakes core0 if it is idle, so log_flush() formats the record.
+  __sev();
+}
+
+// Formats one record. Unused argument slots are passed as zero; printf ignores
+// arguments beyond the ones the format consumes.
+static void log_format_record(const log_record_t *record) {
+  char buffer[256];
+  int len = snprintf(buffer, sizeof(buffer), "%s", record->level);
+  if (len < 0) {
+    return;
+  }
+  size_t used = (size_t)len;
+  int body = snprintf(buffer + used, sizeof(buffer) - used - 2, record->format,
+                      record->args[0], record->args[1], record->args[2],
+                      record->args[3], record->args[4], record->args[5]);
+  if (body < 0) {
+    return;
+  }
+  used += ((size_t)body < sizeof(buffer) - used - 2)
+              ? (size_t)body
+              : sizeof(buffer) - used - 3;
+  buffer[used++] = '\r';
+  buffer[used++] = '\n';
+  log_write(buffer, used);
+}
+#endif
+
+#if PUSBKB_LOG_BINARY
+// Hot path is a handful of stores, a CRC over ~20 bytes and one ring write.
+void log_write_binary(log_level_t level, uint32_t nargs,
+                      const char *format, ...) {
+  if (format == NULL) {
+    return;
+  }
+  if (nargs > LOG_DEFERRED_MAX_ARGS) {
+    nargs = LOG_DEFERRED_MAX_ARGS;
+  }
+  uint8_t payload[10 + 4 * LOG_DEFERRED_MAX_ARGS];
+  payload[0] = PUSBKB_FRAME_TYPE_LOG;
+  payload[1] = (uint8_t)level;
+  frame_put_u32(&payload[2], time_us_32());
+  frame_put_u32(&payload[6], (uint32_t)(uintptr_t)format);
+  va_list args;
+  va_start(args, format);
+  for (uint32_t i = 0; i < nargs; i++) {
+    frame_put_u32(&payload[10 + 4 * i], va_arg(args, uint32_t));
+  }
+  va_end(args);
+  log_write_frame(payload, (uint8_t)(10 + 4 * nargs));
+}
+#endif
+
 void log_write(const char *data, size_t len) {
   if (data == NULL || len == 0) {
     return;
   }
-  fwrite(data, 1, len, stdout);
-  fflush(stdout);
+  critical_section_enter_blocking(&log_lock);
+  log_enqueue_locked(data, len);
+  critical_section_exit(&log_lock);
+}
+
+void log_write_frame(const uint8_t *payload, uint8_t len) {
+  uint8_t frame[PUSBKB_FRAME_MAX_PAYLOAD + PUSBKB_FRAME_OVERHEAD];
+  size_t frame_len = frame_encode(frame, sizeof(frame), payload, len);
+  log_write((const char *)frame, frame_len);
 }
 
 void log_flush(void) {
-  fflush(stdout);
+#if PUSBKB_LOG_DEFERRED
+  while (true) {
+    log_record_t record;
+    critical_section_enter_blocking(&log_lock);
+    bool have_record = log_records_tail != log_records_head;
+    if (have_record) {
+      record = log_records[log_records_tail & (PUSBKB_LOG_DEFERRED_RECORDS - 1)];
+      for (uint32_t i = record.nargs; i < LOG_DEFERRED_MAX_ARGS; i++) {
+        record.args[i] = 0;
+      }
+      log_records_tail++;
+    }
+    critical_section_exit(&log_lock);
+    if (!have_record) {
+      break;
+    }
+    log_format_record(&record);
+  }
+#endif
+  // The TX IRQ normally keeps the FIFO fed; this just covers a missed edge.
+  log_uart_tx_irq();
+}
+
+bool log_tx_idle(void) {
+  if (log_uart == NULL) {
+    return true;
+  }
+  return spsc_ring_used(&log_ring) == 0 &&
+         (uart_get_hw(log_uart)->fr & UART_UARTFR_BUSY_BITS) == 0;
 }
 
 // TinyUSB debug printf hook (CFG_TUSB_DEBUG_PRINTF).
@@ -1,29 +1,89 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-#include "pico/stdlib.h"
-
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Same declaration as hardware/uart.h, so the portable core can log without
+// the SDK headers.
+typedef struct uart_inst uart_inst_t;
+
 #ifndef PUSBKB_DEBUG
 #define PUSBKB_DEBUG 1
 #endif
 
+// Deferred mode: LOG_* only records the format pointer and raw 32-bit args;
+// formatting happens later in log_flush(). Arguments must be integers or
+// pointers to strings that outlive the call (no stack buffers, no floats).
+#ifndef PUSBKB_LOG_DEFERRED
+#define PUSBKB_LOG_DEFERRED 0
+#endif
+
+// Binary mode: LOG_* emit a PUSBKB_FRAME_TYPE_LOG frame carrying the level,
+// a timestamp, the format string address and the raw args. log_decode.py turns
+// them back into text using the ELF. Same argument rules as deferred mode.
+#ifndef PUSBKB_LOG_BINARY
+#define PUSBKB_LOG_BINARY 0
+#endif
+
+typedef enum {
+  LOG_LEVEL_DEBUG = 0,
+  LOG_LEVEL_INFO,
+  LOG_LEVEL_WARN,
+  LOG_LEVEL_ERROR,
+} log_level_t;
+
+// Starts draining queued log output to `uart` TX. Call once the UART is up.
+// With NULL it only sets up the lock, so both cores can queue lines before
+// that (fast boot); a second call attaches the UART.
+void log_init(uart_inst_t *uart);
+// UART IRQ hook: refills the TX FIFO from the log ring.
+void log_uart_tx_irq(void);
+// Number of log lines lost because the ring was full.
+uint32_t log_dropped_count(void);
+
 void log_write(const char *data, size_t len);
+// Queues a binary frame (see frame.h) on the same TX stream as the log text.
+void log_write_frame(const uint8_t *payload, uint8_t len);
 void log_flush(void);
+// True once everything queued so far has left the UART, shift register
+// included (e.g. before changing the baud rate).
+bool log_tx_idle(void);
 
 // Logging helpers
 void log_write_line(const char *level, const char *format, ...);
 
-#define LOG_INFO(...) log_write_line("INFO: ", __VA_ARGS__)
-#define LOG_WARN(...) log_write_line("WARN: ", __VA_ARGS__)
-#define LOG_ERROR(...) log_write_line("ERROR: ", __VA_ARGS__)
+#if PUSBKB_LOG_DEFERRED || PUSBKB_LOG_BINARY
+#define LOG_DEFERRED_MAX_ARGS 6
+#define LOG_NARGS(...) LOG_NARGS_(__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(format, a1, a2, a3, a4, a5, a6, n, ...) n
+#endif
+
+#if PUSBKB_LOG_BINARY
+void log_write_binary(log_level_t level, uint32_t nargs,
+                      const char *format, ...);
+
+#define LOG_LINE(level, text, ...) \
+  log_write_binary(level, LOG_NARGS(__VA_ARGS__), __VA_ARGS__)
+#elif PUSBKB_LOG_DEFERRED
+void log_write_deferred(const char *level, uint32_t nargs,
+                        const char *format, ...);
+
+#define LOG_LINE(level, text, ...) \
+  log_write_deferred(text, LOG_NARGS(__VA_ARGS__), __VA_ARGS__)
+#else
+#define LOG_LINE(level, text, ...) log_write_line(text, __VA_ARGS__)
+#endif
+
+#define LOG_INFO(...) LOG_LINE(LOG_LEVEL_INFO, "INFO: ", __VA_ARGS__)
+#define LOG_WARN(...) LOG_LINE(LOG_LEVEL_WARN, "WARN: ", __VA_ARGS__)
+#define LOG_ERROR(...) LOG_LINE(LOG_LEVEL_ERROR, "ERROR: ", __VA_ARGS__)
 #if PUSBKB_DEBUG
-#define LOG_DEBUG(...) log_write_line("DEBUG: ", __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_LINE(LOG_LEVEL_DEBUG, "DEBUG: ", __VA_ARGS__)
 #else
 #define LOG_DEBUG(...) do {} while (0)
 #endif
@@ -0,0 +1,188 @@
+/*
+ * Macro storage in the reserved flash region.
+ */
+
+#include "macro.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+
+#include "frame.h"
+#include "log.h"
+
+_Static_assert(PUSBKB_MACRO_SLOT_SIZE % FLASH_SECTOR_SIZE == 0,
+               "PUSBKB_MACRO_SLOT_SIZE must be a multiple of the flash sector");
+_Static_assert(PUSBKB_MACRO_MAX_EVENTS <= UINT16_MAX,
+               "macro event count must fit macro_header_t.count");
+
+#define MACRO_REGION_SIZE ((uint32_t)PUSBKB_MACRO_SLOTS * PUSBKB_MACRO_SLOT_SIZE)
+#define MACRO_REGION_OFFSET ((uint32_t)PICO_FLASH_SIZE_BYTES - MACRO_REGION_SIZE)
+#define MACRO_NO_SLOT 0xFF
+
+// End of the program image in flash, from the SDK linker script.
+extern char __flash_binary_end;
+
+// One slot image: the recording under construction, or the macro last loaded
+// for playback (macro_cache_slot).
+static union {
+  macro_header_t header;
+  uint8_t bytes[PUSBKB_MACRO_SLOT_SIZE];
+} macro_buf;
+static uint8_t macro_cache_slot = MACRO_NO_SLOT;
+static uint8_t macro_record_slot = MACRO_NO_SLOT;
+static bool macro_record_overflow = false;
+static bool macro_region_ok = false;
+
+static uint32_t macro_slot_offset(uint8_t slot) {
+  return MACRO_REGION_OFFSET + (uint32_t)slot * PUSBKB_MACRO_SLOT_SIZE;
+}
+
+static const macro_header_t *macro_slot_xip(uint8_t slot) {
+  return (const macro_header_t *)(uintptr_t)(XIP_BASE + macro_slot_offset(slot));
+}
+
+static uint16_t macro_events_crc(const macro_header_t *header) {
+  return frame_crc16(0xFFFF, (const uint8_t *)macro_events(header),
+                     (size_t)header->count * sizeof(macro_event_t));
+}
+
+void macro_init(void) {
+  uintptr_t image_end = (uintptr_t)&__flash_binary_end - XIP_BASE;
+  macro_region_ok = image_end <= MACRO_REGION_OFFSET;
+  if (!macro_region_ok) {
+    LOG_ERROR("Macro region overlaps firmware (image ends at 0x%08lx); macros disabled",
+              (unsigned long)image_end);
+  }
+}
+
+bool macro_available(void) {
+  return macro_region_ok;
+}
+
+macro_result_t macro_record_begin(uint8_t slot, const char *name,
+                                  uint8_t name_len) {
+  if (!macro_region_ok) {
+    return MACRO_ERR_UNAVAILABLE;
+  }
+  if (slot >= PUSBKB_MACRO_SLOTS) {
+    return MACRO_ERR_SLOT;
+  }
+  macro_cache_slot = MACRO_NO_SLOT;
+  memset(&macro_buf.header, 0, sizeof(macro_buf.header));
+  macro_buf.header.magic = PUSBKB_MACRO_MAGIC;
+  if (name_len > PUSBKB_MACRO_NAME_LEN) {
+    name_len = PUSBKB_MACRO_NAME_LEN;
+  }
+  memcpy(macro_buf.header.name, name, name_len);
+  macro_record_slot = slot;
+  macro_record_overflow = false;
+  return MACRO_OK;
+}
+
+bool macro_recording(void) {
+  return macro_record_slot != MACRO_NO_SLOT;
+}
+
+void macro_record_add(const macro_event_t *event) {
+  if (macro_buf.header.count >= PUSBKB_MACRO_MAX_EVENTS) {
+    macro_record_overflow = true;
+    return;
+  }
+  macro_event_t *events = (macro_event_t *)(&macro_buf.header + 1);
+  events[macro_buf.header.count++] = *event;
+}
+
+typedef struct {
+  uint32_t offset;
+  uint32_t program_len; // 0 = erase only
+} macro_flash_op_t;
+
+// Runs with interrupts off on this core and the other core locked out.
+static void macro_flash_op(void *param) {
+  const macro_flash_op_t *op = (const macro_flash_op_t *)param;
+  flash_range_erase(op->offset, PUSBKB_MACRO_SLOT_SIZE);
+  if (op->program_len != 0) {
+    flash_range_program(op->offset, macro_buf.bytes, op->program_len);
+  }
+}
+
+static macro_result_t macro_flash_run(const macro_flash_op_t *op) {
+  int rc = flash_safe_execute(macro_flash_op, (void *)op, 100);
+  if (rc != PICO_OK) {
+    LOG_ERROR("Macro flash write failed (%d)", rc);
+    return MACRO_ERR_UNAVAILABLE;
+  }
+  return MACRO_OK;
+}
+
+macro_result_t macro_record_commit(uint8_t *slot_out, uint16_t *count) {
+  if (!macro_recording()) {
+    return MACRO_ERR_BUSY;
+  }
+  uint8_t slot = macro_record_slot;
+  macro_record_slot = MACRO_NO_SLOT;
+  *slot_out = slot;
+  *count = macro_buf.header.count;
+  if (macro_record_overflow) {
+    return MACRO_ERR_FULL;
+  }
+  macro_buf.header.crc = macro_events_crc(&macro_buf.header);
+  size_t used = sizeof(macro_header_t) +
+                (size_t)macro_buf.header.count * sizeof(macro_event_t);
+  macro_flash_op_t op = {
+    .offset = macro_slot_offset(slot),
+    .program_len = (uint32_t)((used + FLASH_PAGE_SIZE - 1) &
+                              ~(size_t)(FLASH_PAGE_SIZE - 1)),
+  };
+  macro_result_t result = macro_flash_run(&op);
+  if (result == MACRO_OK) {
+    macro_cache_slot = slot;
+  }
+  return result;
+}
+
+macro_result_t macro_load(uint8_t slot, const macro_header_t **header) {
+  if (!macro_region_ok) {
+    return MACRO_ERR_UNAVAILABLE;
+  }
+  if (slot >= PUSBKB_MACRO_SLOTS) {
+    return MACRO_ERR_SLOT;
+  }
+  if (macro_recording()) {
+    return MACRO_ERR_BUSY;
+  }
+  if (macro_cache_slot != slot) {
+    const macro_header_t *stored = macro_slot_xip(slot);
+    if (stored->magic != PUSBKB_MACRO_MAGIC ||
+        stored->count > PUSBKB_MACRO_MAX_EVENTS ||
+        macro_events_crc(stored) != stored->crc) {
+      return MACRO_ERR_EMPTY;
+    }
+    memcpy(macro_buf.bytes, stored,
+           sizeof(macro_header_t) + (size_t)stored->count * sizeof(macro_event_t));
+    macro_cache_slot = slot;
+  }
+  *header = &macro_buf.header;
+  return MACRO_OK;
+}
+
+macro_result_t macro_erase(uint8_t slot) {
+  if (!macro_region_ok) {
+    return MACRO_ERR_UNAVAILABLE;
+  }
+  if (slot >= PUSBKB_MACRO_SLOTS) {
+    return MACRO_ERR_SLOT;
+  }
+  if (macro_recording()) {
+    return MACRO_ERR_BUSY;
+  }
+  if (macro_cache_slot == slot) {
+    macro_cache_slot = MACRO_NO_SLOT;
+  }
+  macro_flash_op_t op = { .offset = macro_slot_offset(slot) };
+  return macro_flash_run(&op);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Named event sequences stored in a reserved region at the end of flash.
+//
+// Each slot is PUSBKB_MACRO_SLOT_SIZE bytes (whole erase sectors) holding a
+// macro_header_t followed by `count` macro_event_t records, readable in place
+// through XIP. Recording builds the image in a RAM buffer and programs the slot
+// on commit; playback copies the slot back into the same buffer once, so
+// repeated plays of one macro never touch flash.
+#ifndef PUSBKB_MACRO_SLOTS
+#define PUSBKB_MACRO_SLOTS 8
+#endif
+#ifndef PUSBKB_MACRO_SLOT_SIZE
+#define PUSBKB_MACRO_SLOT_SIZE 4096
+#endif
+
+#define PUSBKB_MACRO_MAGIC    0x3152434Du // "MCR1"
+#define PUSBKB_MACRO_NAME_LEN 16
+
+typedef struct {
+  uint32_t magic;
+  uint16_t count;
+  uint16_t crc;   // frame_crc16() over the event records
+  char name[PUSBKB_MACRO_NAME_LEN]; // not NUL-terminated when full
+} macro_header_t;
+
+// Stored event, independent of the in-RAM key_event_t layout.
+typedef struct {
+  uint16_t code;
+  uint8_t type;
+  uint8_t modifier;
+  uint8_t flags;
+  uint8_t reserved;
+  uint16_t pad;
+  uint32_t delay_us;
+} macro_event_t;
+
+_Static_assert(sizeof(macro_header_t) == 24, "macro_header_t layout");
+_Static_assert(sizeof(macro_event_t) == 12, "macro_event_t layout");
+
+#define PUSBKB_MACRO_MAX_EVENTS \
+  ((PUSBKB_MACRO_SLOT_SIZE - sizeof(macro_header_t)) / sizeof(macro_event_t))
+
+// Result codes, sent back in PUSBKB_FRAME_TYPE_MACRO frames.
+typedef enum {
+  MACRO_OK = 0,
+  MACRO_ERR_SLOT,        // slot number out of range
+  MACRO_ERR_EMPTY,       // slot erased, or its contents fail the CRC
+  MACRO_ERR_FULL,        // recording overflowed the slot; nothing was stored
+  MACRO_ERR_BUSY,        // not while recording/playing, or nothing to commit
+  MACRO_ERR_UNAVAILABLE, // the reserved region overlaps the firmware image
+} macro_result_t;
+
+// Checks the reserved region against the image. Call once at boot.
+void macro_init(void);
+bool macro_available(void);
+
+// Recording. Events added between begin and commit go to the RAM buffer; commit
+// erases and programs the slot, which blocks both cores for tens of ms.
+macro_result_t macro_record_begin(uint8_t slot, const char *name, uint8_t name_len);
+bool macro_recording(void);
+void macro_record_add(const macro_event_t *event);
+macro_result_t macro_record_commit(uint8_t *slot, uint16_t *count);
+
+// Loads `slot` into the RAM buffer (a no-op if it is already there) and returns
+// its image. The pointer stays valid until the next recording starts.
+macro_result_t macro_load(uint8_t slot, const macro_header_t **header);
+macro_result_t macro_erase(uint8_t slot);
+
+static inline const macro_event_t *macro_events(const macro_header_t *header) {
+  return (const macro_event_t *)(header + 1);
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -8,16 +8,37 @@
 #include <string.h>
 
 #include "hardware/clocks.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 #include "hardware/uart.h"
 #include "hardware/watchdog.h"
+#include "pico/multicore.h"
 #include "pico/stdlib.h"
 #include "pico/stdio.h"
 #include "pico/stdio_uart.h"
 
 #include "class/hid/hid_device.h"
+#include "config.h"
+#include "frame.h"
+#include "hal.h"
+#include "hid_ack.h"
 #include "hid_reports.h"
+#include "hid_sched.h"
+#include "key_queue.h"
+#include "latency.h"
 #include "log.h"
+#include "macro.h"
+#include "spsc_ring.h"
+#include "stats.h"
 #include "tusb.h"
+#include "uart_parser.h"
+#include "usb_cdc.h"
+#include "usb_descriptors.h"
+
+// pico_flash is only linked for the flash writers (see CMakeLists.txt).
+#if PUSBKB_MACROS || PUSBKB_CONFIG_STORE
+#include "pico/flash.h"
+#endif
 
 // --------------------------------------------------------------------
 // Watchdog configuration
@@ -26,69 +47,76 @@
 // Watchdog timeout in milliseconds. Main loop should iterate in milliseconds.
 #define WATCHDOG_TIMEOUT_MS 8000
 
-// --------------------------------------------------------------------
-// UART protocol -> HID mapping
-//
-// Packet format (5 bytes):
-//   [type] [code_lo] [code_hi] [modifier] [flags]
-//
-// type byte:
-//   - low nibble: 0 = keyboard, 1 = consumer
-//   - bit 7: set for release, clear for press
-//
-// Keyboard payload: 16-bit code + modifier byte
-// Consumer payload: 16-bit usage (little-endian)
-// --------------------------------------------------------------------
+// Longest either core sleeps with nothing to do. Work normally wakes them
+// sooner: UART and USB interrupts, deadlines, and a SEV when the other core
+// has moved the event queue. This bounds the gaps between watchdog feeds and
+// core1 heartbeats.
+#define IDLE_WAKE_MS 250
 
-typedef struct {
-  uint16_t keycode;
-  uint8_t modifier;
-  bool apple_fn;
-} hid_key_t;
-
-typedef enum {
-  RX_MODE_TYPE = 0,
-  RX_MODE_CODE_LO,
-  RX_MODE_CODE_HI,
-  RX_MODE_MODIFIER,
-  RX_MODE_FLAGS,
-} uart_rx_mode_t;
-
-// Small ring buffer to absorb CDC bursts without blocking USB tasks.
-// This lives on core0 and feeds the multicore FIFO opportunistically.
-#define PUSBKB_QUEUE_LEN 64
-static uint64_t key_queue[PUSBKB_QUEUE_LEN];
-static uint16_t key_queue_head = 0;
-static uint16_t key_queue_tail = 0;
+// core0 parses UART packets and pushes, core1 pops (hid_sched.c). With
+// PUSBKB_HID_AUX_QUEUE consumer events have a queue of their own.
+static key_event_t key_queue_storage[PUSBKB_QUEUE_LEN];
+static key_queue_t key_queue = KEY_QUEUE_INIT(key_queue_storage);
+#if PUSBKB_HID_AUX_QUEUE
+static key_event_t aux_queue_storage[PUSBKB_AUX_QUEUE_LEN];
+static key_queue_t aux_queue = KEY_QUEUE_INIT(aux_queue_storage);
+#endif
 
-static bool key_queue_is_empty(void) {
-  return key_queue_head == key_queue_tail;
+// Events pushed onto / taken off the queues so far, all queues together. The
+// loops compare these to decide whether to wake the other core; consumed is
+// what credit frames and HID acks report.
+static uint32_t PUSBKB_RAM_FUNC(events_pushed)(void) {
+#if PUSBKB_HID_AUX_QUEUE
+  return key_queue.head + aux_queue.head;
+#else
+  return key_queue.head;
+#endif
 }
 
-static size_t key_queue_free_space(void) {
-  if (key_queue_head >= key_queue_tail) {
-    return PUSBKB_QUEUE_LEN - (key_queue_head - key_queue_tail) - 1;
-  }
-  return (key_queue_tail - key_queue_head) - 1;
+static uint32_t PUSBKB_RAM_FUNC(events_popped)(void) {
+#if PUSBKB_HID_AUX_QUEUE
+  return key_queue.tail + aux_queue.tail;
+#else
+  return key_queue.tail;
+#endif
 }
 
-static bool key_queue_push(uint64_t packed) {
-  if (key_queue_free_space() == 0) {
-    return false;
-  }
-  key_queue[key_queue_head] = packed;
-  key_queue_head = (uint16_t)((key_queue_head + 1) % PUSBKB_QUEUE_LEN);
-  return true;
+static uint32_t PUSBKB_RAM_FUNC(events_consumed)(void) {
+#if PUSBKB_HID_AUX_QUEUE
+  return key_queue.consumed + aux_queue.consumed;
+#else
+  return key_queue.consumed;
+#endif
 }
 
-static bool key_queue_pop(uint64_t *out) {
-  if (key_queue_is_empty()) {
-    return false;
-  }
-  *out = key_queue[key_queue_tail];
-  key_queue_tail = (uint16_t)((key_queue_tail + 1) % PUSBKB_QUEUE_LEN);
-  return true;
-}
+// More counters for pusbkb_stats_t; the HID ones live in hid_sched.c. Loop
+// times are the longest pass through each main loop, not counting sleep.
+static volatile uint32_t core1_loop_max_us = 0;
+// core0 counters for pusbkb_stats_t.
+static uint32_t core0_loop_max_us = 0;
+static uint32_t watchdog_margin_ms = WATCHDOG_TIMEOUT_MS;
+
+// Bumped by core1 every loop iteration; core0 only feeds the watchdog while
+// it keeps moving, so a wedged USB core still resets the board.
+static volatile uint32_t core1_heartbeat = 0;
+
+// Reset record (pusbkb_reset_cause_t). Watchdog scratch registers 0-2 survive
+// every reset but power-on, and the SDK's watchdog_reboot() only uses 4-7.
+// They hold a magic with the boot count, the uptime at the last feed, and
+// whether core0 had stopped feeding because core1 stalled. Plain register
+// stores, so keeping them costs nothing at boot or per feed.
+#define RESET_RECORD_MAGIC   0x5242u // "RB"
+#define RESET_SCRATCH_BOOT   0       // magic << 16 | boot count
+#define RESET_SCRATCH_UPTIME 1       // ms since boot at the last feed
+#define RESET_SCRATCH_STALL  2       // PUSBKB_RESET_CORE1_STALL while not feeding for it
+
+typedef struct {
+  uint8_t cause;
+  uint32_t boot_count;
+  uint32_t uptime_ms;
+} reset_record_t;
+
+static reset_record_t reset_record;
 
 // UART configuration defaults (overridable via compile definitions).
 #ifndef PUSBKB_UART_INDEX
@@ -103,310 +131,1513 @@ static bool key_queue_pop(uint64_t *out) {
 #ifndef PUSBKB_UART_RX_PIN
 #define PUSBKB_UART_RX_PIN 1
 #endif
+// Hardware flow control pins (-1 = unused). RTS is only deasserted once the
+// RX ring and the event queue are both full, so the sender pauses instead of
+// losing events.
+#ifndef PUSBKB_UART_CTS_PIN
+#define PUSBKB_UART_CTS_PIN -1
+#endif
+#ifndef PUSBKB_UART_RTS_PIN
+#define PUSBKB_UART_RTS_PIN -1
+#endif
+#define PUSBKB_UART_HW_FLOW (PUSBKB_UART_RTS_PIN >= 0)
+// Credit flow control: periodically report free event queue slots on TX.
+#ifndef PUSBKB_FLOW_CREDITS
+#define PUSBKB_FLOW_CREDITS 0
+#endif
+#ifndef PUSBKB_CREDIT_INTERVAL_MS
+#define PUSBKB_CREDIT_INTERVAL_MS 20
+#endif
 #ifndef PUSBKB_HID_TEST
 #define PUSBKB_HID_TEST 0
 #endif
+#ifndef PUSBKB_HID_TEST_PATTERN
+#define PUSBKB_HID_TEST_PATTERN PUSBKB_TEST_PATTERN_SHIFT_A
+#endif
+#ifndef PUSBKB_HID_TEST_RATE
+#define PUSBKB_HID_TEST_RATE 1
+#endif
+#ifndef PUSBKB_MACROS
+#define PUSBKB_MACROS 0
+#endif
+// Runtime baud rate changes (PUSBKB_FRAME_CMD_SET_BAUD) fall back to the old
+// rate unless a valid frame arrives at the new one within this.
+#ifndef PUSBKB_UART_BAUD_CONFIRM_MS
+#define PUSBKB_UART_BAUD_CONFIRM_MS 1000
+#endif
+// Auto-baud: at boot, cycle through uart_autobaud_rates until a valid frame
+// arrives, staying on each for the dwell time. Gives up after the timeout and
+// stays at PUSBKB_UART_BAUDRATE.
+#ifndef PUSBKB_UART_AUTOBAUD
+#define PUSBKB_UART_AUTOBAUD 0
+#endif
+#ifndef PUSBKB_UART_AUTOBAUD_DWELL_MS
+#define PUSBKB_UART_AUTOBAUD_DWELL_MS 50
+#endif
+#ifndef PUSBKB_UART_AUTOBAUD_TIMEOUT_MS
+#define PUSBKB_UART_AUTOBAUD_TIMEOUT_MS 5000
+#endif
+// RX ring between the UART IRQ and the parser (must be a power of two).
+#ifndef PUSBKB_UART_RX_RING_LEN
+#define PUSBKB_UART_RX_RING_LEN 1024
+#endif
+
+_Static_assert((PUSBKB_UART_RX_RING_LEN & (PUSBKB_UART_RX_RING_LEN - 1)) == 0,
+               "PUSBKB_UART_RX_RING_LEN must be a power of two");
+
+// The UART IRQ drains the 32-byte hardware FIFO into this ring so RX keeps up
+// regardless of how long the main loop takes to come back to the parser.
+static uint8_t uart_rx_ring_storage[PUSBKB_UART_RX_RING_LEN];
+static spsc_ring_t uart_rx_ring = SPSC_RING_INIT(uart_rx_ring_storage);
+static volatile uint32_t uart_rx_ring_overflows = 0;
+static volatile uint32_t uart_rx_hw_overruns = 0;
+#if PUSBKB_LATENCY_STATS
+// Time of the last RX IRQ that moved bytes into the ring.
+static volatile uint32_t uart_rx_irq_us = 0;
+#endif
+
+// Link a command arrived on; its reply goes back the same way.
+typedef enum {
+  REPLY_UART = 0,
+  REPLY_CDC,
+} reply_channel_t;
 
+// core0 state around the parsers.
 typedef struct {
-  uart_rx_mode_t rx_mode;
-  uint8_t pending_type;
-  uint8_t pending_code_lo;
-  uint8_t pending_code_hi;
-  uint8_t pending_modifier;
-  uint8_t pending_flags;
-  uint32_t dropped_queue;
-  absolute_time_t last_rx_time;
-  bool last_rx_time_valid;
+  uart_parser_t parser;
+#if PUSBKB_USB_CDC
+  uart_parser_t cdc_parser;
+#endif
+  uint32_t reported_framing_errors;
+  uint32_t reported_text_chars;
+  uint32_t reported_ring_overflows;
+  uint32_t reported_hw_overruns;
+  uint32_t reported_high_water;
+  uint32_t reported_reports_saved;
+  absolute_time_t last_credit_time;
+  uint32_t last_credit_free; // event_credit_free()
+  uint8_t credit_requests; // bit per reply_channel_t
+#if PUSBKB_MACROS
+  // Macro being replayed into the event queue (events == NULL when idle).
+  const macro_event_t *macro_events;
+  uint16_t macro_count;
+  uint16_t macro_pos;
+  uint8_t macro_slot;
+  reply_channel_t macro_reply;
+#endif
 } uart_rx_state_t;
 
+// core0 owns it; core1 only reads counters for the stats feature report.
+static uart_rx_state_t uart_rx_state PUSBKB_CORE0_DATA("uart_rx_state");
+
+static reply_channel_t reply_channel(const uart_parser_t *parser) {
+#if PUSBKB_USB_CDC
+  if (parser == &uart_rx_state.cdc_parser) {
+    return REPLY_CDC;
+  }
+#else
+  (void)parser;
+#endif
+  return REPLY_UART;
+}
+
+// Credit accounting. The rule in credit frames, (sent - consumed - discarded)
+// below `capacity`, only holds if `consumed` counts the sender's own events,
+// so every queue slot remembers where its event came from: a link
+// (reply_channel_t), or EVENT_SOURCE_LOCAL for macro playback and the test
+// generator. core0 tags a slot right after pushing into it and counts the
+// tags the consumer has passed before a slot comes round again.
+#define EVENT_SOURCE_LOCAL 2
+
+typedef struct {
+  key_queue_t *queue;
+  uint8_t *sources;   // per queue slot
+  uint32_t accounted; // queue position the counts below are up to date with
+  // Per reply_channel_t: events taken off the queue, and events recorded into
+  // a macro instead of queued.
+  uint32_t consumed[2];
+  uint32_t recorded[2];
+} event_credit_t;
+
+static uint8_t key_queue_sources[PUSBKB_QUEUE_LEN];
+static event_credit_t key_credit = {.queue = &key_queue,
+                                    .sources = key_queue_sources};
+#if PUSBKB_HID_AUX_QUEUE
+static uint8_t aux_queue_sources[PUSBKB_AUX_QUEUE_LEN];
+static event_credit_t aux_credit = {.queue = &aux_queue,
+                                    .sources = aux_queue_sources};
+#endif
+
+static event_credit_t *PUSBKB_RAM_FUNC(event_credit)(uint8_t type) {
+#if PUSBKB_HID_AUX_QUEUE
+  if (hid_sched_queue(type) == &aux_queue) {
+    return &aux_credit;
+  }
+#else
+  (void)type;
+#endif
+  return &key_credit;
+}
+
+static void PUSBKB_RAM_FUNC(event_credit_account)(event_credit_t *credit) {
+  uint32_t tail = credit->queue->tail;
+  for (; credit->accounted != tail; credit->accounted++) {
+    uint8_t source = credit->sources[credit->accounted & credit->queue->mask];
+    if (source != EVENT_SOURCE_LOCAL) {
+      credit->consumed[source]++;
+    }
+  }
+}
+
+// hid_sched_push() for core0, tagging the event with its source.
+static bool PUSBKB_RAM_FUNC(events_push)(const key_event_t *event,
+                                         uint8_t source) {
+  event_credit_t *credit = event_credit(event->type);
+  if (!hid_sched_push(event)) {
+    return false;
+  }
+  uint32_t seq = credit->queue->head - 1;
+  if (seq - credit->accounted >= key_queue_capacity(credit->queue)) {
+    // The slot's previous event is gone (the push succeeded); count it first.
+    event_credit_account(credit);
+  }
+  credit->sources[seq & credit->queue->mask] = source;
+  return true;
+}
+
+// One queue's part of a credit frame for `channel`: free, capacity, consumed
+// and discarded (`dropped` by the parser plus recorded). Returns its length.
+static uint8_t event_credit_put(uint8_t *out, event_credit_t *credit,
+                                reply_channel_t channel, uint32_t dropped) {
+  event_credit_account(credit);
+  frame_put_u16(&out[0], (uint16_t)key_queue_free_space(credit->queue));
+  frame_put_u16(&out[2], (uint16_t)key_queue_capacity(credit->queue));
+  frame_put_u32(&out[4], credit->consumed[channel]);
+  frame_put_u32(&out[8], dropped + credit->recorded[channel]);
+  return 12;
+}
+
+// Free slots of every queue in one value, to tell when a credit frame is due.
+static uint32_t event_credit_free(void) {
+  uint32_t free_slots = (uint32_t)key_queue_free_space(&key_queue);
+#if PUSBKB_HID_AUX_QUEUE
+  free_slots |= (uint32_t)key_queue_free_space(&aux_queue) << 16;
+#endif
+  return free_slots;
+}
+
+#if PUSBKB_MULTIDROP
+// How UART replies to the command being handled go out. A command sent to this
+// board's address is answered with the address wrapped around the reply, so a
+// controller talking to several boards can tell them apart. Broadcast commands
+// get no reply, so boards sharing a TX line do not talk over each other.
+typedef enum {
+  REPLY_PLAIN = 0,
+  REPLY_ADDRESSED,
+  REPLY_MUTED,
+} reply_mode_t;
+
+static reply_mode_t reply_mode = REPLY_PLAIN;
+#endif
+
+static void reply_write_frame(reply_channel_t channel, const uint8_t *payload,
+                              uint8_t len) {
+#if PUSBKB_USB_CDC
+  if (channel == REPLY_CDC) {
+    (void)usb_cdc_write_frame(payload, len);
+    return;
+  }
+#else
+  (void)channel;
+#endif
+#if PUSBKB_MULTIDROP
+  if (reply_mode == REPLY_MUTED) {
+    return;
+  }
+  if (reply_mode == REPLY_ADDRESSED && len <= PUSBKB_FRAME_MAX_PAYLOAD - 2) {
+    uint8_t wrapped[PUSBKB_FRAME_MAX_PAYLOAD];
+    wrapped[0] = PUSBKB_FRAME_ADDRESSED;
+    wrapped[1] = uart_rx_state.parser.address;
+    memcpy(&wrapped[2], payload, len);
+    log_write_frame(wrapped, (uint8_t)(len + 2));
+    return;
+  }
+#endif
+  log_write_frame(payload, len);
+}
+
 static uart_inst_t *get_uart_instance(void) {
   return (PUSBKB_UART_INDEX == 0) ? uart0 : uart1;
 }
 
-static void uart_configure(void) {
+#define UART_RX_IRQ_BITS (UART_UARTIMSC_RXIM_BITS | UART_UARTIMSC_RTIM_BITS)
+
+// Shared UART IRQ: RX drains into uart_rx_ring, TX is fed from the log ring.
+static void PUSBKB_RAM_FUNC(uart_irq_handler)(void) {
+  uart_hw_t *hw = uart_get_hw(get_uart_instance());
+#if PUSBKB_LATENCY_STATS
+  if ((hw->fr & UART_UARTFR_RXFE_BITS) == 0) {
+    uart_rx_irq_us = time_us_32();
+  }
+#endif
+  while ((hw->fr & UART_UARTFR_RXFE_BITS) == 0) {
+#if PUSBKB_UART_HW_FLOW
+    if (spsc_ring_free(&uart_rx_ring) == 0) {
+      // Leave bytes in the hardware FIFO so RTS throttles the sender;
+      // uart_handle_input() re-enables RX once the ring has room.
+      hw_clear_bits(&hw->imsc, UART_RX_IRQ_BITS);
+      break;
+    }
+#endif
+    uint32_t data = hw->dr;
+    if (data & UART_UARTDR_OE_BITS) {
+      uart_rx_hw_overruns++;
+    }
+    if (!spsc_ring_push(&uart_rx_ring, (uint8_t)data)) {
+      uart_rx_ring_overflows++;
+    }
+  }
+  if (hw->mis & UART_UARTMIS_TXMIS_BITS) {
+    log_uart_tx_irq();
+  }
+}
+
+static void uart_configure(uint32_t baud) {
   uart_inst_t *uart = get_uart_instance();
-  uart_init(uart, PUSBKB_UART_BAUDRATE);
+  uart_init(uart, baud);
   gpio_set_function(PUSBKB_UART_TX_PIN, GPIO_FUNC_UART);
   gpio_set_function(PUSBKB_UART_RX_PIN, GPIO_FUNC_UART);
   uart_set_format(uart, 8, 1, UART_PARITY_NONE);
-  uart_set_hw_flow(uart, false, false);
   uart_set_fifo_enabled(uart, true);
-  stdio_uart_init_full(uart, PUSBKB_UART_BAUDRATE,
-                       PUSBKB_UART_TX_PIN, PUSBKB_UART_RX_PIN);
-}
-
-static void uart_update_state(uart_rx_state_t *state) {
-  if (state->rx_mode != RX_MODE_TYPE && state->last_rx_time_valid) {
-    int64_t age_us = absolute_time_diff_us(state->last_rx_time,
-                                           get_absolute_time());
-    if (age_us > 200000) {
-      // Drop an incomplete packet if the payload never arrives.
-      state->rx_mode = RX_MODE_TYPE;
-      state->pending_type = 0;
-      state->pending_code_lo = 0;
-      state->pending_code_hi = 0;
-      state->pending_modifier = 0;
-      state->pending_flags = 0;
-      state->last_rx_time_valid = false;
-    }
+  // stdio only gets TX (for SDK panics); RX belongs to the packet parser and
+  // regular logging goes through the async log ring.
+  stdio_uart_init_full(uart, baud, PUSBKB_UART_TX_PIN, -1);
+  log_init(uart);
+#if PUSBKB_UART_CTS_PIN >= 0
+  gpio_set_function(PUSBKB_UART_CTS_PIN, GPIO_FUNC_UART);
+#endif
+#if PUSBKB_UART_RTS_PIN >= 0
+  gpio_set_function(PUSBKB_UART_RTS_PIN, GPIO_FUNC_UART);
+#endif
+  uart_set_hw_flow(uart, PUSBKB_UART_CTS_PIN >= 0, PUSBKB_UART_RTS_PIN >= 0);
+
+  // RX IRQ fires at the FIFO threshold, RX timeout covers the trailing bytes.
+  // The log ring enables the TX IRQ on demand.
+  unsigned irq_num = (PUSBKB_UART_INDEX == 0) ? UART0_IRQ : UART1_IRQ;
+  irq_set_exclusive_handler(irq_num, uart_irq_handler);
+  irq_set_enabled(irq_num, true);
+  uart_set_irq_enables(uart, true, false);
+}
+
+// --------------------------------------------------------------------
+// Runtime baud rate
+//
+// SET_BAUD [baud u32] is answered with SWITCHING at the current rate. Once
+// that (and any queued log output) has left the UART, the link moves to the
+// new rate and waits for the host to send any valid v2 frame there; the
+// device answers CONFIRMED at the new rate, or goes back and answers REVERTED
+// at the old one after PUSBKB_UART_BAUD_CONFIRM_MS. Bytes received around a
+// switch are discarded.
+// --------------------------------------------------------------------
+
+// PL011 limits: the divisor is 16 * (1..65535 + n/64), and rates far from the
+// target fail on the wire anyway.
+#define UART_BAUD_MIN 1200
+#define UART_BAUD_MAX 4000000
+// Log output still queued after this long is sent at the new rate.
+#define UART_BAUD_DRAIN_MS 500
+
+typedef enum {
+  UART_BAUD_IDLE = 0,
+  UART_BAUD_DRAINING,   // SWITCHING sent, waiting for TX to go idle
+  UART_BAUD_CONFIRMING, // at the new rate, waiting for a valid frame
+  UART_BAUD_SCANNING,   // auto-baud
+} uart_baud_state_t;
+
+typedef struct {
+  uart_baud_state_t state;
+  uint32_t baud;          // current rate
+  uint32_t pending_baud;  // DRAINING: rate to move to
+  uint32_t previous_baud; // CONFIRMING: rate to fall back to
+  uint32_t frames_seen;   // parser frame count when the rate last changed
+  absolute_time_t deadline;
+#if PUSBKB_UART_AUTOBAUD
+  int8_t candidate;       // index into uart_autobaud_rates, -1 = not started
+  absolute_time_t scan_end;
+#endif
+} uart_baud_t;
+
+static uart_baud_t uart_baud;
+
+#if PUSBKB_UART_AUTOBAUD
+// Common adapter rates, most likely first.
+static const uint32_t uart_autobaud_rates[] = {
+  115200, 921600, 3000000, 2000000, 1500000, 1000000,
+  460800, 230400, 57600, 38400, 19200, 9600,
+};
+#endif
+
+static void uart_send_baud(reply_channel_t reply, pusbkb_baud_result_t result,
+                           uint32_t baud) {
+  uint8_t payload[6];
+  payload[0] = PUSBKB_FRAME_TYPE_BAUD;
+  payload[1] = (uint8_t)result;
+  frame_put_u32(&payload[2], baud);
+  reply_write_frame(reply, payload, sizeof(payload));
+}
+
+// Whether the divisor the SDK would pick for `baud` lands within 2%.
+static bool uart_baud_supported(uint32_t baud) {
+  if (baud < UART_BAUD_MIN || baud > UART_BAUD_MAX) {
+    return false;
+  }
+  uint32_t clk = clock_get_hz(clk_peri);
+  // Same rounding as uart_set_baudrate(): divisor in 1/64ths.
+  uint64_t div64 = ((8ull * clk / baud) + 1) / 2;
+  if (div64 < 64 || div64 > 65535ull * 64) {
+    return false;
   }
+  uint64_t actual = 4ull * clk / div64;
+  uint64_t error = (actual > baud) ? actual - baud : baud - actual;
+  return error * 50 <= baud;
 }
 
-static void uart_handle_input(uart_rx_state_t *state) {
-  uart_inst_t *uart = get_uart_instance();
-  while (uart_is_readable(uart)) {
-    uint8_t byte = uart_getc(uart);
-    state->last_rx_time = get_absolute_time();
-    state->last_rx_time_valid = true;
-    switch (state->rx_mode) {
-      case RX_MODE_TYPE:
-        state->pending_type = byte;
-        state->rx_mode = RX_MODE_CODE_LO;
-        break;
-      case RX_MODE_CODE_LO:
-        state->pending_code_lo = byte;
-        state->rx_mode = RX_MODE_CODE_HI;
-        break;
-      case RX_MODE_CODE_HI:
-        state->pending_code_hi = byte;
-        state->rx_mode = RX_MODE_MODIFIER;
+// Reprograms the divisor and forgets everything received so far, which is
+// noise at one of the two rates.
+static void uart_apply_baud(uint32_t baud) {
+  uart_set_baudrate(get_uart_instance(), baud);
+  uart_baud.baud = baud;
+  const uint8_t *chunk;
+  uint32_t len;
+  while ((len = spsc_ring_peek(&uart_rx_ring, &chunk)) != 0) {
+    spsc_ring_consume(&uart_rx_ring, len);
+  }
+  uart_parser_reset(&uart_rx_state.parser);
+  uart_baud.frames_seen = uart_rx_state.parser.frames;
+}
+
+// A saved rate (fast boot) is trusted as is: no autobaud scan.
+static void uart_baud_init(uint32_t baud, bool saved) {
+  uart_baud.baud = baud;
+  (void)saved;
+#if PUSBKB_UART_AUTOBAUD
+  if (saved) {
+    return;
+  }
+  uart_baud.state = UART_BAUD_SCANNING;
+  uart_baud.candidate = -1;
+  uart_baud.scan_end = make_timeout_time_ms(PUSBKB_UART_AUTOBAUD_TIMEOUT_MS);
+#endif
+}
+
+// SET_BAUD handler. The command frame itself confirms a switch in progress.
+static void uart_baud_request(reply_channel_t reply, uint32_t baud) {
+  if (uart_baud.state == UART_BAUD_CONFIRMING) {
+    uart_baud.state = UART_BAUD_IDLE;
+    uart_send_baud(REPLY_UART, PUSBKB_BAUD_CONFIRMED, uart_baud.baud);
+  }
+  if (reply != REPLY_UART || uart_baud.state != UART_BAUD_IDLE ||
+      !uart_baud_supported(baud)) {
+    uart_send_baud(reply, PUSBKB_BAUD_REJECTED, uart_baud.baud);
+    return;
+  }
+  if (baud == uart_baud.baud) {
+    uart_send_baud(reply, PUSBKB_BAUD_CONFIRMED, baud);
+    return;
+  }
+  uart_send_baud(REPLY_UART, PUSBKB_BAUD_SWITCHING, baud);
+  uart_baud.pending_baud = baud;
+  uart_baud.state = UART_BAUD_DRAINING;
+  uart_baud.deadline = make_timeout_time_ms(UART_BAUD_DRAIN_MS);
+}
+
+static void uart_baud_task(void) {
+  bool got_frame = uart_rx_state.parser.frames != uart_baud.frames_seen;
+  switch (uart_baud.state) {
+    case UART_BAUD_IDLE:
+      break;
+    case UART_BAUD_DRAINING:
+      if (log_tx_idle() || time_reached(uart_baud.deadline)) {
+        uart_baud.previous_baud = uart_baud.baud;
+        uart_apply_baud(uart_baud.pending_baud);
+        uart_baud.state = UART_BAUD_CONFIRMING;
+        uart_baud.deadline = make_timeout_time_ms(PUSBKB_UART_BAUD_CONFIRM_MS);
+      }
+      break;
+    case UART_BAUD_CONFIRMING:
+      if (got_frame) {
+        uart_baud.state = UART_BAUD_IDLE;
+        uart_send_baud(REPLY_UART, PUSBKB_BAUD_CONFIRMED, uart_baud.baud);
+        LOG_INFO("UART at %lu baud", (unsigned long)uart_baud.baud);
+      } else if (time_reached(uart_baud.deadline)) {
+        uart_apply_baud(uart_baud.previous_baud);
+        uart_baud.state = UART_BAUD_IDLE;
+        uart_send_baud(REPLY_UART, PUSBKB_BAUD_REVERTED, uart_baud.baud);
+        LOG_WARN("UART baud switch not confirmed, back at %lu",
+                 (unsigned long)uart_baud.baud);
+      }
+      break;
+    case UART_BAUD_SCANNING:
+#if PUSBKB_UART_AUTOBAUD
+      if (uart_baud.candidate < 0) {
+        // Let the boot log out at the default rate first.
+        if (!log_tx_idle()) {
+          break;
+        }
+      } else if (got_frame) {
+        uart_baud.state = UART_BAUD_IDLE;
+        uart_send_baud(REPLY_UART, PUSBKB_BAUD_CONFIRMED, uart_baud.baud);
+        LOG_INFO("Auto-baud: %lu", (unsigned long)uart_baud.baud);
         break;
-      case RX_MODE_MODIFIER:
-        state->pending_modifier = byte;
-        state->rx_mode = RX_MODE_FLAGS;
+      } else if (time_reached(uart_baud.scan_end)) {
+        uart_apply_baud(PUSBKB_UART_BAUDRATE);
+        uart_baud.state = UART_BAUD_IDLE;
+        LOG_INFO("Auto-baud: no frames, staying at %lu",
+                 (unsigned long)uart_baud.baud);
         break;
-      case RX_MODE_FLAGS: {
-        state->pending_flags = byte;
-        uint16_t code = ((uint16_t)state->pending_code_hi << 8) |
-                        state->pending_code_lo;
-        LOG_DEBUG("Serial pkt: type=0x%02x code=0x%04x mod=0x%02x flags=0x%02x",
-                  state->pending_type, code, state->pending_modifier,
-                  state->pending_flags);
-        uint64_t packed = ((uint64_t)state->pending_type << 32) |
-                          ((uint64_t)state->pending_flags << 24) |
-                          ((uint64_t)state->pending_modifier << 16) |
-                          ((uint64_t)state->pending_code_hi << 8) |
-                          (uint64_t)state->pending_code_lo;
-        if (!key_queue_push(packed)) {
-          state->dropped_queue++;
-          if ((state->dropped_queue & 0x3F) == 1) {
-            LOG_DEBUG("UART RX drop: queue full");
-          }
-        }
-        state->rx_mode = RX_MODE_TYPE;
+      } else if (!time_reached(uart_baud.deadline)) {
         break;
       }
-      default:
-        state->rx_mode = RX_MODE_TYPE;
-        break;
+      uart_baud.candidate = (int8_t)((uart_baud.candidate + 1) %
+          (int)(sizeof(uart_autobaud_rates) / sizeof(uart_autobaud_rates[0])));
+      uart_apply_baud(uart_autobaud_rates[uart_baud.candidate]);
+      uart_baud.deadline = make_timeout_time_ms(PUSBKB_UART_AUTOBAUD_DWELL_MS);
+#endif
+      break;
+  }
+}
+
+// Parser hooks (uart_parser.h).
+
+// Queues a parsed event, or appends it to the macro being recorded.
+bool PUSBKB_RAM_FUNC(uart_parser_event_cb)(uart_parser_t *parser,
+                                           const key_event_t *event) {
+  reply_channel_t source = reply_channel(parser);
+#if PUSBKB_MACROS
+  if (macro_recording()) {
+    macro_event_t stored = {
+      .code = event->code,
+      .type = event->type,
+      .modifier = event->modifier,
+      .flags = event->flags,
+#if PUSBKB_TIMED_EVENTS
+      .delay_us = event->delay_us,
+#endif
+    };
+    macro_record_add(&stored);
+    // Never reaches the queue: a discard as far as the sender's credit goes.
+    event_credit(event->type)->recorded[source]++;
+    return true;
+  }
+#endif
+#if PUSBKB_LATENCY_STATS
+  if (!events_push(event, source)) {
+    return false;
+  }
+  latency_record(PUSBKB_LATENCY_PARSE, event->rx_us, event->queued_us);
+  return true;
+#else
+  return events_push(event, source);
+#endif
+}
+
+bool PUSBKB_RAM_FUNC(uart_parser_space_cb)(uart_parser_t *parser,
+                                           uint8_t type) {
+  (void)parser;
+  return key_queue_free_space(hid_sched_queue(type)) != 0;
+}
+
+// Snapshot of the runtime counters. Callable from either core: every field is
+// a single aligned load, so a snapshot may be skewed but never torn.
+static void stats_add_parser(pusbkb_stats_t *out, const uart_parser_t *parser) {
+  out->rx_bytes += parser->rx_bytes;
+  out->packets += parser->packets;
+  out->framing_errors += parser->framing_errors;
+  out->frame_crc_errors += parser->frame_crc_errors;
+  out->rx_timeouts += parser->rx_timeouts;
+  out->queue_dropped += parser->dropped_queue;
+  out->text_chars_skipped += parser->dropped_text_chars;
+}
+
+static void stats_collect(pusbkb_stats_t *out) {
+  memset(out, 0, sizeof(*out));
+  out->version = PUSBKB_STATS_VERSION;
+  out->uptime_ms = to_ms_since_boot(get_absolute_time());
+  stats_add_parser(out, &uart_rx_state.parser);
+#if PUSBKB_USB_CDC
+  stats_add_parser(out, &uart_rx_state.cdc_parser);
+#endif
+  out->rx_ring_overflows = uart_rx_ring_overflows;
+  out->rx_hw_overruns = uart_rx_hw_overruns;
+  out->queue_high_water = (uint16_t)key_queue.high_water;
+  out->queue_capacity = (uint16_t)PUSBKB_QUEUE_LEN;
+  out->reports_keyboard = hid_reports_keyboard;
+  out->reports_aux = hid_reports_aux;
+  out->reports_saved = hid_reports_saved;
+  out->hid_busy = hid_busy;
+  out->core0_loop_max_us = core0_loop_max_us;
+  out->core1_loop_max_us = core1_loop_max_us;
+  out->watchdog_margin_ms = watchdog_margin_ms;
+  out->log_dropped = log_dropped_count();
+  out->reset_cause = reset_record.cause;
+  out->boot_count = reset_record.boot_count;
+  out->reset_uptime_ms = reset_record.uptime_ms;
+#if PUSBKB_HID_ACK
+  out->ack_dropped = hid_ack_dropped();
+#endif
+}
+
+static void uart_send_stats(reply_channel_t reply) {
+  uint8_t payload[1 + sizeof(pusbkb_stats_t)];
+  pusbkb_stats_t stats;
+  stats_collect(&stats);
+  payload[0] = PUSBKB_FRAME_TYPE_STATS;
+  memcpy(&payload[1], &stats, sizeof(stats));
+  reply_write_frame(reply, payload, sizeof(payload));
+}
+
+#if PUSBKB_LATENCY_STATS
+// One frame per stage. A reset races with core1's increments, so a count taken
+// in that instant can be lost; fine for a histogram.
+static void uart_send_latency(reply_channel_t reply, bool reset) {
+  uint8_t payload[3 + 4 * PUSBKB_LATENCY_BUCKETS];
+  payload[0] = PUSBKB_FRAME_TYPE_LATENCY;
+  payload[2] = PUSBKB_LATENCY_BUCKETS;
+  for (uint8_t stage = 0; stage < PUSBKB_LATENCY_STAGES; stage++) {
+    payload[1] = stage;
+    for (size_t i = 0; i < PUSBKB_LATENCY_BUCKETS; i++) {
+      frame_put_u32(&payload[3 + 4 * i], latency_hist[stage][i]);
+      if (reset) {
+        latency_hist[stage][i] = 0;
+      }
     }
+    reply_write_frame(reply, payload, sizeof(payload));
   }
 }
+#endif
 
-static void hid_send_press_release(const hid_key_t *key, uint8_t *stage) {
-  if (!tud_hid_n_ready(PUSBKB_HID_ITF_KEYBOARD)) {
+#if PUSBKB_MACROS
+static void uart_send_macro_status(reply_channel_t reply, uint8_t cmd,
+                                   uint8_t slot,
+                                   macro_result_t result, uint16_t count,
+                                   const char *name) {
+  uint8_t payload[6 + PUSBKB_MACRO_NAME_LEN];
+  uint8_t len = 6;
+  payload[0] = PUSBKB_FRAME_TYPE_MACRO;
+  payload[1] = cmd;
+  payload[2] = slot;
+  payload[3] = (uint8_t)result;
+  frame_put_u16(&payload[4], count);
+  if (name != NULL) {
+    memcpy(&payload[6], name, PUSBKB_MACRO_NAME_LEN);
+    len += PUSBKB_MACRO_NAME_LEN;
+  }
+  reply_write_frame(reply, payload, len);
+}
+
+// Macro commands run on core0 between packets, so recording sees events in
+// wire order and playback never interleaves with UART input.
+static void uart_handle_macro_command(uart_rx_state_t *state,
+                                      uart_parser_t *parser,
+                                      const uint8_t *payload, uint8_t len) {
+  reply_channel_t reply = reply_channel(parser);
+  uint8_t cmd = payload[0];
+  uint8_t slot = (len > 1) ? payload[1] : 0xFF;
+  const macro_header_t *header = NULL;
+  macro_result_t result;
+  uint16_t count = 0;
+  if (state->macro_events != NULL) {
+    uart_send_macro_status(reply, cmd, slot, MACRO_ERR_BUSY, 0, NULL);
     return;
   }
-  if (*stage == 1) {
-    uint8_t keycodes[6] = {0};
-    keycodes[0] = (uint8_t)key->keycode;
-    struct __attribute__((packed)) {
-      uint8_t modifier;
-      uint8_t apple_fn;
-      uint8_t keycode[6];
-    } report = {
-      .modifier = key->modifier,
-      .apple_fn = key->apple_fn ? 1 : 0,
+  switch (cmd) {
+    case PUSBKB_FRAME_CMD_MACRO_RECORD:
+      result = macro_record_begin(slot, (const char *)&payload[2],
+                                  (len > 2) ? (uint8_t)(len - 2) : 0);
+      break;
+    case PUSBKB_FRAME_CMD_MACRO_COMMIT:
+      result = macro_record_commit(&slot, &count);
+      LOG_INFO("Macro commit: %u events, result %d", count, (int)result);
+      break;
+    case PUSBKB_FRAME_CMD_MACRO_PLAY:
+      result = macro_load(slot, &header);
+      if (result == MACRO_OK) {
+        count = header->count;
+        state->macro_events = macro_events(header);
+        state->macro_count = count;
+        state->macro_pos = 0;
+        state->macro_slot = slot;
+        state->macro_reply = reply;
+        // Acknowledged once the last event is queued (uart_macro_play_task).
+        if (count != 0) {
+          // Later bytes wait until the macro is queued.
+          parser->stop = true;
+          return;
+        }
+        state->macro_events = NULL;
+      }
+      break;
+    case PUSBKB_FRAME_CMD_MACRO_ERASE:
+      result = macro_erase(slot);
+      break;
+    case PUSBKB_FRAME_CMD_MACRO_INFO:
+      result = macro_load(slot, &header);
+      if (result == MACRO_OK) {
+        uart_send_macro_status(reply, cmd, slot, result, header->count,
+                               header->name);
+        return;
+      }
+      break;
+    default:
+      parser->framing_errors++;
+      return;
+  }
+  uart_send_macro_status(reply, cmd, slot, result, count, NULL);
+}
+
+// Feeds the macro being played into the event queue as space frees up. Returns
+// true while playback is still in progress.
+static bool uart_macro_play_task(uart_rx_state_t *state) {
+  if (state->macro_events == NULL) {
+    return false;
+  }
+  while (state->macro_pos < state->macro_count) {
+    const macro_event_t *stored = &state->macro_events[state->macro_pos];
+    key_event_t event = {
+      .code = stored->code,
+      .type = stored->type,
+      .modifier = stored->modifier,
+      .flags = stored->flags,
+#if PUSBKB_TIMED_EVENTS
+      .delay_us = stored->delay_us,
+#endif
     };
-    memcpy(report.keycode, keycodes, sizeof(keycodes));
-    tud_hid_n_report(PUSBKB_HID_ITF_KEYBOARD, 0, &report, sizeof(report));
-    *stage = 2;
-  } else if (*stage == 2) {
-    struct __attribute__((packed)) {
-      uint8_t modifier;
-      uint8_t apple_fn;
-      uint8_t keycode[6];
-    } report = {0};
-    tud_hid_n_report(PUSBKB_HID_ITF_KEYBOARD, 0, &report, sizeof(report));
-    *stage = 0;
-  }
-}
-
-static void hid_send_consumer_press_release(uint16_t usage, uint8_t *stage) {
-  if (!tud_hid_n_ready(PUSBKB_HID_ITF_AUX)) {
-    return;
+#if PUSBKB_LATENCY_STATS
+    // No UART arrival: latency starts at the push.
+    event.rx_us = event.queued_us = time_us_32();
+#endif
+    if (!events_push(&event, EVENT_SOURCE_LOCAL)) {
+      return true;
+    }
+    state->macro_pos++;
   }
-  if (*stage == 1) {
-    tud_hid_n_report(PUSBKB_HID_ITF_AUX, PUSBKB_REPORT_ID_CONSUMER,
-                     &usage, sizeof(usage));
-    *stage = 2;
-  } else if (*stage == 2) {
-    uint16_t zero = 0;
-    tud_hid_n_report(PUSBKB_HID_ITF_AUX, PUSBKB_REPORT_ID_CONSUMER,
-                     &zero, sizeof(zero));
-    *stage = 0;
-  }
-}
-
-static void hid_queue_task(void) {
-  static hid_key_t pending_key = {0};
-  static uint8_t pending_stage = 0; // 0 = idle, 1 = send press, 2 = send release
-  static pusbkb_pkt_type_t pending_type = PUSBKB_PKT_TYPE_KEYBOARD;
-  static uint16_t pending_usage = 0;
-
-  if (pending_stage != 0) {
-    if (pending_type == PUSBKB_PKT_TYPE_KEYBOARD) {
-      hid_send_press_release(&pending_key, &pending_stage);
-    } else if (pending_type == PUSBKB_PKT_TYPE_CONSUMER) {
-      hid_send_consumer_press_release(pending_usage, &pending_stage);
+  uart_send_macro_status(state->macro_reply, PUSBKB_FRAME_CMD_MACRO_PLAY,
+                         state->macro_slot, MACRO_OK, state->macro_count, NULL);
+  state->macro_events = NULL;
+  return false;
+}
+#endif
+
+#if PUSBKB_HID_TEST
+// Synthetic load for benchmarks (bench.py): taps pushed into the event queue
+// on core0 as if they had arrived over the UART, so everything from the queue
+// to the IN transfer runs the normal path. UART input keeps working alongside.
+typedef struct {
+  bool active;
+  reply_channel_t reply; // where the completion frame goes
+  uint8_t pattern;
+  uint16_t rate_hz;
+  uint32_t count;     // 0 = endless
+  uint32_t generated;
+  uint32_t start_us;
+  uint32_t next_us;
+} test_gen_t;
+
+static test_gen_t test_gen;
+
+static void test_gen_start(reply_channel_t reply, uint8_t pattern,
+                           uint16_t rate_hz, uint32_t count) {
+  test_gen.reply = reply;
+  test_gen.pattern = pattern;
+  test_gen.rate_hz = rate_hz;
+  test_gen.count = count;
+  test_gen.generated = 0;
+  test_gen.active = pattern == PUSBKB_TEST_PATTERN_FLOOD || rate_hz != 0;
+  test_gen.start_us = time_us_32();
+  test_gen.next_us = test_gen.start_us;
+}
+
+static void test_gen_task(void) {
+  test_gen_t *gen = &test_gen;
+  bool flood = gen->pattern == PUSBKB_TEST_PATTERN_FLOOD;
+  while (gen->active) {
+    uint32_t now_us = time_us_32();
+    if (!flood && (int32_t)(now_us - gen->next_us) < 0) {
+      return;
+    }
+    key_event_t event = {
+      .code = PUSBKB_KEY_A,
+      .type = PUSBKB_PKT_TYPE_KEYBOARD,
+#if PUSBKB_LATENCY_STATS
+      .rx_us = now_us,
+      .queued_us = now_us,
+#endif
+    };
+    if (gen->pattern == PUSBKB_TEST_PATTERN_SHIFT_A) {
+      event.modifier = PUSBKB_MODIFIER_LEFTSHIFT;
     } else {
-      pending_stage = 0;
+      event.code = (uint16_t)(PUSBKB_KEY_A + gen->generated % 26);
+    }
+    if (!events_push(&event, EVENT_SOURCE_LOCAL)) {
+      return;
+    }
+    gen->generated++;
+    if (!flood) {
+      uint32_t period_us = 1000000u / gen->rate_hz;
+      gen->next_us += period_us;
+      // More than a period behind (the queue was full): carry on from now
+      // instead of bursting to catch up.
+      if ((int32_t)(now_us - gen->next_us) > (int32_t)period_us) {
+        gen->next_us = now_us;
+      }
+    }
+    if (gen->count != 0 && gen->generated == gen->count) {
+      uint8_t payload[10];
+      payload[0] = PUSBKB_FRAME_TYPE_TEST;
+      payload[1] = gen->pattern;
+      frame_put_u32(&payload[2], gen->generated);
+      frame_put_u32(&payload[6], now_us - gen->start_us);
+      reply_write_frame(gen->reply, payload, sizeof(payload));
+      gen->active = false;
     }
-    return;
   }
+}
+#endif
 
-  uint64_t packed;
-  if (key_queue_pop(&packed)) {
-    uint8_t type_byte = (uint8_t)((packed >> 32) & 0xFF);
-    pending_type = (pusbkb_pkt_type_t)(type_byte & PUSBKB_PKT_TYPE_MASK);
-    bool is_release = (type_byte & PUSBKB_PKT_FLAG_RELEASE) != 0;
-
-    if (pending_type == PUSBKB_PKT_TYPE_KEYBOARD) {
-      pending_key.keycode = (uint16_t)(packed & 0xFFFF);
-      pending_key.modifier = (uint8_t)((packed >> 16) & 0xFF);
-      pending_key.apple_fn = ((packed >> 24) & PUSBKB_KBD_FLAG_APPLE_FN) != 0;
-      if (is_release) {
-        struct __attribute__((packed)) {
-          uint8_t modifier;
-          uint8_t apple_fn;
-          uint8_t keycode[6];
-        } report = {0};
-        tud_hid_n_report(PUSBKB_HID_ITF_KEYBOARD, 0, &report, sizeof(report));
-        return;
-      }
-      pending_stage = 1;
+#if PUSBKB_MULTIDROP
+#include "pico/unique_id.h"
+
+// Applies the stored address to the parsers. The CDC port is point to point,
+// so it takes unaddressed input whatever the flags say.
+static void address_apply(const pusbkb_config_t *config) {
+  uart_rx_state.parser.address = config->address;
+  uart_rx_state.parser.addressed_only =
+      (config->address_flags & PUSBKB_ADDRESS_FLAG_ONLY) != 0;
+#if PUSBKB_USB_CDC
+  uart_rx_state.cdc_parser.address = config->address;
+#endif
+}
+
+static void uart_send_address(reply_channel_t reply,
+                              pusbkb_address_result_t result) {
+  const pusbkb_config_t *config = config_get();
+  pico_unique_board_id_t id;
+  pico_get_unique_board_id(&id);
+  uint8_t payload[4 + sizeof(id.id)];
+  payload[0] = PUSBKB_FRAME_TYPE_ADDRESS;
+  payload[1] = (uint8_t)result;
+  payload[2] = config->address;
+  payload[3] = config->address_flags;
+  memcpy(&payload[4], id.id, sizeof(id.id));
+  reply_write_frame(reply, payload, sizeof(payload));
+}
+
+static void uart_handle_set_address(uart_parser_t *parser, reply_channel_t reply,
+                                    const uint8_t *payload, uint8_t len) {
+  pico_unique_board_id_t id;
+  if (len < 3) {
+    parser->framing_errors++;
+    return;
+  }
+  if (len >= 3 + sizeof(id.id)) {
+    pico_get_unique_board_id(&id);
+    if (memcmp(&payload[3], id.id, sizeof(id.id)) != 0) {
       return;
     }
+    // Only this board acts on it, so it may answer even a broadcast.
+    if (reply_mode == REPLY_MUTED) {
+      reply_mode = REPLY_ADDRESSED;
+    }
+  }
+  if (payload[1] == PUSBKB_ADDRESS_BROADCAST ||
+      (payload[2] & ~PUSBKB_ADDRESS_FLAG_ONLY) != 0) {
+    uart_send_address(reply, PUSBKB_ADDRESS_INVALID);
+    return;
+  }
+  pusbkb_config_t config = *config_get();
+  config.address = payload[1];
+  config.address_flags = payload[2];
+  bool stored = config_store(&config);
+  address_apply(config_get());
+  // Answer from the new address.
+  uart_send_address(reply, stored ? PUSBKB_ADDRESS_OK : PUSBKB_ADDRESS_FLASH_ERR);
+  LOG_INFO("Multidrop address %u%s", (unsigned)config.address,
+           (config.address_flags & PUSBKB_ADDRESS_FLAG_ONLY) ? " (addressed only)" : "");
+}
+#endif
 
-    if (pending_type == PUSBKB_PKT_TYPE_CONSUMER) {
-      pending_usage = (uint16_t)(packed & 0xFFFF);
-      if (is_release) {
-        uint16_t zero = 0;
-        tud_hid_n_report(PUSBKB_HID_ITF_AUX, PUSBKB_REPORT_ID_CONSUMER,
-                         &zero, sizeof(zero));
+#if PUSBKB_FAST_BOOT
+static void uart_send_config(reply_channel_t reply, pusbkb_config_result_t result) {
+  const pusbkb_config_t *config = config_get();
+  uint8_t payload[8];
+  payload[0] = PUSBKB_FRAME_TYPE_CONFIG;
+  payload[1] = (uint8_t)result;
+  frame_put_u32(&payload[2], config->baud);
+  payload[6] = config->hid_interval_ms;
+  payload[7] = config->report_mode;
+  reply_write_frame(reply, payload, sizeof(payload));
+}
+
+// SAVE snapshots what is running now (baud, report mode) plus an optional
+// bInterval; all of it applies from the next boot. The address is kept.
+static void uart_handle_config(uart_parser_t *parser, reply_channel_t reply,
+                               const uint8_t *payload, uint8_t len) {
+  if (len < 2) {
+    parser->framing_errors++;
+    return;
+  }
+  pusbkb_config_t config = *config_get();
+  switch (payload[1]) {
+    case PUSBKB_CONFIG_GET:
+      uart_send_config(reply, PUSBKB_CONFIG_OK);
+      return;
+    case PUSBKB_CONFIG_SAVE:
+      if (uart_baud.state != UART_BAUD_IDLE) {
+        uart_send_config(reply, PUSBKB_CONFIG_INVALID);
         return;
       }
-      pending_stage = 1;
+      config.baud = uart_baud.baud;
+#if PUSBKB_HID_NKRO
+      config.report_mode = hid_nkro_requested ? PUSBKB_CONFIG_MODE_NKRO
+                                              : PUSBKB_CONFIG_MODE_BOOT;
+#endif
+      if (len >= 3 && payload[2] != 0) {
+        config.hid_interval_ms = payload[2];
+      }
+      break;
+    case PUSBKB_CONFIG_CLEAR:
+      config.baud = 0;
+      config.hid_interval_ms = 0;
+      config.report_mode = PUSBKB_CONFIG_MODE_DEFAULT;
+      break;
+    default:
+      uart_send_config(reply, PUSBKB_CONFIG_INVALID);
       return;
-    }
+  }
+  bool stored = config_store(&config);
+  uart_send_config(reply, stored ? PUSBKB_CONFIG_OK : PUSBKB_CONFIG_FLASH_ERR);
+  LOG_INFO("Saved settings: %u baud, bInterval %u ms, report mode %u",
+           (unsigned)config.baud, (unsigned)config.hid_interval_ms,
+           (unsigned)config.report_mode);
+}
+
+// Restores what uart_handle_config() saved, before core1 starts USB. Returns
+// the UART rate to boot at.
+static uint32_t config_apply_boot(bool *saved_baud) {
+  const pusbkb_config_t *config = config_get();
+  if (config->hid_interval_ms != 0) {
+    usb_descriptors_set_hid_interval(config->hid_interval_ms);
+  }
+#if PUSBKB_HID_NKRO
+  if (config->report_mode != PUSBKB_CONFIG_MODE_DEFAULT) {
+    hid_nkro_requested = config->report_mode == PUSBKB_CONFIG_MODE_NKRO;
+  }
+#endif
+  *saved_baud = config->baud != 0 && uart_baud_supported(config->baud);
+  return *saved_baud ? config->baud : PUSBKB_UART_BAUDRATE;
+}
+#endif
+
+#if PUSBKB_HID_ACK
+// Where ack frames go: the link that last sent PUSBKB_FRAME_CMD_HID_ACK.
+static reply_channel_t hid_ack_reply = REPLY_UART;
+
+static void hid_ack_task(void) {
+  pusbkb_hid_ack_t ack;
+  uint8_t payload[1 + sizeof(pusbkb_hid_ack_t)];
+  payload[0] = PUSBKB_FRAME_TYPE_HID_ACK;
+  while (hid_ack_pop(&ack)) {
+    memcpy(&payload[1], &ack, sizeof(ack));
+    reply_write_frame(hid_ack_reply, payload, sizeof(payload));
   }
 }
+#endif
 
-static void hid_test_task(void) {
+void uart_parser_command_cb(uart_parser_t *parser, const uint8_t *payload,
+                            uint8_t len) {
+  uart_rx_state_t *state = &uart_rx_state;
+  reply_channel_t reply = reply_channel(parser);
+#if PUSBKB_MULTIDROP
+  reply_mode = !parser->frame_addressed ? REPLY_PLAIN
+             : (parser->frame_address == PUSBKB_ADDRESS_BROADCAST) ? REPLY_MUTED
+             : REPLY_ADDRESSED;
+#endif
+  switch (payload[0]) {
+    case PUSBKB_FRAME_CMD_GET_CREDIT:
+      state->credit_requests |= (uint8_t)(1u << reply);
+      break;
+    case PUSBKB_FRAME_CMD_GET_STATS:
+      uart_send_stats(reply);
+      break;
+#if PUSBKB_LATENCY_STATS
+    case PUSBKB_FRAME_CMD_GET_LATENCY:
+      uart_send_latency(reply, len > 1 && (payload[1] & 0x01) != 0);
+      break;
+#endif
 #if PUSBKB_HID_TEST
-  static uint8_t stage = 0;
-  static absolute_time_t next_time;
-  static bool initialized = false;
-  if (!initialized) {
-    next_time = make_timeout_time_ms(0);
-    initialized = true;
+    case PUSBKB_FRAME_CMD_TEST_GEN:
+      if (len < 8 || payload[1] > PUSBKB_TEST_PATTERN_FLOOD) {
+        parser->framing_errors++;
+        break;
+      }
+      test_gen_start(reply, payload[1], frame_get_u16(&payload[2]),
+                     frame_get_u32(&payload[4]));
+      break;
+#endif
+#if PUSBKB_MACROS
+    case PUSBKB_FRAME_CMD_MACRO_RECORD:
+    case PUSBKB_FRAME_CMD_MACRO_COMMIT:
+    case PUSBKB_FRAME_CMD_MACRO_PLAY:
+    case PUSBKB_FRAME_CMD_MACRO_ERASE:
+    case PUSBKB_FRAME_CMD_MACRO_INFO:
+      uart_handle_macro_command(state, parser, payload, len);
+      break;
+#endif
+    case PUSBKB_FRAME_CMD_SET_BAUD:
+      if (len < 5) {
+        parser->framing_errors++;
+        break;
+      }
+      uart_baud_request(reply, frame_get_u32(&payload[1]));
+      break;
+#if PUSBKB_HID_NKRO
+    case PUSBKB_FRAME_CMD_SET_NKRO:
+      if (len < 2 || payload[1] > 1) {
+        parser->framing_errors++;
+        break;
+      }
+      hid_nkro_requested = payload[1] != 0;
+      // core1 may be asleep with nothing queued.
+      __sev();
+      break;
+#endif
+#if PUSBKB_HID_ACK
+    case PUSBKB_FRAME_CMD_HID_ACK:
+      if (len < 2) {
+        parser->framing_errors++;
+        break;
+      }
+      hid_ack_reply = reply;
+      hid_ack_enable(payload[1]);
+      break;
+#endif
+#if PUSBKB_MULTIDROP
+    case PUSBKB_FRAME_CMD_GET_ADDRESS:
+      uart_send_address(reply, PUSBKB_ADDRESS_OK);
+      break;
+    case PUSBKB_FRAME_CMD_SET_ADDRESS:
+      uart_handle_set_address(parser, reply, payload, len);
+      break;
+#endif
+#if PUSBKB_FAST_BOOT
+    case PUSBKB_FRAME_CMD_CONFIG:
+      uart_handle_config(parser, reply, payload, len);
+      break;
+#endif
+    default:
+      parser->framing_errors++;
+      break;
   }
-  if (!tud_mounted() || !tud_hid_n_ready(PUSBKB_HID_ITF_KEYBOARD)) {
-    return;
+#if PUSBKB_MULTIDROP
+  reply_mode = REPLY_PLAIN;
+#endif
+}
+
+static void PUSBKB_RAM_FUNC_NOINLINE(uart_handle_input)(uart_rx_state_t *state) {
+  const uint8_t *chunk;
+  uint32_t len;
+#if PUSBKB_MACROS
+  // UART input waits (in the RX ring, or behind RTS) while a macro plays.
+  bool paused = uart_macro_play_task(state);
+#else
+  bool paused = false;
+#endif
+  // Until the rate is settled (auto-baud scan, switch not yet confirmed), only
+  // CRC-checked frames can tell real input from noise.
+  state->parser.frames_only = uart_baud.state != UART_BAUD_IDLE;
+  while (!paused && (len = spsc_ring_peek(&uart_rx_ring, &chunk)) != 0) {
+#if PUSBKB_LATENCY_STATS
+    // Only the latest IRQ time is known: with a backlog in the RX ring, PARSE
+    // under-reports time spent waiting in the ring.
+    state->parser.rx_us = uart_rx_irq_us;
+#endif
+    uint32_t consumed = uart_parse_bytes(&state->parser, chunk, len);
+    spsc_ring_consume(&uart_rx_ring, consumed);
+    if (consumed < len) {
+      // Queue full mid-text; resume once core1 has drained some events.
+      break;
+    }
+#if PUSBKB_MACROS
+    // A play command just started; hold the rest until it has been queued.
+    paused = uart_macro_play_task(state);
+#endif
   }
-  if (!time_reached(next_time)) {
-    return;
+
+  const uart_parser_t *parser = &state->parser;
+  if (parser->dropped_text_chars != state->reported_text_chars) {
+    LOG_DEBUG("Text pkt: %lu unmapped chars skipped",
+              (unsigned long)parser->dropped_text_chars);
+    state->reported_text_chars = parser->dropped_text_chars;
   }
 
-  if (stage == 0) {
-    struct __attribute__((packed)) {
-      uint8_t modifier;
-      uint8_t apple_fn;
-      uint8_t keycode[6];
-    } report = {
-      .modifier = KEYBOARD_MODIFIER_LEFTSHIFT,
-      .apple_fn = 0,
-      .keycode = {HID_KEY_A, 0, 0, 0, 0, 0},
-    };
-    tud_hid_n_report(PUSBKB_HID_ITF_KEYBOARD, 0, &report, sizeof(report));
-    stage = 1;
-    next_time = make_timeout_time_ms(5);
-  } else {
-    struct __attribute__((packed)) {
-      uint8_t modifier;
-      uint8_t apple_fn;
-      uint8_t keycode[6];
-    } report = {0};
-    tud_hid_n_report(PUSBKB_HID_ITF_KEYBOARD, 0, &report, sizeof(report));
-    stage = 0;
-    next_time = make_timeout_time_ms(1000);
+  uint32_t high_water = key_queue.high_water;
+  if (high_water >= state->reported_high_water + PUSBKB_QUEUE_LEN / 8 ||
+      (high_water == PUSBKB_QUEUE_LEN &&
+       state->reported_high_water != PUSBKB_QUEUE_LEN)) {
+    LOG_DEBUG("Event queue high-water mark: %lu/%u",
+              (unsigned long)high_water, PUSBKB_QUEUE_LEN);
+    state->reported_high_water = high_water;
+  }
+
+  uint32_t reports_saved = hid_reports_saved;
+  if (reports_saved - state->reported_reports_saved >= 256) {
+    LOG_DEBUG("HID reports saved by coalescing: %lu",
+              (unsigned long)reports_saved);
+    state->reported_reports_saved = reports_saved;
+  }
+
+#if PUSBKB_UART_HW_FLOW
+  if (spsc_ring_free(&uart_rx_ring) != 0) {
+    hw_set_bits(&uart_get_hw(get_uart_instance())->imsc, UART_RX_IRQ_BITS);
+  }
+#endif
+
+  uint32_t framing_errors = parser->framing_errors + parser->frame_crc_errors;
+  if (framing_errors != state->reported_framing_errors) {
+    LOG_DEBUG("UART RX framing: %lu bad type bytes, %lu bad frames",
+              (unsigned long)parser->framing_errors,
+              (unsigned long)parser->frame_crc_errors);
+    state->reported_framing_errors = framing_errors;
+  }
+
+  uint32_t overflows = uart_rx_ring_overflows;
+  if (overflows != state->reported_ring_overflows) {
+    LOG_WARN("UART RX drop: ring full (%lu bytes total)",
+             (unsigned long)overflows);
+    state->reported_ring_overflows = overflows;
+  }
+  uint32_t overruns = uart_rx_hw_overruns;
+  if (overruns != state->reported_hw_overruns) {
+    LOG_WARN("UART RX drop: FIFO overrun (%lu total)",
+             (unsigned long)overruns);
+    state->reported_hw_overruns = overruns;
+  }
+}
+
+#if PUSBKB_USB_CDC
+// Same as the UART path, from the CDC RX ring. Bytes left there hold off the
+// next OUT transfer, so USB backpressure takes the place of RTS.
+static void cdc_handle_input(uart_rx_state_t *state) {
+  const uint8_t *chunk;
+  uint32_t len;
+#if PUSBKB_MACROS
+  bool paused = state->macro_events != NULL;
+#else
+  bool paused = false;
+#endif
+  while (!paused && (len = usb_cdc_rx_peek(&chunk)) != 0) {
+#if PUSBKB_LATENCY_STATS
+    state->cdc_parser.rx_us = usb_cdc_rx_time_us();
+#endif
+    uint32_t consumed = uart_parse_bytes(&state->cdc_parser, chunk, len);
+    usb_cdc_rx_consume(consumed);
+    if (consumed < len) {
+      break;
+    }
+#if PUSBKB_MACROS
+    paused = uart_macro_play_task(state);
+#endif
+  }
+}
+#endif
+
+// Credit frames let the host stream at the maximum safe rate: it may have at
+// most `free` more events in flight, or equivalently keep
+// (sent - consumed - discarded) below `capacity`. With PUSBKB_HID_AUX_QUEUE
+// the frame has the same four fields again for the aux queue, and each queue
+// keeps to the rule on its own.
+static void uart_flow_control_task(uart_rx_state_t *state) {
+#if PUSBKB_FLOW_CREDITS
+  absolute_time_t now = get_absolute_time();
+  int64_t since_us = absolute_time_diff_us(state->last_credit_time, now);
+  uint32_t free_slots = event_credit_free();
+  bool due = since_us >= (int64_t)PUSBKB_CREDIT_INTERVAL_MS * 1000 &&
+             (free_slots != state->last_credit_free || since_us >= 1000000);
+  if (due) {
+    // Periodic credits are for the UART sender; CDC has USB backpressure.
+    state->credit_requests |= 1u << REPLY_UART;
   }
+#else
+  absolute_time_t now = get_absolute_time();
+  uint32_t free_slots = event_credit_free();
 #endif
+  if (state->credit_requests == 0) {
+    return;
+  }
+  uint8_t payload[1 + 12 * (1 + PUSBKB_HID_AUX_QUEUE)];
+  payload[0] = PUSBKB_FRAME_TYPE_CREDIT;
+  for (uint8_t channel = REPLY_UART; channel <= REPLY_CDC; channel++) {
+    if ((state->credit_requests & (1u << channel)) == 0) {
+      continue;
+    }
+    // Counts are per link: each sender only tracks its own events.
+#if PUSBKB_USB_CDC
+    const uart_parser_t *parser =
+        (channel == REPLY_CDC) ? &state->cdc_parser : &state->parser;
+#else
+    const uart_parser_t *parser = &state->parser;
+#endif
+    uint32_t dropped = parser->dropped_queue + parser->dropped_text_chars;
+    uint8_t len = 1;
+#if PUSBKB_HID_AUX_QUEUE
+    dropped -= parser->dropped_queue_aux;
+#endif
+    len += event_credit_put(&payload[len], &key_credit,
+                            (reply_channel_t)channel, dropped);
+#if PUSBKB_HID_AUX_QUEUE
+    len += event_credit_put(&payload[len], &aux_credit,
+                            (reply_channel_t)channel, parser->dropped_queue_aux);
+#endif
+    reply_write_frame((reply_channel_t)channel, payload, sizeof(payload));
+  }
+  state->last_credit_time = now;
+  state->last_credit_free = free_slots;
+  state->credit_requests = 0;
+}
+
+// The host forgets key state on reset/reconnect; resend from scratch.
+void tud_mount_cb(void) {
+  hid_sched_reset();
 }
 
-// TinyUSB HID callbacks (not used for this device).
+// TinyUSB HID callbacks.
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id,
                                hid_report_type_t report_type, uint8_t* buffer,
                                uint16_t reqlen) {
-  (void)instance;
-  (void)report_id;
-  (void)report_type;
-  (void)buffer;
-  (void)reqlen;
+  if (instance == PUSBKB_HID_ITF_AUX && report_id == PUSBKB_REPORT_ID_STATS &&
+      report_type == HID_REPORT_TYPE_FEATURE &&
+      reqlen >= sizeof(pusbkb_stats_t)) {
+    pusbkb_stats_t stats;
+    stats_collect(&stats);
+    memcpy(buffer, &stats, sizeof(stats));
+    return sizeof(stats);
+  }
   return 0;
 }
 
+void PUSBKB_RAM_FUNC(tud_hid_report_complete_cb)(uint8_t instance,
+                                                 uint8_t const* report,
+                                                 uint16_t len) {
+#if PUSBKB_HID_ACK
+  hid_ack_in_complete(instance, report, len, events_consumed());
+#else
+  (void)report;
+  (void)len;
+#endif
+  hid_sched_report_complete(instance);
+}
+
+#if PUSBKB_TIMED_EVENTS
+// Only enabled while a timed event is waiting for its due time.
+void PUSBKB_RAM_FUNC(tud_sof_cb)(uint32_t frame_count) {
+  (void)frame_count;
+  hid_sched_sof();
+}
+#endif
+
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id,
                            hid_report_type_t report_type, uint8_t const* buffer,
                            uint16_t bufsize) {
+#if PUSBKB_HID_ACK
+  // Keyboard LEDs arrive as output reports, on the control pipe since the
+  // interfaces have no OUT endpoint.
+  if (report_type == HID_REPORT_TYPE_OUTPUT) {
+    hid_ack_output_report(instance, report_id, buffer, bufsize,
+                          events_consumed());
+  }
+#else
   (void)instance;
   (void)report_id;
   (void)report_type;
   (void)buffer;
   (void)bufsize;
+#endif
+}
+
+// core1: owns TinyUSB and the HID report scheduler so USB IN reports never
+// wait behind UART parsing or a slow log line on core0.
+static void core1_main(void) {
+#if PUSBKB_MACROS || PUSBKB_CONFIG_STORE
+  // Lets core0 park this core while it erases/programs macro or config flash.
+  flash_safe_execute_core_init();
+#endif
+  // Initialize the native USB stack (HID on the built-in USB port). The USB
+  // IRQ is installed on the calling core.
+  if (!tud_init(0)) {
+    LOG_ERROR("tud_init failed");
+  }
+
+  absolute_time_t idle_wake = make_timeout_time_ms(IDLE_WAKE_MS);
+  while (true) {
+    uint32_t start_us = time_us_32();
+    uint32_t queue_tail = events_popped();
+    core1_heartbeat++;
+    tud_task();
+    bool more = hid_sched_task();
+#if PUSBKB_USB_CDC
+    more = usb_cdc_task() || more;
+#endif
+    if (events_popped() != queue_tail) {
+      // Queue space for core0: RX backlog, macro playback, credits.
+      __sev();
+    }
+    uint32_t busy_us = time_us_32() - start_us;
+    if (busy_us > core1_loop_max_us) {
+      core1_loop_max_us = busy_us;
+    }
+    // The USB IRQ wakes the core for new TinyUSB events (including the SOFs a
+    // timed event waits for) and core0 sends a SEV with new events. Either
+    // landing after the checks still ends the WFE right away.
+    if (!more && !tud_task_event_ready()) {
+      if (time_reached(idle_wake)) {
+        idle_wake = make_timeout_time_ms(IDLE_WAKE_MS);
+      }
+      best_effort_wfe_or_timeout(idle_wake);
+    }
+  }
+}
+
+// Moves `deadline` up to a partial packet's timeout.
+static absolute_time_t parser_deadline(const uart_parser_t *parser,
+                                       absolute_time_t deadline) {
+  if (parser->rx_mode != RX_MODE_TYPE && parser->last_rx_valid) {
+    absolute_time_t timeout =
+        from_us_since_boot(parser->last_rx_us + UART_PARSER_TIMEOUT_US + 1);
+    if (absolute_time_diff_us(timeout, deadline) > 0) {
+      return timeout;
+    }
+  }
+  return deadline;
+}
+
+// When core0 next has timed work, at the latest `idle_wake`. Deadlines are
+// absolute and only move once reached, so repeated sleeps reuse the same
+// alarm. Work waiting on core1 (a full queue) waits for its SEV instead.
+static absolute_time_t core0_next_deadline(const uart_rx_state_t *state,
+                                           absolute_time_t idle_wake) {
+  absolute_time_t deadline = parser_deadline(&state->parser, idle_wake);
+#if PUSBKB_USB_CDC
+  deadline = parser_deadline(&state->cdc_parser, deadline);
+#endif
+  if (uart_baud.state == UART_BAUD_DRAINING) {
+    // Nothing interrupts when the last TX bit leaves; poll for it.
+    return make_timeout_time_ms(1);
+  }
+  if (uart_baud.state != UART_BAUD_IDLE &&
+      absolute_time_diff_us(uart_baud.deadline, deadline) > 0) {
+    deadline = uart_baud.deadline;
+  }
+#if PUSBKB_FLOW_CREDITS
+  {
+    uint32_t wait_ms =
+        (event_credit_free() != state->last_credit_free)
+            ? PUSBKB_CREDIT_INTERVAL_MS
+            : 1000;
+    absolute_time_t credit = delayed_by_ms(state->last_credit_time, wait_ms);
+    if (absolute_time_diff_us(credit, deadline) > 0) {
+      deadline = credit;
+    }
+  }
+#endif
+#if PUSBKB_HID_TEST
+  if (test_gen.active && test_gen.pattern != PUSBKB_TEST_PATTERN_FLOOD &&
+      key_queue_free_space(&key_queue) != 0) {
+    // next_us is the low half of the same clock.
+    uint64_t now_us = time_us_64();
+    int32_t wait_us = (int32_t)(test_gen.next_us - (uint32_t)now_us);
+    absolute_time_t tap =
+        from_us_since_boot(now_us + (wait_us > 0 ? (uint64_t)wait_us : 0));
+    if (absolute_time_diff_us(tap, deadline) > 0) {
+      deadline = tap;
+    }
+  }
+#endif
+  return deadline;
+}
+
+static void watchdog_task(void) {
+  static uint32_t last_heartbeat = 0;
+  static absolute_time_t last_heartbeat_time;
+  static bool initialized = false;
+  uint32_t heartbeat = core1_heartbeat;
+  if (!initialized || heartbeat != last_heartbeat) {
+    last_heartbeat = heartbeat;
+    last_heartbeat_time = get_absolute_time();
+    initialized = true;
+  }
+  int64_t stalled_us = absolute_time_diff_us(last_heartbeat_time,
+                                             get_absolute_time());
+  if (stalled_us >= (int64_t)WATCHDOG_TIMEOUT_MS * 1000 / 2) {
+    watchdog_hw->scratch[RESET_SCRATCH_STALL] = PUSBKB_RESET_CORE1_STALL;
+  } else {
+    static absolute_time_t last_feed_time;
+    static bool fed = false;
+    absolute_time_t now = get_absolute_time();
+    watchdog_hw->scratch[RESET_SCRATCH_UPTIME] = to_ms_since_boot(now);
+    watchdog_hw->scratch[RESET_SCRATCH_STALL] = 0;
+    if (fed) {
+      int64_t since_ms = absolute_time_diff_us(last_feed_time, now) / 1000;
+      int64_t margin_ms = (int64_t)WATCHDOG_TIMEOUT_MS - since_ms;
+      if (margin_ms < (int64_t)watchdog_margin_ms) {
+        watchdog_margin_ms = (margin_ms > 0) ? (uint32_t)margin_ms : 0;
+      }
+    }
+    last_feed_time = now;
+    fed = true;
+    watchdog_update();
+  }
+}
+
+// Reads what the last run left in the scratch registers and starts this run's
+// record. First thing at boot, before anything can feed the watchdog.
+static void reset_record_init(void) {
+  uint32_t boot = watchdog_hw->scratch[RESET_SCRATCH_BOOT];
+  bool valid = (boot >> 16) == RESET_RECORD_MAGIC;
+  uint32_t count = 0;
+  reset_record.cause = PUSBKB_RESET_POWER_ON;
+  reset_record.uptime_ms = 0;
+  if (valid && watchdog_caused_reboot()) {
+    count = boot & 0xFFFFu;
+    reset_record.uptime_ms = watchdog_hw->scratch[RESET_SCRATCH_UPTIME];
+    if (!watchdog_enable_caused_reboot()) {
+      reset_record.cause = PUSBKB_RESET_SOFTWARE;
+    } else if (watchdog_hw->scratch[RESET_SCRATCH_STALL] == PUSBKB_RESET_CORE1_STALL) {
+      reset_record.cause = PUSBKB_RESET_CORE1_STALL;
+    } else {
+      reset_record.cause = PUSBKB_RESET_CORE0_STALL;
+    }
+  }
+  if (count < 0xFFFFu) {
+    count++;
+  }
+  reset_record.boot_count = count;
+  watchdog_hw->scratch[RESET_SCRATCH_BOOT] = (RESET_RECORD_MAGIC << 16) | count;
+  watchdog_hw->scratch[RESET_SCRATCH_UPTIME] = 0;
+  watchdog_hw->scratch[RESET_SCRATCH_STALL] = 0;
+}
+
+static const char *reset_cause_name(uint8_t cause) {
+  switch (cause) {
+    case PUSBKB_RESET_CORE0_STALL: return "core0 stall";
+    case PUSBKB_RESET_CORE1_STALL: return "core1 stall";
+    case PUSBKB_RESET_SOFTWARE: return "software reboot";
+    default: return "power on";
+  }
 }
 
 int main(void) {
+  reset_record_init();
   set_sys_clock_khz(120000, true);
 
-  // Initialize UART stdio before TinyUSB to capture early logs.
-  uart_configure();
+  uart_parser_init(&uart_rx_state.parser, PUSBKB_UART_HW_FLOW);
+#if PUSBKB_USB_CDC
+  // USB always pushes back, so CDC legacy packets wait for space too.
+  uart_parser_init(&uart_rx_state.cdc_parser, true);
+#endif
+  hid_sched_init(&key_queue);
+#if PUSBKB_HID_AUX_QUEUE
+  hid_sched_init_aux(&aux_queue);
+#endif
 
-  // Check if we rebooted due to watchdog
-  bool watchdog_reboot = watchdog_enable_caused_reboot();
+  uint32_t boot_baud = PUSBKB_UART_BAUDRATE;
+  bool saved_baud = false;
+#if PUSBKB_CONFIG_STORE
+  // Log lines from here on (either core) wait in the ring until
+  // uart_configure() attaches the UART.
+  log_init(NULL);
+  config_init();
+#endif
+#if PUSBKB_FAST_BOOT
+  // USB first: the host starts enumerating while core0 brings up the UART
+  // and macros.
+  boot_baud = config_apply_boot(&saved_baud);
+  multicore_launch_core1(core1_main);
+#endif
 
-  // Initialize the native USB stack (HID on the built-in USB port).
-  if (!tud_init(0)) {
-    LOG_ERROR("tud_init failed");
-  }
+  // Initialize UART logging before TinyUSB to capture early logs.
+  uart_configure(boot_baud);
+  uart_baud_init(boot_baud, saved_baud);
+#if PUSBKB_MACROS
+  macro_init();
+#endif
+#if PUSBKB_MULTIDROP
+  address_apply(config_get());
+#endif
+
+#if !PUSBKB_FAST_BOOT
+  multicore_launch_core1(core1_main);
+#endif
   LOG_INFO("TinyUSB debug level %d", CFG_TUSB_DEBUG);
   LOG_INFO("build " PUSBKB_GIT_COMMIT);
 
-  if (watchdog_reboot) {
-    LOG_WARN("watchdog triggered reboot");
+  if (reset_record.cause != PUSBKB_RESET_POWER_ON) {
+    LOG_WARN("reset: %s after %u ms (boot %u)",
+             reset_cause_name(reset_record.cause),
+             (unsigned)reset_record.uptime_ms,
+             (unsigned)reset_record.boot_count);
   }
   LOG_INFO("PicoUSBKeyBridge boot");
+#if PUSBKB_FAST_BOOT
+  LOG_INFO("UART %u baud%s", (unsigned)boot_baud, saved_baud ? " (saved)" : "");
+#endif
+#if PUSBKB_MULTIDROP
+  LOG_INFO("Multidrop address %u", (unsigned)uart_rx_state.parser.address);
+#endif
 #if PUSBKB_HID_TEST
-  LOG_INFO("HID test mode enabled");
+  test_gen_start(REPLY_UART, PUSBKB_HID_TEST_PATTERN, PUSBKB_HID_TEST_RATE, 0);
+  LOG_INFO("HID test mode: pattern %u at %u taps/s",
+           (unsigned)PUSBKB_HID_TEST_PATTERN, (unsigned)PUSBKB_HID_TEST_RATE);
 #endif
 
   // Enable watchdog with timeout, pause during debug sessions
   watchdog_enable(WATCHDOG_TIMEOUT_MS, true);
   LOG_INFO("watchdog enabled");
 
-  uart_rx_state_t uart_rx_state = {0};
-
+  // core0: UART ingest, framing and logging. Each pass handles whatever is
+  // pending, then sleeps until an interrupt (UART RX, timer), a SEV from core1
+  // or the next deadline.
+  absolute_time_t idle_wake = make_timeout_time_ms(IDLE_WAKE_MS);
   while (true) {
-    watchdog_update();
-    tud_task();
+    uint32_t start_us = time_us_32();
+    uint32_t queue_head = events_pushed();
+    watchdog_task();
     log_flush();
-#if PUSBKB_HID_TEST
-    hid_test_task();
-#else
-    uart_update_state(&uart_rx_state);
+    uart_parser_check_timeout(&uart_rx_state.parser);
     uart_handle_input(&uart_rx_state);
-    hid_queue_task();
+#if PUSBKB_USB_CDC
+    uart_parser_check_timeout(&uart_rx_state.cdc_parser);
+    cdc_handle_input(&uart_rx_state);
 #endif
+    uart_flow_control_task(&uart_rx_state);
+    uart_baud_task();
+#if PUSBKB_HID_ACK
+    hid_ack_task();
+#endif
+#if PUSBKB_HID_TEST
+    test_gen_task();
+#endif
+    if (events_pushed() != queue_head) {
+      // New events for core1.
+      __sev();
+    }
+    uint32_t busy_us = time_us_32() - start_us;
+    if (busy_us > core0_loop_max_us) {
+      core0_loop_max_us = busy_us;
+    }
+    if (time_reached(idle_wake)) {
+      idle_wake = make_timeout_time_ms(IDLE_WAKE_MS);
+    }
+    best_effort_wfe_or_timeout(core0_next_deadline(&uart_rx_state, idle_wake));
   }
 
   return 0;
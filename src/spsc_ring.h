@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Lock-free single-producer/single-consumer byte ring.
+//
+// The producer only writes `head`, the consumer only writes `tail`. Both are
+// free-running counters so the full capacity is usable; the buffer length must
+// be a power of two. Safe between an IRQ handler and thread code, or between
+// the two cores.
+typedef struct {
+  uint8_t *buf;
+  uint32_t mask;
+  volatile uint32_t head;
+  volatile uint32_t tail;
+} spsc_ring_t;
+
+// Static initializer for a ring backed by a power-of-two sized array.
+#define SPSC_RING_INIT(storage) \
+  { .buf = (storage), .mask = sizeof(storage) - 1, .head = 0, .tail = 0 }
+
+static inline uint32_t spsc_ring_capacity(const spsc_ring_t *ring) {
+  return ring->mask + 1;
+}
+
+static inline uint32_t spsc_ring_used(const spsc_ring_t *ring) {
+  return ring->head - ring->tail;
+}
+
+static inline uint32_t spsc_ring_free(const spsc_ring_t *ring) {
+  return spsc_ring_capacity(ring) - spsc_ring_used(ring);
+}
+
+// Producer side: append one byte. Returns false if the ring is full.
+static inline bool spsc_ring_push(spsc_ring_t *ring, uint8_t byte) {
+  uint32_t head = ring->head;
+  if (head - ring->tail > ring->mask) {
+    return false;
+  }
+  ring->buf[head & ring->mask] = byte;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  ring->head = head + 1;
+  return true;
+}
+
+// Producer side: append `len` bytes, all or nothing. Returns false (writing
+// nothing) if they do not fit.
+static inline bool spsc_ring_write(spsc_ring_t *ring, const uint8_t *data,
+                                   uint32_t len) {
+  uint32_t head = ring->head;
+  if (spsc_ring_capacity(ring) - (head - ring->tail) < len) {
+    return false;
+  }
+  for (uint32_t i = 0; i < len; i++) {
+    ring->buf[(head + i) & ring->mask] = data[i];
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  ring->head = head + len;
+  return true;
+}
+
+// Consumer side: return the longest contiguous readable span without
+// consuming it. Call spsc_ring_consume() once the bytes are processed.
+static inline uint32_t spsc_ring_peek(const spsc_ring_t *ring,
+                                      const uint8_t **data) {
+  uint32_t tail = ring->tail;
+  uint32_t used = ring->head - tail;
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint32_t offset = tail & ring->mask;
+  uint32_t contiguous = spsc_ring_capacity(ring) - offset;
+  *data = &ring->buf[offset];
+  return (used < contiguous) ? used : contiguous;
+}
+
+static inline void spsc_ring_consume(spsc_ring_t *ring, uint32_t len) {
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  ring->tail += len;
+}
+
+#ifdef __cplusplus
+}
+#endif
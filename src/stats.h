@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Runtime counters, sent as-is (little-endian) in PUSBKB_FRAME_TYPE_STATS
+// frames and in the PUSBKB_REPORT_ID_STATS feature report. Fields are only
+// ever appended; bump the version when the layout changes.
+#define PUSBKB_STATS_VERSION 3
+
+typedef struct __attribute__((packed)) {
+  uint8_t version;
+  uint8_t reserved[3];
+  uint32_t uptime_ms;
+  uint32_t rx_bytes;           // bytes taken off the UART
+  uint32_t packets;            // legacy packets, text packets and v2 frames parsed
+  uint32_t framing_errors;     // bad type bytes and malformed frames
+  uint32_t frame_crc_errors;
+  uint32_t rx_timeouts;        // incomplete packets dropped by uart_parser_check_timeout
+  uint32_t rx_ring_overflows;  // bytes lost because the RX ring was full
+  uint32_t rx_hw_overruns;     // bytes lost in the UART FIFO
+  uint32_t queue_dropped;      // events dropped because the queue was full
+  uint32_t text_chars_skipped; // unmapped text characters
+  uint16_t queue_high_water;
+  uint16_t queue_capacity;
+  uint32_t reports_keyboard;   // boot and NKRO keyboard reports sent
+  uint32_t reports_aux;
+  uint32_t reports_saved;      // identical reports skipped
+  uint32_t hid_busy;           // reports that had to wait for a busy endpoint
+  uint32_t core0_loop_max_us;
+  uint32_t core1_loop_max_us;
+  uint32_t watchdog_margin_ms; // least time left before a reset, seen at a feed
+  uint32_t log_dropped;
+  // Version 2: why the board last reset (pusbkb_reset_cause_t).
+  uint8_t reset_cause;
+  uint8_t reserved2[3];
+  uint32_t boot_count;         // boots since power-on
+  uint32_t reset_uptime_ms;    // watchdog resets: uptime at the last feed before it
+  // Version 3.
+  uint32_t ack_dropped;        // PUSBKB_HID_ACK records lost to a full ring
+} pusbkb_stats_t;
+
+_Static_assert(sizeof(pusbkb_stats_t) == 96, "pusbkb_stats_t layout");
+
+// Reset record, kept across resets in the watchdog scratch registers so a
+// stall can be told from a power cycle without touching flash at boot.
+typedef enum {
+  PUSBKB_RESET_POWER_ON = 0, // power-on, brownout or the RUN pin
+  PUSBKB_RESET_CORE0_STALL,  // watchdog timeout: core0 stopped feeding it
+  PUSBKB_RESET_CORE1_STALL,  // watchdog timeout: core1 stopped, so core0 stopped feeding
+  PUSBKB_RESET_SOFTWARE,     // watchdog_reboot() (debugger, picotool)
+} pusbkb_reset_cause_t;
+
+// Latency histograms (PUSBKB_LATENCY_STATS). Each stage counts events per
+// power-of-two bucket of microseconds: bucket 0 is 0 us, bucket i covers
+// [2^(i-1), 2^i) us and the last bucket also takes everything above. Sent as
+// one PUSBKB_FRAME_TYPE_LATENCY frame per stage:
+//   [stage] [bucket count] [count u32 x bucket count]
+#define PUSBKB_LATENCY_BUCKETS 16
+
+typedef enum {
+  PUSBKB_LATENCY_PARSE = 0, // UART RX IRQ -> event queued
+  PUSBKB_LATENCY_QUEUE,     // queued -> taken off the queue by core1
+  PUSBKB_LATENCY_SUBMIT,    // dequeued -> press report handed to TinyUSB
+  PUSBKB_LATENCY_USB,       // report submitted -> IN transfer complete
+  PUSBKB_LATENCY_TOTAL,     // UART RX IRQ -> IN transfer complete
+  PUSBKB_LATENCY_STAGES,
+} pusbkb_latency_stage_t;
+
+// Delivery acknowledgments (PUSBKB_HID_ACK), sent as-is in
+// PUSBKB_FRAME_TYPE_HID_ACK frames after the type byte.
+typedef enum {
+  PUSBKB_HID_ACK_LED = 0, // the host sent a keyboard output report
+  PUSBKB_HID_ACK_IN,      // an IN report transfer completed
+} pusbkb_hid_ack_kind_t;
+
+typedef struct __attribute__((packed)) {
+  uint8_t kind;        // pusbkb_hid_ack_kind_t
+  uint8_t itf;         // HID interface (PUSBKB_HID_ITF_*)
+  uint8_t report_id;
+  uint8_t data;        // LED: the LED bits (bit 0 Num, 1 Caps, 2 Scroll); IN: first report byte
+  uint32_t time_us;    // device time of the callback
+  uint32_t events;     // events taken off the queue by then
+  // IN: since the report was submitted. LED: since the last keyboard report
+  // with a key down completed, which is the host's turnaround for a Lock key.
+  uint32_t latency_us;
+} pusbkb_hid_ack_t;
+
+_Static_assert(sizeof(pusbkb_hid_ack_t) == 16, "pusbkb_hid_ack_t layout");
+
+#ifdef __cplusplus
+}
+#endif
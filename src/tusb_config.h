@@ -40,11 +40,24 @@
 #endif
 
 //------------- CLASS -------------//
-#define CFG_TUD_CDC              0
-#define CFG_TUD_HID              2
+// CDC-ACM control channel (usb_cdc.h).
+#ifndef PUSBKB_USB_CDC
+#define PUSBKB_USB_CDC 0
+#endif
+#define CFG_TUD_CDC              (PUSBKB_USB_CDC ? 1 : 0)
+#define CFG_TUD_CDC_RX_BUFSIZE   256
+#define CFG_TUD_CDC_TX_BUFSIZE   256
+#define CFG_TUD_CDC_EP_BUFSIZE   64
+// Keyboard + aux, plus the NKRO keyboard when enabled.
+#ifndef PUSBKB_HID_NKRO
+#define PUSBKB_HID_NKRO 0
+#endif
+#define CFG_TUD_HID              (PUSBKB_HID_NKRO ? 3 : 2)
 
-// Used by HID descriptor sizing.
-#define CFG_TUD_HID_EP_BUFSIZE   64
+// HID transfer buffers. Larger than the 64-byte interrupt endpoints
+// (PUSBKB_HID_EP_SIZE) because it also bounds control GET_REPORT replies such
+// as the stats feature report.
+#define CFG_TUD_HID_EP_BUFSIZE   128
 
 #ifdef __cplusplus
  }
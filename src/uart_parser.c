@@ -0,0 +1,415 @@
+/*
+ * UART packet and v2 frame parser (portable; see uart_parser.h).
+ */
+
+#include "uart_parser.h"
+
+#include <string.h>
+
+#include "hal.h"
+#include "hid_reports.h"
+#include "keymap.h"
+#include "log.h"
+
+void uart_parser_init(uart_parser_t *parser, bool wait_for_space) {
+  memset(parser, 0, sizeof(*parser));
+  parser->rx_mode = RX_MODE_TYPE;
+  parser->wait_for_space = wait_for_space;
+}
+
+void uart_parser_reset(uart_parser_t *state) {
+  state->rx_mode = RX_MODE_TYPE;
+  state->pending_type = 0;
+  state->pending_code_lo = 0;
+  state->pending_code_hi = 0;
+  state->pending_modifier = 0;
+  state->pending_flags = 0;
+  state->pending_text_len = 0;
+  state->frame_pos = 0;
+  state->frame_dispatch_pos = 0;
+  state->last_rx_valid = false;
+}
+
+void PUSBKB_RAM_FUNC(uart_parser_check_timeout)(uart_parser_t *state) {
+  if (state->rx_mode != RX_MODE_TYPE && state->last_rx_valid) {
+    uint64_t age_us = pusbkb_hal_time_us() - state->last_rx_us;
+    if (age_us > UART_PARSER_TIMEOUT_US) {
+      // Drop an incomplete packet if the payload never arrives.
+      state->rx_timeouts++;
+      uart_parser_reset(state);
+    }
+  }
+}
+
+static bool PUSBKB_RAM_FUNC(uart_type_byte_is_valid)(uint8_t type_byte) {
+  if ((type_byte & ~(PUSBKB_PKT_FLAG_RELEASE | PUSBKB_PKT_TYPE_MASK)) != 0) {
+    return false;
+  }
+  switch (type_byte & PUSBKB_PKT_TYPE_MASK) {
+    case PUSBKB_PKT_TYPE_KEYBOARD:
+    case PUSBKB_PKT_TYPE_CONSUMER:
+    case PUSBKB_PKT_TYPE_TEXT:
+      return true;
+    case PUSBKB_PKT_TYPE_MOUSE:
+    case PUSBKB_PKT_TYPE_ABSOLUTE:
+      return PUSBKB_HID_POINTER;
+    case PUSBKB_PKT_TYPE_SYSTEM:
+      return PUSBKB_HID_SYSTEM;
+    default:
+      return false;
+  }
+}
+
+// Counts an event lost to a full queue, per queue (hid_sched_queue()).
+static void PUSBKB_RAM_FUNC(uart_count_dropped)(uart_parser_t *state,
+                                                uint8_t type) {
+  state->dropped_queue++;
+#if PUSBKB_HID_AUX_QUEUE
+  if ((type & PUSBKB_PKT_TYPE_MASK) != PUSBKB_PKT_TYPE_KEYBOARD) {
+    state->dropped_queue_aux++;
+  }
+#else
+  (void)type;
+#endif
+}
+
+static bool PUSBKB_RAM_FUNC(uart_emit_event)(uart_parser_t *state, uint8_t type,
+                                             uint8_t code_lo, uint8_t code_hi,
+                                             uint8_t modifier, uint8_t flags,
+                                             uint32_t delay_us) {
+  uint16_t code = ((uint16_t)code_hi << 8) | code_lo;
+  LOG_DEBUG("Serial pkt: type=0x%02x code=0x%04x mod=0x%02x flags=0x%02x",
+            type, code, modifier, flags);
+  key_event_t event = {
+    .code = code,
+    .type = type,
+    .modifier = modifier,
+    .flags = flags,
+#if PUSBKB_TIMED_EVENTS
+    .delay_us = delay_us,
+#endif
+#if PUSBKB_LATENCY_STATS
+    .rx_us = state->packet_rx_us,
+    .queued_us = (uint32_t)pusbkb_hal_time_us(),
+#endif
+  };
+#if !PUSBKB_TIMED_EVENTS
+  (void)delay_us;
+#endif
+  if (!uart_parser_event_cb(state, &event)) {
+    uart_count_dropped(state, type);
+    if ((state->dropped_queue & 0x3F) == 1) {
+      LOG_DEBUG("UART RX drop: queue full");
+    }
+    return false;
+  }
+  return true;
+}
+
+// Whether a legacy packet (which has no address) is for this board.
+static bool PUSBKB_RAM_FUNC(uart_legacy_accepted)(uart_parser_t *state) {
+#if PUSBKB_MULTIDROP
+  return !state->addressed_only;
+#else
+  (void)state;
+  return true;
+#endif
+}
+
+static bool PUSBKB_RAM_FUNC(uart_emit_packet)(uart_parser_t *state) {
+  if (!uart_legacy_accepted(state)) {
+#if PUSBKB_MULTIDROP
+    state->other_address++;
+#endif
+    return true;
+  }
+  // With RTS available, wait for space (and let RTS push back) instead of
+  // dropping legacy packets.
+  if (state->wait_for_space &&
+      !uart_parser_space_cb(state, state->pending_type)) {
+    return false;
+  }
+  (void)uart_emit_event(state, state->pending_type, state->pending_code_lo,
+                        state->pending_code_hi, state->pending_modifier,
+                        state->pending_flags, 0);
+  return true;
+}
+
+// Queues one character of a text packet as a keyboard tap. Returns false only
+// when the queue is full, so the caller can retry the byte later.
+static bool PUSBKB_RAM_FUNC(uart_emit_text_char)(uart_parser_t *state,
+                                                 uint8_t ch,
+                                                 uint32_t delay_us) {
+  if (ch >= 0x80 || pusbkb_ascii_keymap[ch][1] == PUSBKB_KEY_NONE) {
+    // Non-ASCII (UTF-8 sequences) and unmapped control characters.
+    state->dropped_text_chars++;
+    return true;
+  }
+  uint8_t modifier = pusbkb_ascii_keymap[ch][0] ? PUSBKB_MODIFIER_LEFTSHIFT : 0;
+  key_event_t event = {
+    .code = pusbkb_ascii_keymap[ch][1],
+    .type = PUSBKB_PKT_TYPE_KEYBOARD,
+    .modifier = modifier,
+#if PUSBKB_TIMED_EVENTS
+    .delay_us = delay_us,
+#endif
+#if PUSBKB_LATENCY_STATS
+    .rx_us = state->packet_rx_us,
+    .queued_us = (uint32_t)pusbkb_hal_time_us(),
+#endif
+  };
+#if !PUSBKB_TIMED_EVENTS
+  (void)delay_us;
+#endif
+  return uart_parser_event_cb(state, &event);
+}
+
+// Dispatches a verified v2 payload. v2 events wait for queue space instead of
+// being dropped: returns false when the queue filled up, with
+// state->frame_dispatch_pos recording how far a text payload got.
+static bool PUSBKB_RAM_FUNC(uart_dispatch_payload)(uart_parser_t *state,
+                                                   const uint8_t *payload,
+                                                   uint8_t len) {
+  uint8_t type_byte = payload[0];
+  if (len != 0 &&
+      (type_byte & PUSBKB_FRAME_CMD_MASK) == PUSBKB_FRAME_CMD_BASE) {
+    uart_parser_command_cb(state, payload, len);
+    return true;
+  }
+  bool timed = len != 0 && (type_byte & PUSBKB_PKT_FLAG_TIMED) != 0;
+  type_byte &= (uint8_t)~PUSBKB_PKT_FLAG_TIMED;
+  if (len == 0 || !uart_type_byte_is_valid(type_byte)) {
+    state->framing_errors++;
+    return true;
+  }
+  bool is_text = (type_byte & PUSBKB_PKT_TYPE_MASK) == PUSBKB_PKT_TYPE_TEXT;
+  // Offset of the delay field, and of the first text character after it.
+  uint8_t delay_pos = is_text ? 1 : 5;
+  uint32_t delay_us = 0;
+  if (timed) {
+    if (len < delay_pos + 4) {
+      state->framing_errors++;
+      return true;
+    }
+    // Without PUSBKB_TIMED_EVENTS the delay is parsed and ignored.
+    delay_us = frame_get_u32(&payload[delay_pos]);
+  }
+  if (is_text) {
+    uint8_t first = timed ? 5 : 1;
+    uint8_t i = (state->frame_dispatch_pos > first) ? state->frame_dispatch_pos
+                                                    : first;
+    for (; i < len; i++) {
+      if (!uart_emit_text_char(state, payload[i], delay_us)) {
+        state->frame_dispatch_pos = i;
+        state->frame_blocked_type = PUSBKB_PKT_TYPE_KEYBOARD;
+        return false;
+      }
+    }
+  } else {
+    if (!uart_parser_space_cb(state, type_byte)) {
+      state->frame_blocked_type = type_byte;
+      return false;
+    }
+    uint8_t body[4] = {0};
+    memcpy(body, &payload[1], (len - 1 < 4) ? (size_t)(len - 1) : 4);
+    (void)uart_emit_event(state, type_byte, body[0], body[1], body[2], body[3],
+                          delay_us);
+  }
+  state->frame_dispatch_pos = 0;
+  return true;
+}
+
+// Unwraps addressed frames, then dispatches the payload if it is for this
+// board. A retried text frame is unwrapped again the same way, so
+// frame_dispatch_pos stays relative to the inner payload.
+static bool PUSBKB_RAM_FUNC(uart_dispatch_frame)(uart_parser_t *state,
+                                                 const uint8_t *payload,
+                                                 uint8_t len) {
+#if PUSBKB_MULTIDROP
+  state->frame_addressed = len != 0 && payload[0] == PUSBKB_FRAME_ADDRESSED;
+  if (state->frame_addressed) {
+    if (len < 3) {
+      state->framing_errors++;
+      return true;
+    }
+    state->frame_address = payload[1];
+    if (payload[1] != state->address &&
+        payload[1] != PUSBKB_ADDRESS_BROADCAST) {
+      state->other_address++;
+      return true;
+    }
+    return uart_dispatch_payload(state, &payload[2], (uint8_t)(len - 2));
+  }
+  if (state->addressed_only) {
+    state->other_address++;
+    return true;
+  }
+#endif
+  return uart_dispatch_payload(state, payload, len);
+}
+
+static bool PUSBKB_RAM_FUNC(uart_frame_complete)(const uart_parser_t *state) {
+  return state->frame_pos > 0 &&
+         state->frame_pos >= (uint16_t)state->frame_buf[0] + 3;
+}
+
+static bool PUSBKB_RAM_FUNC(uart_frame_crc_ok)(const uart_parser_t *state) {
+  uint8_t len = state->frame_buf[0];
+  uint16_t crc = frame_crc16(0xFFFF, state->frame_buf, (size_t)len + 1);
+  return state->frame_buf[len + 1] == (uint8_t)crc &&
+         state->frame_buf[len + 2] == (uint8_t)(crc >> 8);
+}
+
+// A frame just failed its CRC: look for the next sync byte among the bytes
+// already buffered and restart the frame from there, re-checking any candidate
+// that is already complete. Bytes before the new sync byte are discarded.
+static void PUSBKB_RAM_FUNC(uart_frame_resync)(uart_parser_t *state) {
+  while (true) {
+    const uint8_t *sync = memchr(state->frame_buf, PUSBKB_FRAME_SYNC,
+                                 state->frame_pos);
+    if (sync == NULL) {
+      state->frame_pos = 0;
+      state->rx_mode = RX_MODE_TYPE;
+      return;
+    }
+    uint16_t skip = (uint16_t)(sync - state->frame_buf) + 1;
+    state->frame_pos -= skip;
+    memmove(state->frame_buf, state->frame_buf + skip, state->frame_pos);
+    if (!uart_frame_complete(state)) {
+      return;
+    }
+    uint16_t total = (uint16_t)state->frame_buf[0] + 3;
+    if (!uart_frame_crc_ok(state)) {
+      state->frame_crc_errors++;
+      continue;
+    }
+    if (!uart_dispatch_frame(state, &state->frame_buf[1],
+                             state->frame_buf[0])) {
+      // Best effort here: the rest of a recovered frame is dropped.
+      state->frame_dispatch_pos = 0;
+      uart_count_dropped(state, state->frame_blocked_type);
+    }
+    state->frames++;
+    state->packets++;
+    // Anything after the recovered frame still needs a sync byte to count.
+    state->frame_pos -= total;
+    memmove(state->frame_buf, state->frame_buf + total, state->frame_pos);
+  }
+}
+
+// Adds one byte to the v2 frame in progress. Returns false if the completed
+// frame has to wait for queue space; the byte is then not consumed.
+static bool PUSBKB_RAM_FUNC(uart_frame_add_byte)(uart_parser_t *state,
+                                                 uint8_t byte) {
+  state->frame_buf[state->frame_pos++] = byte;
+  if (!uart_frame_complete(state)) {
+    return true;
+  }
+  if (!uart_frame_crc_ok(state)) {
+    state->frame_crc_errors++;
+    uart_frame_resync(state);
+    return true;
+  }
+  if (!uart_dispatch_frame(state, &state->frame_buf[1], state->frame_buf[0])) {
+    // Retried with this same byte once core1 has drained the queue.
+    state->frame_pos--;
+    return false;
+  }
+  state->frames++;
+  state->packets++;
+  state->frame_pos = 0;
+  state->rx_mode = RX_MODE_TYPE;
+  return true;
+}
+
+static uint32_t PUSBKB_RAM_FUNC(uart_parse_chunk)(uart_parser_t *state,
+                                                  const uint8_t *data,
+                                                  uint32_t len) {
+  for (uint32_t i = 0; i < len; i++) {
+    uint8_t byte = data[i];
+    switch (state->rx_mode) {
+      case RX_MODE_TYPE:
+#if PUSBKB_LATENCY_STATS
+        state->packet_rx_us = state->rx_us;
+#endif
+        if (byte == PUSBKB_FRAME_SYNC) {
+          state->frame_pos = 0;
+          state->rx_mode = RX_MODE_FRAME;
+          break;
+        }
+        if (state->frames_only || !uart_type_byte_is_valid(byte)) {
+          // Misaligned or corrupted stream: skip until a plausible type byte.
+          state->framing_errors++;
+          break;
+        }
+        state->pending_type = byte;
+        state->rx_mode =
+            ((byte & PUSBKB_PKT_TYPE_MASK) == PUSBKB_PKT_TYPE_TEXT)
+                ? RX_MODE_TEXT_LEN
+                : RX_MODE_CODE_LO;
+        break;
+      case RX_MODE_CODE_LO:
+        state->pending_code_lo = byte;
+        state->rx_mode = RX_MODE_CODE_HI;
+        break;
+      case RX_MODE_CODE_HI:
+        state->pending_code_hi = byte;
+        state->rx_mode = RX_MODE_MODIFIER;
+        break;
+      case RX_MODE_MODIFIER:
+        state->pending_modifier = byte;
+        state->rx_mode = RX_MODE_FLAGS;
+        break;
+      case RX_MODE_FLAGS:
+        state->pending_flags = byte;
+        if (!uart_emit_packet(state)) {
+          return i;
+        }
+        state->packets++;
+        state->rx_mode = RX_MODE_TYPE;
+        break;
+      case RX_MODE_TEXT_LEN:
+        state->packets++;
+#if PUSBKB_MULTIDROP
+        if (!uart_legacy_accepted(state)) {
+          state->other_address++;
+        }
+#endif
+        state->pending_text_len = byte;
+        state->rx_mode = (byte != 0) ? RX_MODE_TEXT_DATA : RX_MODE_TYPE;
+        break;
+      case RX_MODE_TEXT_DATA:
+        if (uart_legacy_accepted(state) &&
+            !uart_emit_text_char(state, byte, 0)) {
+          return i;
+        }
+        if (--state->pending_text_len == 0) {
+          state->rx_mode = RX_MODE_TYPE;
+        }
+        break;
+      case RX_MODE_FRAME:
+        if (!uart_frame_add_byte(state, byte)) {
+          return i;
+        }
+        if (state->stop) {
+          // The command wants the rest of the input held back for now.
+          state->stop = false;
+          return i + 1;
+        }
+        break;
+      default:
+        state->rx_mode = RX_MODE_TYPE;
+        break;
+    }
+  }
+  return len;
+}
+
+uint32_t PUSBKB_RAM_FUNC(uart_parse_bytes)(uart_parser_t *parser,
+                                           const uint8_t *data, uint32_t len) {
+  parser->last_rx_us = pusbkb_hal_time_us();
+  parser->last_rx_valid = true;
+  uint32_t consumed = uart_parse_chunk(parser, data, len);
+  parser->rx_bytes += consumed;
+  return consumed;
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "key_queue.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// --------------------------------------------------------------------
+// UART protocol -> key events
+//
+// Packet format (5 bytes):
+//   [type] [code_lo] [code_hi] [modifier] [flags]
+//
+// type byte:
+//   - low nibble: 0 = keyboard, 1 = consumer, 2 = text, 3-5 (below)
+//   - bit 7: set for release, clear for press
+//
+// Keyboard payload: 16-bit code + modifier byte
+// Consumer payload: 16-bit usage (little-endian)
+// With PUSBKB_HID_POINTER / PUSBKB_HID_SYSTEM also 3 = mouse, 4 = absolute
+// pointer and 5 = system control (see hid_reports.h for their payloads).
+//
+// A press is a tap (press + release report) unless PUSBKB_KBD_FLAG_HOLD is
+// set, which keeps the key down until a release with the same flag lets go of
+// it. A release without the flag lets go of everything.
+//
+// Text packets are variable length: [0x02] [len] [len ASCII bytes]. Each byte
+// is typed as a tap through the US keymap (keymap.h).
+//
+// v2 framing: a 0xA5 byte where a type byte is expected starts a frame (see
+// frame.h) whose payload is [type] [body]. Legacy type bytes never have bits
+// 4-6 set, so both formats can be mixed on the same link. Frames are
+// CRC-checked and a bad frame is rescanned for the next sync byte, so a lost
+// byte costs at most the frame it hit.
+//
+// Timed events (v2 only, PUSBKB_TIMED_EVENTS): setting PUSBKB_PKT_FLAG_TIMED
+// in the type byte adds a little-endian u32 delay_us, after the 4 key bytes
+// for keyboard/consumer and before the characters for text (where it spaces
+// every character). The press is held back until delay_us after the previous
+// event's press, so queued events replay with the host's spacing instead of
+// the link's.
+//
+// With frames_only set (while the link rate is not settled), everything but
+// CRC-checked v2 frames is skipped: at the wrong rate, noise decodes as
+// plausible legacy type bytes and would be typed into the host.
+//
+// Multidrop (PUSBKB_MULTIDROP): frames wrapped in PUSBKB_FRAME_ADDRESSED are
+// taken only when sent to the parser's address or to PUSBKB_ADDRESS_BROADCAST;
+// with addressed_only set, legacy packets and unwrapped frames are skipped
+// too. Skipped input still counts in the framing counters it passes through.
+//
+// The parser has no platform dependencies: events, queue space and command
+// frames go through the uart_parser_*_cb hooks the application implements.
+// --------------------------------------------------------------------
+
+#ifndef PUSBKB_MULTIDROP
+#define PUSBKB_MULTIDROP 0
+#endif
+
+// An incomplete packet is dropped after this long without bytes.
+#define UART_PARSER_TIMEOUT_US 200000
+
+typedef enum {
+  RX_MODE_TYPE = 0,
+  RX_MODE_CODE_LO,
+  RX_MODE_CODE_HI,
+  RX_MODE_MODIFIER,
+  RX_MODE_FLAGS,
+  RX_MODE_TEXT_LEN,
+  RX_MODE_TEXT_DATA,
+  RX_MODE_FRAME,
+} uart_rx_mode_t;
+
+typedef struct {
+  uart_rx_mode_t rx_mode;
+  uint8_t pending_type;
+  uint8_t pending_code_lo;
+  uint8_t pending_code_hi;
+  uint8_t pending_modifier;
+  uint8_t pending_flags;
+  uint8_t pending_text_len;
+  // v2 frame bytes after the sync: len, payload, crc16.
+  uint8_t frame_buf[PUSBKB_FRAME_MAX_PAYLOAD + 3];
+  uint16_t frame_pos;
+  uint8_t frame_dispatch_pos;
+  // Packet type byte of the event a complete frame is waiting to queue.
+  uint8_t frame_blocked_type;
+  // Legacy packets wait for queue space instead of being dropped (set when the
+  // link has RTS to push back with).
+  bool wait_for_space;
+  // Set by a command callback to end uart_parse_bytes() after its frame.
+  bool stop;
+  // Set by the application: skip legacy packets, take only v2 frames.
+  bool frames_only;
+  uint64_t last_rx_us;
+  bool last_rx_valid;
+#if PUSBKB_MULTIDROP
+  // Set by the application.
+  uint8_t address;
+  bool addressed_only;
+  // Whether the frame being dispatched was wrapped, and the address it was
+  // sent to. For uart_parser_command_cb() to decide how to reply.
+  bool frame_addressed;
+  uint8_t frame_address;
+  uint32_t other_address; // packets and frames skipped as not for this board
+#endif
+#if PUSBKB_LATENCY_STATS
+  // Arrival time of the bytes being parsed, set by the caller before each
+  // chunk, and its value when the current packet's first byte was parsed.
+  uint32_t rx_us;
+  uint32_t packet_rx_us;
+#endif
+  uint32_t rx_bytes;
+  uint32_t packets;
+  uint32_t frames; // v2 frames that passed the CRC check
+  uint32_t rx_timeouts;
+  uint32_t dropped_queue;
+#if PUSBKB_HID_AUX_QUEUE
+  uint32_t dropped_queue_aux; // of dropped_queue, events for the aux queue
+#endif
+  uint32_t dropped_text_chars;
+  uint32_t framing_errors;
+  uint32_t frame_crc_errors;
+} uart_parser_t;
+
+void uart_parser_init(uart_parser_t *parser, bool wait_for_space);
+
+// Runs the packet state machine over a chunk of received bytes. Returns how
+// many bytes were consumed: text packets and v2 frames stop early rather than
+// drop events when the queue is full, leaving the rest for a later call.
+uint32_t uart_parse_bytes(uart_parser_t *parser, const uint8_t *data,
+                          uint32_t len);
+
+// Drops an incomplete packet once UART_PARSER_TIMEOUT_US passed since the last
+// chunk. Call periodically.
+void uart_parser_check_timeout(uart_parser_t *parser);
+// Drops an incomplete packet now, keeping the counters.
+void uart_parser_reset(uart_parser_t *parser);
+
+// Application hooks.
+//
+// Takes a parsed event (normally onto the key queue). Returns false when there
+// is no room; the parser then retries or drops it as the packet format needs.
+bool uart_parser_event_cb(uart_parser_t *parser, const key_event_t *event);
+// Whether uart_parser_event_cb() would take an event of packet type byte
+// `type` right now.
+bool uart_parser_space_cb(uart_parser_t *parser, uint8_t type);
+// Handles a CRC-checked v2 command frame (type 0x20-0x2F).
+void uart_parser_command_cb(uart_parser_t *parser, const uint8_t *payload,
+                            uint8_t len);
+
+#ifdef __cplusplus
+}
+#endif
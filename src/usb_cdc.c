@@ -0,0 +1,120 @@
+/*
+ * CDC-ACM control channel (see usb_cdc.h).
+ */
+
+#include "usb_cdc.h"
+
+#if PUSBKB_USB_CDC
+
+#include "hardware/sync.h"
+#include "pico/time.h"
+#include "tusb.h"
+
+#include "frame.h"
+#include "spsc_ring.h"
+
+_Static_assert((PUSBKB_CDC_RX_RING_LEN & (PUSBKB_CDC_RX_RING_LEN - 1)) == 0 &&
+               (PUSBKB_CDC_TX_RING_LEN & (PUSBKB_CDC_TX_RING_LEN - 1)) == 0,
+               "PUSBKB_CDC_*_RING_LEN must be powers of two");
+
+static uint8_t cdc_rx_storage[PUSBKB_CDC_RX_RING_LEN];
+static spsc_ring_t cdc_rx_ring = SPSC_RING_INIT(cdc_rx_storage);
+static uint8_t cdc_tx_storage[PUSBKB_CDC_TX_RING_LEN];
+static spsc_ring_t cdc_tx_ring = SPSC_RING_INIT(cdc_tx_storage);
+#if PUSBKB_LATENCY_STATS
+static volatile uint32_t cdc_rx_us = 0;
+#endif
+
+// Takes as much from the CDC FIFO as the ring has room for. Bytes left in the
+// FIFO hold off the next OUT transfer.
+static bool usb_cdc_receive(void) {
+  bool moved = false;
+  uint8_t chunk[64];
+  while (true) {
+    uint32_t room = spsc_ring_free(&cdc_rx_ring);
+    uint32_t want = tud_cdc_available();
+    if (want > room) {
+      want = room;
+    }
+    if (want > sizeof(chunk)) {
+      want = sizeof(chunk);
+    }
+    if (want == 0) {
+      break;
+    }
+    uint32_t got = tud_cdc_read(chunk, want);
+    if (got == 0) {
+      break;
+    }
+    spsc_ring_write(&cdc_rx_ring, chunk, got);
+    moved = true;
+  }
+  if (moved) {
+#if PUSBKB_LATENCY_STATS
+    cdc_rx_us = time_us_32();
+#endif
+    // Wakes core0 to parse.
+    __sev();
+  }
+  return moved;
+}
+
+void tud_cdc_rx_cb(uint8_t itf) {
+  (void)itf;
+  (void)usb_cdc_receive();
+}
+
+bool usb_cdc_task(void) {
+  bool moved = usb_cdc_receive();
+  const uint8_t *data;
+  uint32_t len;
+  bool connected = tud_cdc_connected();
+  bool sent = false;
+  while ((len = spsc_ring_peek(&cdc_tx_ring, &data)) != 0) {
+    // Replies to a closed port would be stale by the time it opens.
+    uint32_t written = connected ? tud_cdc_write(data, len) : len;
+    spsc_ring_consume(&cdc_tx_ring, written);
+    sent = sent || (connected && written != 0);
+    if (written < len) {
+      break;
+    }
+  }
+  if (sent) {
+    tud_cdc_write_flush();
+  }
+  return moved || sent;
+}
+
+uint32_t usb_cdc_rx_peek(const uint8_t **data) {
+  return spsc_ring_peek(&cdc_rx_ring, data);
+}
+
+void usb_cdc_rx_consume(uint32_t len) {
+  if (len != 0) {
+    spsc_ring_consume(&cdc_rx_ring, len);
+    // Room to take more from the CDC FIFO.
+    __sev();
+  }
+}
+
+#if PUSBKB_LATENCY_STATS
+uint32_t usb_cdc_rx_time_us(void) {
+  return cdc_rx_us;
+}
+#endif
+
+bool usb_cdc_write_frame(const uint8_t *payload, uint8_t len) {
+  if (!tud_cdc_connected()) {
+    return false;
+  }
+  uint8_t frame[PUSBKB_FRAME_MAX_PAYLOAD + PUSBKB_FRAME_OVERHEAD];
+  size_t frame_len = frame_encode(frame, sizeof(frame), payload, len);
+  if (!spsc_ring_write(&cdc_tx_ring, frame, (uint32_t)frame_len)) {
+    return false;
+  }
+  // Wakes core1 to pass it on.
+  __sev();
+  return true;
+}
+
+#endif
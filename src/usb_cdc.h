@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Optional CDC-ACM control channel (PUSBKB_USB_CDC): the USB host sends the
+// same packets and v2 frames it would send over the UART, without the adapter
+// and its baud rate cap. TinyUSB runs on core1 and the parser on core0, so
+// bytes cross between them in two SPSC rings: RX filled from tud_cdc_rx_cb,
+// TX holding command replies until core1 hands them to TinyUSB.
+
+#ifndef PUSBKB_USB_CDC
+#define PUSBKB_USB_CDC 0
+#endif
+
+// CDC RX ring (must be a power of two). Once it is full the OUT endpoint is
+// left unarmed, so the host backs off instead of losing bytes.
+#ifndef PUSBKB_CDC_RX_RING_LEN
+#define PUSBKB_CDC_RX_RING_LEN 1024
+#endif
+#ifndef PUSBKB_CDC_TX_RING_LEN
+#define PUSBKB_CDC_TX_RING_LEN 1024
+#endif
+
+#if PUSBKB_USB_CDC
+// core1: moves received bytes into the RX ring and queued replies into the
+// CDC IN endpoint. Returns true if it moved anything. Call every loop pass.
+bool usb_cdc_task(void);
+
+// core0: the longest contiguous span of received bytes, and how much of it was
+// parsed.
+uint32_t usb_cdc_rx_peek(const uint8_t **data);
+void usb_cdc_rx_consume(uint32_t len);
+#if PUSBKB_LATENCY_STATS
+// time_us_32() when core1 last moved bytes into the RX ring.
+uint32_t usb_cdc_rx_time_us(void);
+#endif
+
+// core0: queues a v2 frame (see frame.h) for the host. Dropped, returning
+// false, when the ring is full or no terminal has the port open.
+bool usb_cdc_write_frame(const uint8_t *payload, uint8_t len);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
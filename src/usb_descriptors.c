@@ -7,7 +7,11 @@
 #include "class/hid/hid_device.h"
 #include "tusb.h"
 
+#include "hid_ack.h"
 #include "hid_reports.h"
+#include "stats.h"
+#include "usb_cdc.h"
+#include "usb_descriptors.h"
 
 #define USB_VID   0x1915 // Nordic Semiconductor
 #define USB_PID   0xEEEF // Nordic HID keyboard sample PID
@@ -21,15 +25,25 @@ tusb_desc_device_t const desc_device = {
   .bDescriptorType    = TUSB_DESC_DEVICE,
   .bcdUSB             = USB_BCD,
 
+#if PUSBKB_USB_CDC
+  // CDC needs an interface association descriptor, which needs the IAD
+  // device class.
+  .bDeviceClass       = TUSB_CLASS_MISC,
+  .bDeviceSubClass    = MISC_SUBCLASS_COMMON,
+  .bDeviceProtocol    = MISC_PROTOCOL_IAD,
+#else
   // Device class is specified per interface for HID
   .bDeviceClass       = 0x00,
   .bDeviceSubClass    = 0x00,
   .bDeviceProtocol    = 0x00,
+#endif
 
   .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
   .idVendor           = USB_VID,
   .idProduct          = USB_PID,
-  .bcdDevice          = 0x0100,
+  // Different interface sets get different release numbers, so Windows does
+  // not reuse cached driver bindings from the other layout.
+  .bcdDevice          = PUSBKB_USB_CDC ? 0x0101 : 0x0100,
 
   .iManufacturer      = 0x01,
   .iProduct           = 0x02,
@@ -50,53 +64,145 @@ uint8_t const * tud_descriptor_device_cb(void) {
 enum {
   ITF_NUM_HID_KEYBOARD = 0,
   ITF_NUM_HID_AUX,
+#if PUSBKB_HID_NKRO
+  ITF_NUM_HID_NKRO,
+#endif
+#if PUSBKB_USB_CDC
+  ITF_NUM_CDC,
+  ITF_NUM_CDC_DATA,
+#endif
   ITF_NUM_TOTAL
 };
 
 #define EPNUM_HID_KEYBOARD   0x81
 #define EPNUM_HID_AUX        0x82
-
-#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + 2 * TUD_HID_DESC_LEN)
+#define EPNUM_HID_NKRO       0x83
+#define EPNUM_CDC_NOTIF      0x84
+#define EPNUM_CDC_OUT        0x05
+#define EPNUM_CDC_IN         0x85
+
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN + \
+                             CFG_TUD_CDC * TUD_CDC_DESC_LEN)
+
+#if PUSBKB_HID_ACK
+// Standard keyboard LED output report, so the host reports its Lock states
+// back (hid_ack.h). Only declared when something listens.
+#define HID_KEYBOARD_LED_OUTPUT                                                \
+  0x05, 0x08,                     /* Usage Page (LEDs)                   */   \
+  0x19, 0x01,                     /* Usage Minimum (Num Lock)            */   \
+  0x29, 0x05,                     /* Usage Maximum (Kana)                */   \
+  0x15, 0x00,                     /* Logical Minimum (0)                 */   \
+  0x25, 0x01,                     /* Logical Maximum (1)                 */   \
+  0x75, 0x01,                     /* Report Size (1)                     */   \
+  0x95, 0x05,                     /* Report Count (5)                    */   \
+  0x91, 0x02,                     /* Output (Data, Var, Abs) LED bits    */   \
+  0x75, 0x03,                     /* Report Size (3)                     */   \
+  0x95, 0x01,                     /* Report Count (1)                    */   \
+  0x91, 0x01,                     /* Output (Const) padding              */
+#else
+#define HID_KEYBOARD_LED_OUTPUT
+#endif
+
+// Input items generated from the report tables in hid_reports.h. Every
+// usage and logical bound is written as a 2-byte item, which covers all the
+// tables (usages up to 0x3FF, signed bounds down to -127).
+#define HID_REPORT_TABLE_FIELD(name, page, umin, umax, lmin, lmax, bits, count, flags) \
+  HID_USAGE_PAGE   ( page ),                                                  \
+  HID_USAGE_MIN_N  ( umin, 2 ),                                               \
+  HID_USAGE_MAX_N  ( umax, 2 ),                                               \
+  HID_LOGICAL_MIN_N( lmin, 2 ),                                               \
+  HID_LOGICAL_MAX_N( lmax, 2 ),                                               \
+  HID_REPORT_SIZE  ( bits ),                                                  \
+  HID_REPORT_COUNT ( count ),                                                 \
+  HID_INPUT        ( flags ),
+#define HID_REPORT_TABLE_PAD(name, bits)                                      \
+  HID_REPORT_SIZE  ( bits ),                                                  \
+  HID_REPORT_COUNT ( 1 ),                                                     \
+  HID_INPUT        ( HID_CONSTANT ),
+#define HID_REPORT_TABLE(report) \
+  PUSBKB_REPORT_##report(HID_REPORT_TABLE_FIELD, HID_REPORT_TABLE_PAD)
 
 static uint8_t const desc_hid_report_keyboard[] = {
   // Keyboard report with Apple Fn in the reserved byte.
   // Reference: https://gist.github.com/fauxpark/010dcf5d6377c3a71ac98ce37414c6c4
-  0x05, 0x01,                     // Usage Page (Generic Desktop)
-  0x09, 0x06,                     // Usage (Keyboard)
-  0xA1, 0x01,                     // Collection (Application)
-  0x05, 0x07,                     // Usage Page (Key Codes)
-  0x19, 0xE0,                     // Usage Minimum (224)
-  0x29, 0xE7,                     // Usage Maximum (231)
-  0x15, 0x00,                     // Logical Minimum (0)
-  0x25, 0x01,                     // Logical Maximum (1)
-  0x75, 0x01,                     // Report Size (1)
-  0x95, 0x08,                     // Report Count (8)
-  0x81, 0x02,                     // Input (Data, Var, Abs) Modifier byte
-
-  0x05, 0xFF,                     // Usage Page (AppleVendor Top Case)
-  0x09, 0x03,                     // Usage (KeyboardFn)
-  0x15, 0x00,                     // Logical Minimum (0)
-  0x25, 0x01,                     // Logical Maximum (1)
-  0x75, 0x08,                     // Report Size (8)
-  0x95, 0x01,                     // Report Count (1)
-  0x81, 0x02,                     // Input (Data, Var, Abs) Apple Fn byte
-
-  0x95, 0x06,                     // Report Count (6)
-  0x75, 0x08,                     // Report Size (8)
-  0x15, 0x00,                     // Logical Minimum (0)
-  0x25, 0x65,                     // Logical Maximum (101)
-  0x05, 0x07,                     // Usage Page (Key Codes)
-  0x19, 0x00,                     // Usage Minimum (0)
-  0x29, 0x65,                     // Usage Maximum (101)
-  0x81, 0x00,                     // Input (Data, Array) Key array
-  0xC0                            // End Collection
+  HID_USAGE_PAGE   ( HID_USAGE_PAGE_DESKTOP ),
+  HID_USAGE        ( HID_USAGE_DESKTOP_KEYBOARD ),
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_TABLE( KEYBOARD )
+    HID_KEYBOARD_LED_OUTPUT
+  HID_COLLECTION_END
+};
+
+#if PUSBKB_HID_NKRO
+static uint8_t const desc_hid_report_nkro[] = {
+  HID_USAGE_PAGE   ( HID_USAGE_PAGE_DESKTOP ),
+  HID_USAGE        ( HID_USAGE_DESKTOP_KEYBOARD ),
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_TABLE( NKRO )
+    HID_KEYBOARD_LED_OUTPUT
+  HID_COLLECTION_END
 };
+#endif
 
 static uint8_t const desc_hid_report_aux[] = {
-  TUD_HID_REPORT_DESC_CONSUMER( HID_REPORT_ID(PUSBKB_REPORT_ID_CONSUMER) ),
+  HID_USAGE_PAGE   ( HID_USAGE_PAGE_CONSUMER ),
+  HID_USAGE        ( HID_USAGE_CONSUMER_CONTROL ),
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_ID  ( PUSBKB_REPORT_ID_CONSUMER )
+    HID_REPORT_TABLE( CONSUMER )
+  HID_COLLECTION_END,
+
+#if PUSBKB_HID_POINTER
+  HID_USAGE_PAGE   ( HID_USAGE_PAGE_DESKTOP ),
+  HID_USAGE        ( HID_USAGE_DESKTOP_MOUSE ),
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_ID  ( PUSBKB_REPORT_ID_MOUSE )
+    HID_USAGE      ( HID_USAGE_DESKTOP_POINTER ),
+    HID_COLLECTION ( HID_COLLECTION_PHYSICAL ),
+      HID_REPORT_TABLE( MOUSE )
+    HID_COLLECTION_END,
+  HID_COLLECTION_END,
+
+  HID_USAGE_PAGE   ( HID_USAGE_PAGE_DESKTOP ),
+  HID_USAGE        ( HID_USAGE_DESKTOP_MOUSE ),
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_ID  ( PUSBKB_REPORT_ID_ABSOLUTE )
+    HID_USAGE      ( HID_USAGE_DESKTOP_POINTER ),
+    HID_COLLECTION ( HID_COLLECTION_PHYSICAL ),
+      HID_REPORT_TABLE( ABSOLUTE )
+    HID_COLLECTION_END,
+  HID_COLLECTION_END,
+#endif
+
+#if PUSBKB_HID_SYSTEM
+  HID_USAGE_PAGE   ( HID_USAGE_PAGE_DESKTOP ),
+  HID_USAGE        ( HID_USAGE_DESKTOP_SYSTEM_CONTROL ),
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_ID  ( PUSBKB_REPORT_ID_SYSTEM )
+    HID_REPORT_TABLE( SYSTEM )
+  HID_COLLECTION_END,
+#endif
+
+  // Vendor feature report with the runtime counters (pusbkb_stats_t).
+  HID_USAGE_PAGE_N ( HID_USAGE_PAGE_VENDOR, 2 ),
+  HID_USAGE        ( 0x01 ),
+  HID_COLLECTION   ( HID_COLLECTION_APPLICATION ),
+    HID_REPORT_ID  ( PUSBKB_REPORT_ID_STATS )
+    HID_USAGE      ( 0x02 ),
+    HID_LOGICAL_MIN( 0x00 ),
+    HID_LOGICAL_MAX_N( 0xFF, 2 ),
+    HID_REPORT_SIZE( 8 ),
+    HID_REPORT_COUNT( sizeof(pusbkb_stats_t) ),
+    HID_FEATURE    ( HID_DATA | HID_VARIABLE | HID_ABSOLUTE ),
+  HID_COLLECTION_END,
 };
 
+#if PUSBKB_FAST_BOOT
+// In RAM, so the stored bInterval can be patched in before enumeration.
+uint8_t desc_fs_configuration[] = {
+#else
 uint8_t const desc_fs_configuration[] = {
+#endif
   // Config number, interface count, string index, total length, attribute, power in mA
   TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN,
                         TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
@@ -104,14 +210,43 @@ uint8_t const desc_fs_configuration[] = {
   // Interface number, string index, protocol, report descriptor len, EP addr, size, interval
   TUD_HID_DESCRIPTOR(ITF_NUM_HID_KEYBOARD, 4, HID_ITF_PROTOCOL_KEYBOARD,
                      sizeof(desc_hid_report_keyboard), EPNUM_HID_KEYBOARD,
-                     CFG_TUD_HID_EP_BUFSIZE, 10),
+                     PUSBKB_HID_EP_SIZE, PUSBKB_HID_INTERVAL_MS),
 
   // Aux HID interface (consumer reports).
   TUD_HID_DESCRIPTOR(ITF_NUM_HID_AUX, 5, HID_ITF_PROTOCOL_NONE,
                      sizeof(desc_hid_report_aux), EPNUM_HID_AUX,
-                     CFG_TUD_HID_EP_BUFSIZE, 10),
+                     PUSBKB_HID_EP_SIZE, PUSBKB_HID_INTERVAL_MS),
+
+#if PUSBKB_HID_NKRO
+  // NKRO keyboard (no boot protocol; the boot interface above stays for BIOS).
+  TUD_HID_DESCRIPTOR(ITF_NUM_HID_NKRO, 6, HID_ITF_PROTOCOL_NONE,
+                     sizeof(desc_hid_report_nkro), EPNUM_HID_NKRO,
+                     PUSBKB_HID_EP_SIZE, PUSBKB_HID_INTERVAL_MS),
+#endif
+
+#if PUSBKB_USB_CDC
+  // Control channel: interface number, string index, notification EP addr
+  // and size, data OUT/IN EP addrs, data EP size.
+  TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, 7, EPNUM_CDC_NOTIF, 8, EPNUM_CDC_OUT,
+                     EPNUM_CDC_IN, CFG_TUD_CDC_EP_BUFSIZE),
+#endif
 };
 
+#if PUSBKB_FAST_BOOT
+void usb_descriptors_set_hid_interval(uint8_t interval_ms) {
+  bool hid = false;
+  for (size_t i = 0; i + 1 < sizeof(desc_fs_configuration);
+       i += desc_fs_configuration[i]) {
+    uint8_t *desc = &desc_fs_configuration[i];
+    if (desc[1] == TUSB_DESC_INTERFACE) {
+      hid = desc[5] == TUSB_CLASS_HID;
+    } else if (desc[1] == TUSB_DESC_ENDPOINT && hid) {
+      desc[6] = interval_ms;
+    }
+  }
+}
+#endif
+
 uint8_t const * tud_descriptor_configuration_cb(uint8_t index) {
   (void) index;
   return desc_fs_configuration;
@@ -121,6 +256,11 @@ uint8_t const * tud_hid_descriptor_report_cb(uint8_t instance) {
   if (instance == PUSBKB_HID_ITF_KEYBOARD) {
     return desc_hid_report_keyboard;
   }
+#if PUSBKB_HID_NKRO
+  if (instance == PUSBKB_HID_ITF_NKRO) {
+    return desc_hid_report_nkro;
+  }
+#endif
   return desc_hid_report_aux;
 }
 
@@ -135,6 +275,8 @@ char const* string_desc_arr [] = {
   "000000000001",                // 3: Serials (placeholder)
   "Nordic HID Keyboard",         // 4: HID Interface (keyboard)
   "Nordic HID Keyboard Aux",     // 5: HID Interface (consumer)
+  "Nordic HID Keyboard NKRO",    // 6: HID Interface (NKRO keyboard)
+  "Nordic HID Keyboard Control", // 7: CDC Interface (control channel)
 };
 
 static uint16_t _desc_str[32];
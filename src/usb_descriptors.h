@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// bInterval for the HID interrupt IN endpoints (full-speed: 1 unit = 1 ms).
+#ifndef PUSBKB_HID_INTERVAL_MS
+#define PUSBKB_HID_INTERVAL_MS 10
+#endif
+
+#ifndef PUSBKB_FAST_BOOT
+#define PUSBKB_FAST_BOOT 0
+#endif
+
+#if PUSBKB_FAST_BOOT
+// Replaces the HID endpoints' bInterval with a stored one (1-255 ms). Only
+// before tud_init(): the host reads it once, at enumeration.
+void usb_descriptors_set_hid_interval(uint8_t interval_ms);
+#endif
+
+#ifdef __cplusplus
+}
+#endif